@@ -19,7 +19,7 @@
 
 
 //#include "LokiExport.h"
-//#include "Threads.h"
+#include "Threads.h"
 #include <algorithm>
 #include <stdexcept>
 #include <cassert>
@@ -28,6 +28,18 @@
 #include <vector>
 #include <list>
 #include <memory>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <initializer_list>
+#include <map>
+#include <string>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #ifdef _MSC_VER
 #define LOKI_C_CALLING_CONVENTION_QUALIFIER __cdecl 
@@ -35,6 +47,19 @@
 #define LOKI_C_CALLING_CONVENTION_QUALIFIER 
 #endif
 
+/// \def LOKI_CACHE_LINE_SIZE
+/// Alignment used to keep objects written by different threads on
+/// different cache lines.
+#ifndef LOKI_CACHE_LINE_SIZE
+#define LOKI_CACHE_LINE_SIZE 64
+#endif
+
+/// \def LOKI_SINGLETON_ARENA_SIZE
+/// Bytes of static storage available to CreateInArena.
+#ifndef LOKI_SINGLETON_ARENA_SIZE
+#define LOKI_SINGLETON_ARENA_SIZE 65536
+#endif
+
 ///  \defgroup  SingletonGroup Singleton
 ///  \defgroup  CreationGroup Creation policies
 ///  \ingroup   SingletonGroup
@@ -54,6 +79,143 @@ namespace Loki
 {
     typedef void (LOKI_C_CALLING_CONVENTION_QUALIFIER *atexit_pfn_t)();
 
+    namespace Private
+    {
+
+        ////////////////////////////////////////////////////////////////////////////////
+        // class LifetimeTracker
+        // Helper class for SetLongevity
+        ////////////////////////////////////////////////////////////////////////////////
+
+        class LifetimeTracker
+        {
+        public:
+            LifetimeTracker(unsigned int x) : longevity_(x) 
+            {}
+            
+            virtual ~LifetimeTracker() = 0;
+            
+            static bool Compare(const LifetimeTracker* lhs,
+                const LifetimeTracker* rhs)
+            {
+                return lhs->longevity_ > rhs->longevity_;
+            }
+            
+        private:
+            unsigned int longevity_;
+        };
+        
+        // Definition required
+        inline LifetimeTracker::~LifetimeTracker() {} 
+
+        // Helper data
+        // std::list because of the inserts
+        typedef std::list<LifetimeTracker*> TrackerArray;
+        inline TrackerArray* pTrackerArray = 0;
+        // SetLongevity may run on several threads during eager startup
+        inline std::mutex trackerMutex;
+
+        // Helper destroyer function
+        template <typename T>
+        struct Deleter
+        {
+            typedef void (*Type)(T*);
+            static void Delete(T* pObj)
+            { delete pObj; }
+        };
+
+        // Concrete lifetime tracker for objects of type T
+        template <typename T, typename Destroyer>
+        class ConcreteLifetimeTracker : public LifetimeTracker
+        {
+        public:
+            ConcreteLifetimeTracker(T* p,unsigned int longevity, Destroyer d)
+                : LifetimeTracker(longevity)
+                , pTracked_(p)
+                , destroyer_(d)
+            {}
+            
+            ~ConcreteLifetimeTracker()
+            { destroyer_(pTracked_); }
+            
+        private:
+            T* pTracked_;
+            Destroyer destroyer_;
+        };
+
+        ///  Destroys the tracked object with the lowest longevity
+        inline void LOKI_C_CALLING_CONVENTION_QUALIFIER AtExitFn()
+        {
+            LifetimeTracker* pTop = 0;
+            {
+                std::lock_guard<std::mutex> guard(trackerMutex);
+                assert(pTrackerArray!=0 && !pTrackerArray->empty());
+                // Pick the element at the top of the stack
+                pTop = pTrackerArray->back();
+                // Remove that object off the stack _before_ deleting pTop
+                pTrackerArray->pop_back();
+                // Destroy stack when it's empty
+                if(pTrackerArray->empty())
+                {
+                    delete pTrackerArray;
+                    pTrackerArray = 0;
+                }
+            }
+            // Destroy the element outside the lock, its destructor may well
+            // use other singletons
+            delete pTop;
+        }
+
+    } // namespace Private
+
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \ingroup LifetimeGroup 
+    ///  
+    ///  Assigns an object a longevity; ensures ordered destructions of objects 
+    ///  registered thusly during the exit sequence of the application
+    ////////////////////////////////////////////////////////////////////////////////
+
+    template <typename T, typename Destroyer>
+    void SetLongevity(T* pDynObject, unsigned int longevity,
+        Destroyer d)
+    {
+        using namespace Private;
+
+        // automatically delete the ConcreteLifetimeTracker object when a exception is thrown
+        std::unique_ptr<LifetimeTracker> 
+            p( new ConcreteLifetimeTracker<T, Destroyer>(pDynObject, longevity, d) );
+
+        {
+            std::lock_guard<std::mutex> guard(trackerMutex);
+            // manage lifetime of stack manually
+            if(pTrackerArray==0)
+                pTrackerArray = new TrackerArray;
+
+            // Find correct position
+            TrackerArray::iterator pos = std::upper_bound(
+                pTrackerArray->begin(), 
+                pTrackerArray->end(), 
+                p.get(), 
+                LifetimeTracker::Compare);
+            
+            // Insert the pointer to the ConcreteLifetimeTracker object into the queue
+            pTrackerArray->insert(pos, p.get());
+        }
+        
+        // nothing has thrown: don't delete the ConcreteLifetimeTracker object
+        p.release();
+        
+        // Register a call to AtExitFn
+        std::atexit(Private::AtExitFn);
+    }
+
+    template <typename T>
+    void SetLongevity(T* pDynObject, unsigned int longevity,
+        typename Private::Deleter<T>::Type d = Private::Deleter<T>::Delete)
+    {
+        SetLongevity<T, typename Private::Deleter<T>::Type>(pDynObject, longevity, d);
+    }
+
     ////////////////////////////////////////////////////////////////////////////////
     ///  \struct CreateUsingNew 
     ///
@@ -174,6 +336,76 @@ namespace Loki
         }
     };
 
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \class SingletonArena
+    ///
+    ///  \ingroup CreationGroup
+    ///  Static, cache-line-aligned storage shared by all CreateInArena
+    ///  singletons.  Reserve hands out whole cache lines from a bump pointer,
+    ///  so no two singletons share a line and none shares one with unrelated
+    ///  heap data.  The storage lives in .bss: it needs no allocation, is
+    ///  usable during static initialization, and only pages which are used
+    ///  become resident.  Memory is never returned.
+    ////////////////////////////////////////////////////////////////////////////////
+    class SingletonArena
+    {
+    public:
+        ///  Returns size bytes starting on a cache line, or throws
+        ///  std::bad_alloc if LOKI_SINGLETON_ARENA_SIZE is exhausted.
+        static void* Reserve(std::size_t size)
+        {
+            const std::size_t bytes = (size + LOKI_CACHE_LINE_SIZE - 1)
+                / LOKI_CACHE_LINE_SIZE * LOKI_CACHE_LINE_SIZE;
+            std::size_t offset = used_.load(std::memory_order_relaxed);
+            do
+            {
+                if (bytes > LOKI_SINGLETON_ARENA_SIZE - offset)
+                    throw std::bad_alloc();
+            }
+            while (!used_.compare_exchange_weak(offset, offset + bytes,
+                std::memory_order_relaxed));
+            return storage_ + offset;
+        }
+
+        ///  Returns # of bytes reserved so far
+        static std::size_t Used()
+        { return used_.load(std::memory_order_relaxed); }
+
+    private:
+        alignas(LOKI_CACHE_LINE_SIZE)
+            inline static unsigned char storage_[LOKI_SINGLETON_ARENA_SIZE];
+        inline static std::atomic<std::size_t> used_{0};
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \struct CreateInArena
+    ///
+    ///  \ingroup CreationGroup
+    ///  Implementation of the CreationPolicy used by SingletonHolder
+    ///  Creates objects in SingletonArena, so hot singletons sit on their own
+    ///  cache lines instead of wherever the heap puts them.  Each type gets
+    ///  its slot on first creation and keeps it, so a singleton recreated by
+    ///  PhoenixSingleton or DeletableSingleton reuses the same lines.
+    ///  Destruction order is left to the lifetime policy; combine with
+    ///  SingletonWithLongevity to control it.
+    ////////////////////////////////////////////////////////////////////////////////
+    template <class T> struct CreateInArena
+    {
+        static_assert(alignof(T) <= LOKI_CACHE_LINE_SIZE,
+            "CreateInArena only aligns to LOKI_CACHE_LINE_SIZE");
+
+        static T* Create()
+        {
+            static void* const slot = SingletonArena::Reserve(sizeof(T));
+            return new(slot) T;
+        }
+        
+        static void Destroy(T* p)
+        {
+            p->~T();
+        }
+    };
+
     ////////////////////////////////////////////////////////////////////////////////
     ///  \struct DefaultLifetime
     ///
@@ -302,6 +534,39 @@ namespace Loki
     template <class T>
     bool DeletableSingleton<T>::needCallback = true;
 
+    namespace Private 
+    {
+        template <class T>
+        struct Adapter
+        {
+            void operator()(T*) { return pFun_(); }
+            atexit_pfn_t pFun_;
+        };
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \struct  SingletonWithLongevity
+    ///
+    ///  \ingroup LifetimeGroup
+    ///  Implementation of the LifetimePolicy used by SingletonHolder
+    ///  Schedules an object's destruction in order of their longevities
+    ///  Assumes a visible function GetLongevity(T*) that returns the longevity of the
+    ///  object.  Objects with a lower longevity are destroyed first.
+    ////////////////////////////////////////////////////////////////////////////////
+    template <class T>
+    class SingletonWithLongevity
+    {
+    public:
+        static void ScheduleDestruction(T* pObj, atexit_pfn_t pFun)
+        {
+            Private::Adapter<T> adapter = { pFun };
+            SetLongevity(pObj, GetLongevity(pObj), adapter);
+        }
+        
+        static void OnDeadReference()
+        { throw std::logic_error("Dead Reference Detected"); }
+    };
+
     ////////////////////////////////////////////////////////////////////////////////
     ///  \struct NoDestroy
     ///
@@ -332,12 +597,23 @@ namespace Loki
     ///  \param LifetimePolicy Lifetime policy, default: DefaultLifetime,
     ///  \param ThreadingModel Threading policy, 
     ///                         default: LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL
+    ///  \param MutexPolicy Mutex used by the threading policy,
+    ///                         default: LOKI_DEFAULT_MUTEX
+    ///
+    ///  \par Thread safety
+    ///  With ClassLevelLockable, Instance() is a double-checked lock: the
+    ///  pointer is read with an acquire load, and only while it is still null
+    ///  does MakeInstance take the class-level lock, check again, construct and
+    ///  publish the object with a release store.  After the first construction
+    ///  every call is one load and one branch.
     ////////////////////////////////////////////////////////////////////////////////
     template
     <
         typename T,
         template <class> class CreationPolicy = CreateStatic,//CreateUsingNew,
-        template <class> class LifetimePolicy = PhoenixSingleton//DefaultLifetime
+        template <class> class LifetimePolicy = PhoenixSingleton,//DefaultLifetime
+        template <class, class> class ThreadingModel = LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+        class MutexPolicy = LOKI_DEFAULT_MUTEX
     >
     class SingletonHolder
     {
@@ -358,7 +634,8 @@ namespace Loki
         SingletonHolder();
         
         // Data
-        typedef T * PtrInstanceType;
+        typedef ThreadingModel<T*, MutexPolicy> PtrThreadingModel;
+        typedef typename PtrThreadingModel::VolatileType PtrInstanceType;
         static PtrInstanceType pInstance_;
         static bool destroyed_;
     };
@@ -371,18 +648,22 @@ namespace Loki
     <
         class T,
         template <class> class C,
-        template <class> class L
+        template <class> class L,
+        template <class, class> class M,
+        class X
     >
-    typename SingletonHolder<T, C, L>::PtrInstanceType
-        SingletonHolder<T, C, L>::pInstance_ = 0;
+    typename SingletonHolder<T, C, L, M, X>::PtrInstanceType
+        SingletonHolder<T, C, L, M, X>::pInstance_{};
 
     template
     <
         class T,
         template <class> class C,
-        template <class> class L
+        template <class> class L,
+        template <class, class> class M,
+        class X
     >
-    bool SingletonHolder<T, C, L>::destroyed_ = false;
+    bool SingletonHolder<T, C, L, M, X>::destroyed_ = false;
 
     ////////////////////////////////////////////////////////////////////////////////
     // SingletonHolder::Instance
@@ -392,15 +673,20 @@ namespace Loki
     <
         class T,
         template <class> class CreationPolicy,
-        template <class> class LifetimePolicy
+        template <class> class LifetimePolicy,
+        template <class, class> class ThreadingModel,
+        class MutexPolicy
     >
-    inline T& SingletonHolder<T, CreationPolicy, LifetimePolicy>::Instance()
+    inline T& SingletonHolder<T, CreationPolicy, LifetimePolicy, ThreadingModel,
+        MutexPolicy>::Instance()
     {
-        if (!pInstance_)
+        T* p = PtrThreadingModel::Load(pInstance_);
+        if (!p)
         {
             MakeInstance();
+            p = PtrThreadingModel::Load(pInstance_);
         }
-        return *pInstance_;
+        return *p;
     }
 
     ////////////////////////////////////////////////////////////////////////////////
@@ -411,19 +697,27 @@ namespace Loki
     <
         class T,
         template <class> class CreationPolicy,
-        template <class> class LifetimePolicy
+        template <class> class LifetimePolicy,
+        template <class, class> class ThreadingModel,
+        class MutexPolicy
     >
-    void SingletonHolder<T, CreationPolicy, LifetimePolicy>::MakeInstance()
+    void SingletonHolder<T, CreationPolicy, LifetimePolicy, ThreadingModel,
+        MutexPolicy>::MakeInstance()
     {
-        if (!pInstance_)
+        typename ThreadingModel<SingletonHolder, MutexPolicy>::Lock guard;
+        (void)guard;
+
+        if (!PtrThreadingModel::Load(pInstance_))
         {
             if (destroyed_)
             {
                 destroyed_ = false;
                 LifetimePolicy<T>::OnDeadReference();
             }
-            pInstance_ = CreationPolicy<T>::Create();
-            LifetimePolicy<T>::ScheduleDestruction(pInstance_, 
+            T* p = CreationPolicy<T>::Create();
+            // Publish only the fully constructed object.
+            PtrThreadingModel::Store(pInstance_, p);
+            LifetimePolicy<T>::ScheduleDestruction(p, 
                 &DestroySingleton);
         }
     }
@@ -432,18 +726,458 @@ namespace Loki
     <
         class T,
         template <class> class CreationPolicy,
-        template <class> class L
+        template <class> class L,
+        template <class, class> class M,
+        class X
     >
     void LOKI_C_CALLING_CONVENTION_QUALIFIER 
-    SingletonHolder<T, CreationPolicy, L>::DestroySingleton()
+    SingletonHolder<T, CreationPolicy, L, M, X>::DestroySingleton()
     {
         assert(!destroyed_);
-        CreationPolicy<T>::Destroy(pInstance_);
-        pInstance_ = 0;
+        CreationPolicy<T>::Destroy(PtrThreadingModel::Load(pInstance_));
+        PtrThreadingModel::Store(pInstance_, 0);
         destroyed_ = true;
     }
 
 
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \class  ThreadLocalSingletonHolder
+    ///
+    ///  \ingroup SingletonGroup
+    ///
+    ///  Provides one instance of T per thread.  Meant for caches and counters
+    ///  which every thread hits, where a shared instance would bounce its
+    ///  cache line between cores.  Instance() reads a thread_local pointer and
+    ///  never locks; the first call on each thread creates the object and
+    ///  registers it, and it is destroyed when the thread exits.
+    ///
+    ///  \param CreationPolicy Creation policy, default: CreateUsingNew
+    ///
+    ///  \par Aggregation
+    ///  Accumulate folds op over the instances of all running threads, under
+    ///  a lock which only excludes thread start-up and exit.  The owners keep
+    ///  writing meanwhile, so T must be safe to read concurrently (relaxed
+    ///  atomics for counters).  Whatever a thread held is gone once it exits;
+    ///  use ShardedSingletonHolder for totals which must outlive threads.
+    ////////////////////////////////////////////////////////////////////////////////
+    template
+    <
+        typename T,
+        template <class> class CreationPolicy = CreateUsingNew
+    >
+    class ThreadLocalSingletonHolder
+    {
+    public:
+
+        ///  Type of the singleton object
+        typedef T ObjectType;
+
+        ///  Returns a reference to the calling thread's object
+        static T& Instance()
+        {
+            if (!pInstance_)
+            {
+                MakeInstance();
+            }
+            return *pInstance_;
+        }
+
+        ///  Folds op(result, const T&) over the objects of all live threads
+        template <class R, class BinaryOp>
+        static R Accumulate(R init, BinaryOp op)
+        {
+            typename ClassLevelLockable<ThreadLocalSingletonHolder>::Lock guard;
+            (void)guard;
+            for (T* p : Registry())
+                init = op(init, *p);
+            return init;
+        }
+
+    private:
+        typedef std::list<T*> RegistryType;
+
+        ///  Destroys the thread's object when the thread exits
+        struct ThreadSlot
+        {
+            typename RegistryType::iterator pos_;
+
+            ~ThreadSlot()
+            {
+                if (!pInstance_)
+                    return;
+                {
+                    typename ClassLevelLockable<ThreadLocalSingletonHolder>::Lock guard;
+                    (void)guard;
+                    Registry().erase(pos_);
+                }
+                CreationPolicy<T>::Destroy(pInstance_);
+                pInstance_ = 0;
+            }
+        };
+
+        // Never destroyed: threads may exit after static destructors ran.
+        static RegistryType& Registry()
+        {
+            static RegistryType* registry = new RegistryType;
+            return *registry;
+        }
+
+        static void MakeInstance()
+        {
+            static thread_local ThreadSlot slot;
+            T* p = CreationPolicy<T>::Create();
+            {
+                typename ClassLevelLockable<ThreadLocalSingletonHolder>::Lock guard;
+                (void)guard;
+                slot.pos_ = Registry().insert(Registry().end(), p);
+            }
+            pInstance_ = p;
+        }
+
+        // Protection
+        ThreadLocalSingletonHolder();
+
+        // Data
+        inline static thread_local T* pInstance_ = 0;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \class  ShardedSingletonHolder
+    ///
+    ///  \ingroup SingletonGroup
+    ///
+    ///  Provides one instance of T per CPU.  All shards are created together
+    ///  by the first call, each on its own cache line, and Instance() returns
+    ///  the shard of the CPU the caller runs on (sched_getcpu on Linux, shard
+    ///  zero elsewhere).  A thread can migrate right after picking its shard,
+    ///  so two threads may still share one: T must be thread-safe, sharding
+    ///  only keeps that rare.
+    ///
+    ///  \param LifetimePolicy Lifetime policy, default: DefaultLifetime
+    ///
+    ///  \par Aggregation
+    ///  Accumulate folds op(result, const T&) over every shard, e.g. to sum
+    ///  per-CPU counters on read.
+    ////////////////////////////////////////////////////////////////////////////////
+    template
+    <
+        typename T,
+        template <class> class LifetimePolicy = DefaultLifetime
+    >
+    class ShardedSingletonHolder
+    {
+    public:
+
+        ///  Type of the singleton object
+        typedef T ObjectType;
+
+        ///  Returns a reference to the calling CPU's shard
+        static T& Instance()
+        {
+            Slot* shards = pShards_.load(std::memory_order_acquire);
+            if (!shards)
+            {
+                MakeInstance();
+                shards = pShards_.load(std::memory_order_acquire);
+            }
+            return shards[CurrentCpu() & shardMask_].object_;
+        }
+
+        ///  Folds op(result, const T&) over all shards
+        template <class R, class BinaryOp>
+        static R Accumulate(R init, BinaryOp op)
+        {
+            Slot* shards = pShards_.load(std::memory_order_acquire);
+            if (!shards)
+            {
+                MakeInstance();
+                shards = pShards_.load(std::memory_order_acquire);
+            }
+            for (std::size_t i = 0; i <= shardMask_; ++i)
+                init = op(init, static_cast<const T&>(shards[i].object_));
+            return init;
+        }
+
+    private:
+        struct alignas(LOKI_CACHE_LINE_SIZE) Slot
+        {
+            T object_;
+        };
+
+        static unsigned CurrentCpu()
+        {
+#ifdef __linux__
+            const int cpu = sched_getcpu();
+            return cpu < 0 ? 0 : static_cast<unsigned>(cpu);
+#else
+            return 0;
+#endif
+        }
+
+        static void MakeInstance()
+        {
+            typename ClassLevelLockable<ShardedSingletonHolder>::Lock guard;
+            (void)guard;
+
+            if (!pShards_.load(std::memory_order_acquire))
+            {
+                if (destroyed_)
+                {
+                    destroyed_ = false;
+                    LifetimePolicy<T>::OnDeadReference();
+                }
+                // Round up to a power of two so that Instance() can mask.
+                std::size_t count = 1;
+                const std::size_t cpus = std::thread::hardware_concurrency();
+                while (count < cpus)
+                    count <<= 1;
+                Slot* shards = new Slot[count];
+                shardMask_ = count - 1;
+                pShards_.store(shards, std::memory_order_release);
+                LifetimePolicy<T>::ScheduleDestruction(&shards[0].object_,
+                    &DestroySingleton);
+            }
+        }
+
+        static void LOKI_C_CALLING_CONVENTION_QUALIFIER DestroySingleton()
+        {
+            assert(!destroyed_);
+            delete [] pShards_.exchange(0, std::memory_order_acq_rel);
+            destroyed_ = true;
+        }
+
+        // Protection
+        ShardedSingletonHolder();
+
+        // Data
+        inline static std::atomic<Slot*> pShards_{0};
+        inline static std::size_t shardMask_ = 0;
+        inline static bool destroyed_ = false;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \class  SingletonStartup
+    ///
+    ///  \ingroup SingletonGroup
+    ///
+    ///  Registry of singletons which are constructed eagerly at start-up
+    ///  instead of on their first Instance() call, so that the first request
+    ///  after a deploy does not pay for big tables or allocator pools.
+    ///
+    ///  Each entry has a name and the names it depends on.  InitializeAll
+    ///  constructs every entry after its dependencies, running independent
+    ///  entries on several threads.  Since dependencies are created and
+    ///  scheduled for destruction first, DefaultLifetime destroys them last;
+    ///  SingletonWithLongevity orders destruction by longevity as usual.
+    ///
+    ///  \par Usage
+    ///  \code
+    ///  typedef SingletonHolder<Pools> PoolsHolder;
+    ///  typedef SingletonHolder<Tables> TablesHolder;
+    ///  static EagerSingleton<PoolsHolder> pools("pools");
+    ///  static EagerSingleton<TablesHolder> tables("tables", {"pools"});
+    ///  int main() { SingletonStartup::InitializeAll(); ... }
+    ///  \endcode
+    ///
+    ///  Singletons which touch an undeclared dependency from their constructor
+    ///  may race with it; declare it, or use ClassLevelLockable for both.
+    ////////////////////////////////////////////////////////////////////////////////
+    class SingletonStartup
+    {
+    public:
+        ///  Adds a singleton to the registry.  Usually called during static
+        ///  initialization through EagerSingleton.
+        static void Register(const char* name, atexit_pfn_t init,
+            std::initializer_list<const char*> dependsOn)
+        {
+            std::lock_guard<std::mutex> guard(Mutex());
+            Entry entry = { name, init, std::vector<std::string>(
+                dependsOn.begin(), dependsOn.end()), false };
+            Entries().push_back(entry);
+        }
+
+        ///  Constructs every registered singleton not constructed yet, using
+        ///  up to threads threads (0 means one per CPU).  Throws
+        ///  std::logic_error for unknown or cyclic dependencies, and rethrows
+        ///  the first exception thrown by a constructor.
+        static void InitializeAll(unsigned int threads = 0)
+        {
+            std::lock_guard<std::mutex> guard(Mutex());
+            std::vector<Entry>& entries = Entries();
+            const std::size_t count = entries.size();
+
+            std::map<std::string, std::size_t> byName;
+            for (std::size_t i = 0; i < count; ++i)
+                if (!byName.insert(std::make_pair(entries[i].name_, i)).second)
+                    throw std::logic_error("Duplicate singleton: " + entries[i].name_);
+
+            std::vector<std::size_t> waitingFor(count, 0);
+            std::vector<std::vector<std::size_t> > dependents(count);
+            std::vector<std::size_t> ready;
+            std::size_t pending = 0;
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                if (entries[i].done_)
+                    continue;
+                ++pending;
+                for (const std::string& dep : entries[i].dependsOn_)
+                {
+                    std::map<std::string, std::size_t>::const_iterator it =
+                        byName.find(dep);
+                    if (it == byName.end())
+                        throw std::logic_error("Unknown singleton dependency: "
+                            + entries[i].name_ + " -> " + dep);
+                    if (entries[it->second].done_)
+                        continue;
+                    ++waitingFor[i];
+                    dependents[it->second].push_back(i);
+                }
+                if (0 == waitingFor[i])
+                    ready.push_back(i);
+            }
+            if (0 == pending)
+                return;
+            CheckAcyclic(waitingFor, dependents, ready, pending);
+
+            if (0 == threads)
+                threads = std::thread::hardware_concurrency();
+            if (threads > pending)
+                threads = static_cast<unsigned int>(pending);
+
+            Scheduler scheduler = { entries, waitingFor, dependents, ready,
+                pending, {}, {}, {} };
+            std::vector<std::thread> workers;
+            for (unsigned int i = 1; i < threads; ++i)
+                workers.emplace_back(&Scheduler::Run, &scheduler);
+            scheduler.Run();
+            for (std::thread& worker : workers)
+                worker.join();
+            if (scheduler.error_)
+                std::rethrow_exception(scheduler.error_);
+        }
+
+    private:
+        struct Entry
+        {
+            std::string name_;
+            atexit_pfn_t init_;
+            std::vector<std::string> dependsOn_;
+            bool done_;
+        };
+
+        ///  Hands out entries whose dependencies are done to worker threads
+        struct Scheduler
+        {
+            std::vector<Entry>& entries_;
+            std::vector<std::size_t>& waitingFor_;
+            const std::vector<std::vector<std::size_t> >& dependents_;
+            std::vector<std::size_t>& ready_;
+            std::size_t pending_;
+            std::exception_ptr error_;
+            std::mutex mutex_;
+            std::condition_variable changed_;
+
+            void Run()
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                for (;;)
+                {
+                    changed_.wait(lock, [this] {
+                        return !ready_.empty() || 0 == pending_ || error_; });
+                    if (0 == pending_ || error_)
+                        return;
+                    const std::size_t index = ready_.back();
+                    ready_.pop_back();
+                    lock.unlock();
+                    std::exception_ptr error;
+                    try
+                    {
+                        entries_[index].init_();
+                    }
+                    catch (...)
+                    {
+                        error = std::current_exception();
+                    }
+                    lock.lock();
+                    if (error)
+                    {
+                        if (!error_)
+                            error_ = error;
+                    }
+                    else
+                    {
+                        entries_[index].done_ = true;
+                        --pending_;
+                        for (std::size_t dependent : dependents_[index])
+                            if (0 == --waitingFor_[dependent])
+                                ready_.push_back(dependent);
+                    }
+                    changed_.notify_all();
+                }
+            }
+        };
+
+        ///  Kahn's algorithm on copies, so that a cycle is reported instead of
+        ///  leaving the workers waiting forever.
+        static void CheckAcyclic(std::vector<std::size_t> waitingFor,
+            const std::vector<std::vector<std::size_t> >& dependents,
+            std::vector<std::size_t> ready, std::size_t pending)
+        {
+            while (!ready.empty())
+            {
+                const std::size_t index = ready.back();
+                ready.pop_back();
+                --pending;
+                for (std::size_t dependent : dependents[index])
+                    if (0 == --waitingFor[dependent])
+                        ready.push_back(dependent);
+            }
+            if (0 != pending)
+                throw std::logic_error("Cyclic singleton dependencies");
+        }
+
+        // Both are used during static initialization, hence function statics
+        static std::vector<Entry>& Entries()
+        {
+            static std::vector<Entry> entries;
+            return entries;
+        }
+
+        static std::mutex& Mutex()
+        {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        // Protection
+        SingletonStartup();
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \class  EagerSingleton
+    ///
+    ///  \ingroup SingletonGroup
+    ///
+    ///  Registers SHolder (a SingletonHolder or any class with a static
+    ///  Instance()) with SingletonStartup.  Define one at namespace scope.
+    ////////////////////////////////////////////////////////////////////////////////
+    template <class SHolder>
+    class EagerSingleton
+    {
+    public:
+        explicit EagerSingleton(const char* name,
+            std::initializer_list<const char*> dependsOn = {})
+        {
+            SingletonStartup::Register(name, &Initialize, dependsOn);
+        }
+
+    private:
+        static void LOKI_C_CALLING_CONVENTION_QUALIFIER Initialize()
+        {
+            SHolder::Instance();
+        }
+    };
+
     ////////////////////////////////////////////////////////////////////////////////
     ///  \class  Singleton
     ///
@@ -21,16 +21,104 @@
 //#define DO_EXTRA_LOKI_TESTS
 //#define USE_NEW_TO_ALLOCATE
 //#define LOKI_CHECK_FOR_CORRUPTION
+//#define LOKI_HARDENED_CHUNKS
+
+#ifndef LOKI_HARDENED_SAMPLE_INTERVAL
+    /// # of deallocations between sampled full-Chunk checks in hardened mode.
+    #define LOKI_HARDENED_SAMPLE_INTERVAL 64
+#endif
 
 #ifdef DO_EXTRA_LOKI_TESTS
     #include <iostream>
 #endif
 
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
 #include "smallobj.h"
 
 namespace Loki
 {
 
+// DefaultCorruptionHandler ---------------------------------------------------
+
+static void DefaultCorruptionHandler( const void * p, const char * what )
+{
+    std::fprintf( stderr, "Loki::FixedAllocator: %s at %p\n", what, p );
+    std::abort();
+}
+
+static FixedAllocator::CorruptionHandler corruptionHandler = DefaultCorruptionHandler;
+
+// ReportCorruption -----------------------------------------------------------
+
+static void ReportCorruption( const void * p, const char * what )
+{
+    corruptionHandler( p, what );
+}
+
+#ifdef LOKI_HARDENED_CHUNKS
+
+// BlockKey -------------------------------------------------------------------
+/** @ingroup SmallObjectGroupInternal
+ Mixes the address of a block with a per-process secret.  The top byte keys
+ the stealth index and the next byte is the canary, so neither can be forged
+ by writing a constant into every freed block.
+ */
+static inline std::uint64_t BlockKey( const unsigned char * block )
+{
+    static const std::uint64_t secret =
+        reinterpret_cast< std::uintptr_t >( &secret ) * 0x9E3779B97F4A7C15ULL;
+    return ( reinterpret_cast< std::uintptr_t >( block ) ^ secret )
+        * 0xBF58476D1CE4E5B9ULL;
+}
+
+#endif
+
+// Chunk::StoreIndex ----------------------------------------------------------
+
+inline void Chunk::StoreIndex( unsigned char * block, unsigned char index,
+    std::size_t blockSize )
+{
+#ifdef LOKI_HARDENED_CHUNKS
+    const std::uint64_t key = BlockKey( block );
+    *block = index ^ static_cast< unsigned char >( key >> 56 );
+    if ( 1 < blockSize )
+        block[ 1 ] = static_cast< unsigned char >( key >> 48 );
+#else
+    (void) blockSize;
+    *block = index;
+#endif
+}
+
+// Chunk::LoadIndex -----------------------------------------------------------
+
+inline unsigned char Chunk::LoadIndex( const unsigned char * block )
+{
+#ifdef LOKI_HARDENED_CHUNKS
+    return *block ^ static_cast< unsigned char >( BlockKey( block ) >> 56 );
+#else
+    return *block;
+#endif
+}
+
+// Chunk::HasCanary -----------------------------------------------------------
+
+inline bool Chunk::HasCanary( const unsigned char * block, std::size_t blockSize )
+{
+#ifdef LOKI_HARDENED_CHUNKS
+    return ( blockSize < 2 ) ||
+        ( block[ 1 ] == static_cast< unsigned char >( BlockKey( block ) >> 48 ) );
+#else
+    (void) block;
+    (void) blockSize;
+    return true;
+#endif
+}
+
 // Chunk::Init ----------------------------------------------------------------
 
 bool Chunk::Init( std::size_t blockSize, unsigned char blocks )
@@ -71,7 +159,7 @@ void Chunk::Reset(std::size_t blockSize, unsigned char blocks)
     unsigned char i = 0;
     for ( unsigned char * p = pData_; i != blocks; p += blockSize )
     {
-        *p = ++i;
+        StoreIndex( p, ++i, blockSize );
     }
 }
 
@@ -96,7 +184,22 @@ void* Chunk::Allocate(std::size_t blockSize)
     assert((firstAvailableBlock_ * blockSize) / blockSize == 
         firstAvailableBlock_);
     unsigned char * pResult = pData_ + (firstAvailableBlock_ * blockSize);
-    firstAvailableBlock_ = *pResult;
+    if ( !HasCanary( pResult, blockSize ) )
+    {
+        // Something wrote into this block after it was deallocated, so its
+        // stealth index can't be trusted either.  Quarantine the rest of
+        // this Chunk instead of handing the block out.
+        ReportCorruption( pResult, "write after free" );
+        blocksAvailable_ = 0;
+        return NULL;
+    }
+    firstAvailableBlock_ = LoadIndex( pResult );
+#ifdef LOKI_HARDENED_CHUNKS
+    // Spoil the canary so that a block in use only looks deallocated when
+    // its owner happens to write the canary byte itself.
+    if ( 1 < blockSize )
+        pResult[ 1 ] = ~pResult[ 1 ];
+#endif
     --blocksAvailable_;
 
     return pResult;
@@ -122,7 +225,7 @@ void Chunk::Deallocate(void* p, std::size_t blockSize)
         assert( firstAvailableBlock_ != index );
 #endif
 
-    *toRelease = firstAvailableBlock_;
+    StoreIndex( toRelease, firstAvailableBlock_, blockSize );
     firstAvailableBlock_ = index;
     // Truncation check
     assert(firstAvailableBlock_ == (toRelease - pData_) / blockSize);
@@ -198,7 +301,7 @@ bool Chunk::IsCorrupt( unsigned char numBlocks, std::size_t blockSize,
         if ( cc >= blocksAvailable_ )
             // Successfully counted off number of nodes in linked-list.
             break;
-        index = *nextBlock;
+        index = LoadIndex( nextBlock );
         if ( numBlocks <= index )
         {
             /* This catches Type 1 corruptions as shown in above comments.
@@ -265,7 +368,7 @@ bool Chunk::IsBlockAvailable( void * p, unsigned char numBlocks,
         if ( cc >= blocksAvailable_ )
             // Successfully counted off number of nodes in linked-list.
             break;
-        index = *nextBlock;
+        index = LoadIndex( nextBlock );
         if ( index == blockIndex )
             return true;
         assert( numBlocks > index );
@@ -275,6 +378,64 @@ bool Chunk::IsBlockAvailable( void * p, unsigned char numBlocks,
     return false;
 }
 
+// Chunk::IsDoubleFree -------------------------------------------------------
+
+bool Chunk::IsDoubleFree( void * p, unsigned char numBlocks,
+    std::size_t blockSize, const char * & what ) const
+{
+    what = "double free";
+    if ( IsFilled() )
+        return false;
+
+    unsigned char * place = static_cast< unsigned char * >( p );
+    // Alignment check
+    assert( ( place - pData_ ) % blockSize == 0 );
+    const unsigned char index = static_cast< unsigned char >(
+        ( place - pData_ ) / blockSize );
+    if ( firstAvailableBlock_ == index )
+        return true;
+
+#ifdef LOKI_HARDENED_CHUNKS
+    /* A block in use holds the canary byte only if its owner wrote it, but
+     one which was already deallocated always does.  Only those pay for the walk along the
+     linked-list, so the expected cost stays near constant.
+     */
+    if ( ( 1 < blockSize ) && HasCanary( place, blockSize ) )
+    {
+        // Same walk as IsBlockAvailable, but the stealth indexes are not
+        // trusted: an index out of range or seen before ends the walk
+        // instead of reading outside the Chunk or looping.
+        std::bitset< UCHAR_MAX > foundBlocks;
+        unsigned char next = firstAvailableBlock_;
+        for ( unsigned char cc = 0; cc < blocksAvailable_; ++cc )
+        {
+            if ( ( numBlocks <= next ) || foundBlocks.test( next ) )
+            {
+                what = "corrupt free list";
+                return true;
+            }
+            if ( next == index )
+                return true;
+            foundBlocks.set( next, true );
+            next = LoadIndex( pData_ + ( next * blockSize ) );
+        }
+    }
+#else
+    (void) numBlocks;
+#endif
+    return false;
+}
+
+// FixedAllocator::SetCorruptionHandler ---------------------------------------
+
+FixedAllocator::CorruptionHandler FixedAllocator::SetCorruptionHandler(
+    CorruptionHandler handler )
+{
+    CorruptionHandler previous = corruptionHandler;
+    corruptionHandler = ( NULL == handler ) ? DefaultCorruptionHandler : handler;
+    return previous;
+}
+
 // FixedAllocator::FixedAllocator ---------------------------------------------
 
 FixedAllocator::FixedAllocator()
@@ -284,6 +445,7 @@ FixedAllocator::FixedAllocator()
     , allocChunk_( NULL )
     , deallocChunk_( NULL )
     , emptyChunk_( NULL )
+    , deallocsUntilCheck_( LOKI_HARDENED_SAMPLE_INTERVAL )
 {
 }
 
@@ -497,11 +659,17 @@ bool FixedAllocator::TrimEmptyChunk( void )
             deallocChunk_ = &chunks_.front();
             assert( deallocChunk_->blocksAvailable_ < numBlocks_ );
         }
+        // The contents of the last Chunk were swapped into emptyChunk_'s
+        // spot, so follow them there.
+        else if ( deallocChunk_ == lastChunk )
+            deallocChunk_ = emptyChunk_;
         if ( allocChunk_ == emptyChunk_ )
         {
             allocChunk_ = &chunks_.back();
             assert( allocChunk_->blocksAvailable_ < numBlocks_ );
         }
+        else if ( allocChunk_ == lastChunk )
+            allocChunk_ = emptyChunk_;
     }
 
     emptyChunk_ = NULL;
@@ -522,9 +690,21 @@ bool FixedAllocator::TrimChunkList( void )
 
     if ( chunks_.size() == chunks_.capacity() )
         return false;
+    // The swap below moves every Chunk, so remember where the cached Chunk
+    // pointers were and point them into the new container afterwards.
+    Chunk * const oldFront = chunks_.empty() ? NULL : &chunks_.front();
+    const std::ptrdiff_t allocIndex = ( NULL == allocChunk_ ) ? -1 : allocChunk_ - oldFront;
+    const std::ptrdiff_t deallocIndex = ( NULL == deallocChunk_ ) ? -1 : deallocChunk_ - oldFront;
+    const std::ptrdiff_t emptyIndex = ( NULL == emptyChunk_ ) ? -1 : emptyChunk_ - oldFront;
+
     // Use the "make-a-temp-and-swap" trick to remove excess capacity.
     Chunks( chunks_ ).swap( chunks_ );
 
+    Chunk * const newFront = chunks_.empty() ? NULL : &chunks_.front();
+    allocChunk_ = ( allocIndex < 0 ) ? NULL : newFront + allocIndex;
+    deallocChunk_ = ( deallocIndex < 0 ) ? NULL : newFront + deallocIndex;
+    emptyChunk_ = ( emptyIndex < 0 ) ? NULL : newFront + emptyIndex;
+
     return true;
 }
 
@@ -603,6 +783,18 @@ void * FixedAllocator::Allocate( void )
     assert( allocChunk_ != NULL );
     assert( !allocChunk_->IsFilled() );
     void * place = allocChunk_->Allocate( blockSize_ );
+#ifdef LOKI_HARDENED_CHUNKS
+    if ( NULL == place )
+        // allocChunk_ was just quarantined, take the block from another one.
+        return Allocate();
+    if ( !allocChunk_->IsFilled() && ( numBlocks_ <= allocChunk_->firstAvailableBlock_ ) )
+    {
+        // The next stealth index decoded to garbage.  Quarantine the rest of
+        // this Chunk so that no block is handed out twice.
+        ReportCorruption( allocChunk_->pData_, "corrupt stealth index" );
+        allocChunk_->blocksAvailable_ = 0;
+    }
+#endif
 
     // prove either emptyChunk_ points nowhere, or points to a truly empty Chunk.
     assert( ( NULL == emptyChunk_ ) || ( emptyChunk_->HasAvailable( numBlocks_ ) ) );
@@ -645,6 +837,23 @@ bool FixedAllocator::Deallocate( void * p, Chunk * hint )
         assert( false );
         return false;
     }
+#endif
+#ifdef LOKI_HARDENED_CHUNKS
+    const char * what = NULL;
+    if ( foundChunk->IsDoubleFree( p, numBlocks_, blockSize_, what ) )
+    {
+        ReportCorruption( p, what );
+        return false;
+    }
+    if ( 0 == --deallocsUntilCheck_ )
+    {
+        deallocsUntilCheck_ = LOKI_HARDENED_SAMPLE_INTERVAL;
+        if ( foundChunk->IsCorrupt( numBlocks_, blockSize_, true ) )
+        {
+            ReportCorruption( foundChunk->pData_, "corrupt chunk" );
+            return false;
+        }
+    }
 #endif
     deallocChunk_ = foundChunk;
     DoDeallocate(p);
@@ -799,19 +1008,34 @@ void DefaultDeallocator( void * p )
 
 // SmallObjAllocator::SmallObjAllocator ---------------------------------------
 
-/*
 SmallObjAllocator::SmallObjAllocator( std::size_t pageSize,
-    std::size_t maxObjectSize, std::size_t objectAlignSize ) :
+    std::size_t maxObjectSize, std::size_t objectAlignSize,
+    const ReclaimPolicy & policy ) :
     pool_( NULL ),
     maxSmallObjectSize_( maxObjectSize ),
-    objectAlignSize_( objectAlignSize )
+    objectAlignSize_( objectAlignSize ),
+    policy_( policy ),
+    tick_( 0 ),
+    lastUse_( NULL ),
+    untilNextStep_( policy.stepInterval ),
+    reclaimCursor_( 0 )
 {
 #ifdef DO_EXTRA_LOKI_TESTS
     std::cout << "SmallObjAllocator " << this << std::endl;
 #endif
     assert( 0 != objectAlignSize );
     const std::size_t allocCount = GetOffset( maxObjectSize, objectAlignSize );
-    pool_ = new FixedAllocator[ allocCount ];
+    // lastUse_ can not throw once allocated, so nothing leaks if pool_ does.
+    lastUse_ = new std::size_t[ allocCount ]();
+    try
+    {
+        pool_ = new FixedAllocator[ allocCount ];
+    }
+    catch ( ... )
+    {
+        delete [] lastUse_;
+        throw;
+    }
     for ( std::size_t i = 0; i < allocCount; ++i )
         pool_[ i ].Initialize( ( i+1 ) * objectAlignSize, pageSize );
 }
@@ -823,6 +1047,7 @@ SmallObjAllocator::~SmallObjAllocator( void )
 #ifdef DO_EXTRA_LOKI_TESTS
     std::cout << "~SmallObjAllocator " << this << std::endl;
 #endif
+    delete [] lastUse_;
     delete [] pool_;
 }
 
@@ -847,6 +1072,33 @@ bool SmallObjAllocator::TrimExcessMemory( void )
     return found;
 }
 
+// SmallObjAllocator::ReclaimStep ---------------------------------------------
+
+bool SmallObjAllocator::ReclaimStep( void )
+{
+    bool found = false;
+    const std::size_t allocCount = GetOffset( GetMaxObjectSize(), GetAlignment() );
+    std::size_t visits = policy_.allocatorsPerStep;
+    if ( visits > allocCount ) visits = allocCount;
+    for ( ; 0 < visits; --visits )
+    {
+        // tick_ only grows, so the subtraction can not wrap unless tick_
+        // itself wrapped, which merely trims one idle allocator too early.
+        if ( tick_ - lastUse_[ reclaimCursor_ ] >= policy_.idleTicks )
+        {
+            FixedAllocator & allocator = pool_[ reclaimCursor_ ];
+            if ( allocator.TrimEmptyChunk() )
+                found = true;
+            if ( allocator.TrimChunkList() )
+                found = true;
+        }
+        if ( ++reclaimCursor_ == allocCount )
+            reclaimCursor_ = 0;
+    }
+
+    return found;
+}
+
 // SmallObjAllocator::Allocate ------------------------------------------------
 
 void * SmallObjAllocator::Allocate( std::size_t numBytes, bool doThrow )
@@ -865,6 +1117,7 @@ void * SmallObjAllocator::Allocate( std::size_t numBytes, bool doThrow )
     assert( allocator.BlockSize() >= numBytes );
     assert( allocator.BlockSize() < numBytes + GetAlignment() );
     void * place = allocator.Allocate();
+    Touch( index );
 
     if ( ( NULL == place ) && TrimExcessMemory() )
         place = allocator.Allocate();
@@ -904,6 +1157,7 @@ void SmallObjAllocator::Deallocate( void * p, std::size_t numBytes )
     const bool found = allocator.Deallocate( p, NULL );
     (void) found;
     assert( found );
+    Touch( index );
 }
 
 // SmallObjAllocator::Deallocate ----------------------------------------------
@@ -915,8 +1169,9 @@ void SmallObjAllocator::Deallocate( void * p )
     FixedAllocator * pAllocator = NULL;
     const std::size_t allocCount = GetOffset( GetMaxObjectSize(), GetAlignment() );
     Chunk * chunk = NULL;
+    std::size_t ii = 0;
 
-    for ( std::size_t ii = 0; ii < allocCount; ++ii )
+    for ( ; ii < allocCount; ++ii )
     {
         chunk = pool_[ ii ].HasBlock( p );
         if ( NULL != chunk )
@@ -935,6 +1190,7 @@ void SmallObjAllocator::Deallocate( void * p )
     const bool found = pAllocator->Deallocate( p, chunk );
     (void) found;
     assert( found );
+    Touch( ii );
 }
 
 // SmallObjAllocator::IsCorrupt -----------------------------------------------
@@ -964,6 +1220,6 @@ bool SmallObjAllocator::IsCorrupt( void ) const
     }
     return false;
 }
-*/
+
 } // end namespace Loki
 
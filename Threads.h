@@ -0,0 +1,160 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Copyright (c) 2001 by Andrei Alexandrescu
+// This code accompanies the book:
+// Alexandrescu, Andrei. "Modern C++ Design: Generic Programming and Design
+//     Patterns Applied". Copyright (c) 2001. Addison-Wesley.
+// Permission to use, copy, modify, distribute and sell this software for any
+//     purpose is hereby granted without fee, provided that the above copyright
+//     notice appear in all copies and that both that copyright notice and this
+//     permission notice appear in supporting documentation.
+// The author or Addison-Wesley Longman make no representations about the
+//     suitability of this software for any purpose. It is provided "as is"
+//     without express or implied warranty.
+////////////////////////////////////////////////////////////////////////////////
+#ifndef LOKI_THREADS_INC_
+#define LOKI_THREADS_INC_
+
+///  @defgroup  ThreadingGroup Threading
+///  Policies for the threading model:
+///
+///  - SingleThreaded
+///  - ClassLevelLockable
+///
+///  All classes in Loki have configurable threading model.
+///
+///  The macro LOKI_DEFAULT_THREADING selects the default
+///  threading model for certain components of Loki
+///  (it affects only default template arguments)
+///
+///  \par Usage:
+///
+///  To use a specific threading model define
+///
+///  - nothing, single-theading is default
+///  - LOKI_CLASS_LEVEL_THREADING for class-level-threading
+///
+///  Unlike the original Loki this file is built on std::mutex and
+///  std::atomic instead of pthreads and the Win32 API.
+
+#include <atomic>
+#include <mutex>
+
+#if defined(LOKI_CLASS_LEVEL_THREADING)
+#define LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL ::Loki::ClassLevelLockable
+#else
+#define LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL ::Loki::SingleThreaded
+#endif
+
+#ifndef LOKI_DEFAULT_MUTEX
+#define LOKI_DEFAULT_MUTEX ::std::mutex
+#endif
+
+namespace Loki
+{
+
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \class SingleThreaded
+    ///
+    ///  \ingroup ThreadingGroup
+    ///  Implementation of the ThreadingModel policy used by various classes
+    ///  Implements a single-threaded model; no synchronization
+    ////////////////////////////////////////////////////////////////////////////////
+    template <class Host, class MutexPolicy = LOKI_DEFAULT_MUTEX>
+    class SingleThreaded
+    {
+    public:
+        /// \struct Lock
+        /// Dummy Lock class
+        struct Lock
+        {
+            Lock() {}
+            explicit Lock(const SingleThreaded&) {}
+            explicit Lock(const SingleThreaded*) {}
+        };
+
+        typedef Host VolatileType;
+
+        /// Reads a value shared between threads.
+        static Host Load(const VolatileType& val)
+        { return val; }
+
+        /// Publishes a value shared between threads.
+        static void Store(VolatileType& val, Host newVal)
+        { val = newVal; }
+    };
+
+
+    ////////////////////////////////////////////////////////////////////////////////
+    ///  \class ClassLevelLockable
+    ///
+    ///  \ingroup ThreadingGroup
+    ///  Implementation of the ThreadingModel policy used by various classes
+    ///  Implements a class-level locking scheme.  All objects of one Host
+    ///  share a single mutex, which is constant-initialized so that it may be
+    ///  locked during static initialization.
+    ///
+    ///  Load and Store are an acquire/release pair, which is what the
+    ///  double-checked pattern in SingletonHolder needs: once a Store of a
+    ///  pointer is seen by Load, so is everything written before the Store.
+    ///  On x86 both compile to plain moves.
+    ////////////////////////////////////////////////////////////////////////////////
+    template <class Host, class MutexPolicy = LOKI_DEFAULT_MUTEX>
+    class ClassLevelLockable
+    {
+        inline static MutexPolicy mtx_;
+
+    public:
+
+        class Lock;
+        friend class Lock;
+
+        ///  \struct Lock
+        ///  Lock class to lock on class level
+        class Lock
+        {
+        public:
+
+            /// Lock class
+            Lock()
+            {
+                mtx_.lock();
+            }
+
+            /// Lock class
+            explicit Lock(const ClassLevelLockable&)
+            {
+                mtx_.lock();
+            }
+
+            /// Lock class
+            explicit Lock(const ClassLevelLockable*)
+            {
+                mtx_.lock();
+            }
+
+            /// Unlock class
+            ~Lock()
+            {
+                mtx_.unlock();
+            }
+
+        private:
+            Lock(const Lock&);
+            Lock& operator=(const Lock&);
+        };
+
+        typedef std::atomic<Host> VolatileType;
+
+        /// Reads a value shared between threads.
+        static Host Load(const VolatileType& val)
+        { return val.load(std::memory_order_acquire); }
+
+        /// Publishes a value shared between threads.
+        static void Store(VolatileType& val, Host newVal)
+        { val.store(newVal, std::memory_order_release); }
+    };
+
+} // namespace Loki
+
+#endif // end file guardian
@@ -0,0 +1,285 @@
+//分配器基准: 用几种常见的分配/释放模式对比 FixedAllocator, SmallObjAllocator 和 malloc
+//用法: bench_allocator [每轮对象数]
+#include<algorithm>
+#include<chrono>
+#include<condition_variable>
+#include<cstdio>
+#include<cstdlib>
+#include<deque>
+#include<mutex>
+#include<optional>
+#include<random>
+#include<string>
+#include<thread>
+#include<type_traits>
+#include<vector>
+
+#include<unistd.h>
+#ifdef __GLIBC__
+#include<malloc.h>
+#endif
+
+#include"smallobj.h"
+
+using namespace Loki;
+
+namespace {
+
+constexpr std::size_t PageSize=4096;
+constexpr std::size_t MaxSmallObjectSize=256;
+constexpr std::size_t ObjectAlignSize=4;
+
+//当前常驻内存,读 /proc/self/statm 的第二列
+std::size_t current_rss()
+{
+    std::FILE * f=std::fopen("/proc/self/statm","r");
+    if(!f)
+        return 0;
+    unsigned long size=0,resident=0;
+    if(std::fscanf(f,"%lu %lu",&size,&resident)!=2)
+        resident=0;
+    std::fclose(f);
+    return resident*static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+//让 glibc 把空闲内存还给系统,否则上一轮的残留会混进下一轮的 RSS
+void settle_heap()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+struct MallocBackend
+{
+    static constexpr const char * name="malloc";
+    static constexpr bool mixed_sizes=true;
+    static constexpr bool thread_safe=true;
+    explicit MallocBackend(std::size_t){}
+    void * allocate(std::size_t n){return std::malloc(n);}
+    void deallocate(void * p,std::size_t){std::free(p);}
+};
+
+//只能服务一种尺寸,所以不参加混合尺寸的测试
+struct FixedBackend
+{
+    static constexpr const char * name="FixedAllocator";
+    static constexpr bool mixed_sizes=false;
+    static constexpr bool thread_safe=false;
+    FixedAllocator f;
+    explicit FixedBackend(std::size_t block_size){f.Initialize(block_size,PageSize);}
+    void * allocate(std::size_t){return f.Allocate();}
+    void deallocate(void * p,std::size_t){f.Deallocate(p,nullptr);}
+};
+
+struct SmallObjBackend
+{
+    static constexpr const char * name="SmallObjAllocator";
+    static constexpr bool mixed_sizes=true;
+    static constexpr bool thread_safe=false;
+    SmallObjAllocator a{PageSize,MaxSmallObjectSize,ObjectAlignSize};
+    explicit SmallObjBackend(std::size_t){}
+    void * allocate(std::size_t n){return a.Allocate(n,true);}
+    void deallocate(void * p,std::size_t n){a.Deallocate(p,n);}
+};
+
+//Loki 的分配器不是线程安全的,跨线程使用时和 Loki 自己的 ClassLevelLockable 一样整体加锁
+template<typename Backend>
+struct Locked
+{
+    std::mutex m;
+    Backend b;
+    explicit Locked(std::size_t n):b(n){}
+    void * allocate(std::size_t n){std::lock_guard g{m};return b.allocate(n);}
+    void deallocate(void * p,std::size_t n){std::lock_guard g{m};b.deallocate(p,n);}
+};
+
+//malloc 自己就是线程安全的,再包一层锁测到的就是锁了
+template<typename Backend>
+using Shared=std::conditional_t<Backend::thread_safe,Backend,Locked<Backend>>;
+
+enum class Order{LIFO,FIFO,Random};
+
+const char * order_name(Order o)
+{
+    switch(o){
+    case Order::LIFO:return "LIFO";
+    case Order::FIFO:return "FIFO";
+    default:return "random";
+    }
+}
+
+//偏向小对象的尺寸分布,大致模拟节点/字符串/小容器混在一起的情况
+std::vector<std::size_t> make_sizes(std::size_t count,bool mixed,std::size_t fixed_size)
+{
+    std::vector<std::size_t> sizes(count,fixed_size);
+    if(!mixed)
+        return sizes;
+    std::mt19937 rng{42};
+    std::geometric_distribution<std::size_t> dist{0.08};
+    for(auto & s:sizes)
+        s=std::min<std::size_t>(8+dist(rng)*4,MaxSmallObjectSize);
+    return sizes;
+}
+
+struct Result
+{
+    double ns_per_op=0;
+    std::size_t live_bytes=0;
+    std::size_t peak_rss=0;
+    std::size_t retained_rss=0;
+};
+
+void report(const std::string & pattern,const char * backend,const Result & r)
+{
+    //碎片率: 峰值时 RSS 增量中没有被存活对象占用的比例
+    char frag[16]="-";
+    if(r.live_bytes!=0)
+        std::snprintf(frag,sizeof frag,"%.1f%%",r.peak_rss>r.live_bytes?
+                          100.0*(r.peak_rss-r.live_bytes)/r.peak_rss:0.0);
+    std::printf("%-22s %-18s %9.1f %12zu %12zu %8s %12zu\n",
+                pattern.c_str(),backend,r.ns_per_op,
+                r.live_bytes/1024,r.peak_rss/1024,frag,r.retained_rss/1024);
+}
+
+template<typename Backend>
+Result run_single_thread(std::size_t count,Order order,const std::vector<std::size_t> & sizes)
+{
+    settle_heap();
+    Result r;
+    {
+        std::vector<void *> ptrs(count);
+        std::vector<std::size_t> free_order(count);
+        for(std::size_t i=0;i<count;++i)
+            free_order[i]=order==Order::LIFO?count-1-i:i;
+        if(order==Order::Random)
+            std::shuffle(free_order.begin(),free_order.end(),std::mt19937{7});
+        //簿记数组已经分配好,之后的 RSS 增量只来自被测的分配器
+        const std::size_t base_rss=current_rss();
+        std::optional<Backend> backend{std::in_place,sizes.front()};
+        auto & b=*backend;
+
+        const auto start=std::chrono::steady_clock::now();
+        for(std::size_t i=0;i<count;++i)
+            ptrs[i]=b.allocate(sizes[i]);
+        const auto mid=std::chrono::steady_clock::now();
+        for(std::size_t i=0;i<count;++i)
+            r.live_bytes+=sizes[i];
+        const std::size_t peak=current_rss();
+        const auto resume=std::chrono::steady_clock::now();
+        for(auto i:free_order)
+            b.deallocate(ptrs[i],sizes[i]);
+        const auto stop=std::chrono::steady_clock::now();
+
+        const auto ns=std::chrono::duration<double,std::nano>((mid-start)+(stop-resume)).count();
+        r.ns_per_op=ns/(2*count);
+        r.peak_rss=peak>base_rss?peak-base_rss:0;
+        //残留: 分配器析构并归还空闲内存之后仍然占着的部分
+        backend.reset();
+        settle_heap();
+        const std::size_t after=current_rss();
+        r.retained_rss=after>base_rss?after-base_rss:0;
+    }
+    return r;
+}
+
+//生产者分配,消费者在另一个线程释放
+template<typename Backend>
+Result run_cross_thread(std::size_t count,const std::vector<std::size_t> & sizes)
+{
+    settle_heap();
+    Result r;
+    const std::size_t base_rss=current_rss();
+    std::optional<Backend> backend{std::in_place,sizes.front()};
+    auto & b=*backend;
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::pair<void *,std::size_t>> queue;
+    bool done=false;
+    std::size_t peak=0;
+    std::size_t flushes=0;
+
+    const auto start=std::chrono::steady_clock::now();
+    std::thread consumer([&]{
+        for(;;){
+            std::unique_lock lk{m};
+            cv.wait(lk,[&]{return done||!queue.empty();});
+            if(queue.empty())
+                return;
+            auto batch=std::move(queue);
+            queue.clear();
+            lk.unlock();
+            for(auto [p,n]:batch)
+                b.deallocate(p,n);
+        }
+    });
+    std::vector<std::pair<void *,std::size_t>> batch;
+    for(std::size_t i=0;i<count;++i){
+        batch.emplace_back(b.allocate(sizes[i]),sizes[i]);
+        if(batch.size()==256||i+1==count){
+            {
+                std::lock_guard g{m};
+                queue.insert(queue.end(),batch.begin(),batch.end());
+            }
+            cv.notify_one();
+            batch.clear();
+            if(++flushes%16==0)
+                peak=std::max(peak,current_rss());
+        }
+    }
+    {
+        std::lock_guard g{m};
+        done=true;
+    }
+    cv.notify_one();
+    consumer.join();
+    const auto stop=std::chrono::steady_clock::now();
+
+    r.ns_per_op=std::chrono::duration<double,std::nano>(stop-start).count()/(2*count);
+    //对象在途时间很短,存活量没有意义,只看峰值和残留
+    r.peak_rss=peak>base_rss?peak-base_rss:0;
+    backend.reset();
+    settle_heap();
+    const std::size_t after=current_rss();
+    r.retained_rss=after>base_rss?after-base_rss:0;
+    return r;
+}
+
+template<typename Backend>
+void run_backend(std::size_t count)
+{
+    constexpr std::size_t fixed_size=32;
+    const auto fixed=make_sizes(count,false,fixed_size);
+    for(auto order:{Order::LIFO,Order::FIFO,Order::Random})
+        report(std::string(order_name(order))+" "+std::to_string(fixed_size)+"B",
+               Backend::name,run_single_thread<Backend>(count,order,fixed));
+    if constexpr(Backend::mixed_sizes){
+        const auto mixed=make_sizes(count,true,fixed_size);
+        report("random mixed",Backend::name,run_single_thread<Backend>(count,Order::Random,mixed));
+        report("cross-thread mixed",Backend::name,run_cross_thread<Shared<Backend>>(count,mixed));
+    }else{
+        report("cross-thread "+std::to_string(fixed_size)+"B",Backend::name,
+               run_cross_thread<Shared<Backend>>(count,fixed));
+    }
+}
+
+}
+
+int main(int argc,char * argv[])
+{
+    const std::size_t count=argc>1?std::strtoull(argv[1],nullptr,10):1u<<20;
+    if(count==0){
+        std::fprintf(stderr,"usage: %s [objects per run]\n",argv[0]);
+        return 1;
+    }
+    std::printf("%zu objects per run\n",count);
+#ifndef NDEBUG
+    std::printf("warning: assertions are enabled, build with -DCMAKE_BUILD_TYPE=Release for real numbers\n");
+#endif
+    std::printf("%-22s %-18s %9s %12s %12s %8s %12s\n",
+                "pattern","allocator","ns/op","live KiB","peak RSS KiB","frag","retained KiB");
+    run_backend<MallocBackend>(count);
+    run_backend<FixedBackend>(count);
+    run_backend<SmallObjBackend>(count);
+    return 0;
+}
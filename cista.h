@@ -223,6 +223,171 @@ constexpr uint64_t hash(T const& buf, hash_t const h = BASE_HASH) {
 
 }  // namespace cista
 
+#include <thread>
+#include <vector>
+
+// Threads used by chunked_checksum() for large buffers. 0 = one per core.
+#ifndef CISTA_CHECKSUM_THREADS
+#define CISTA_CHECKSUM_THREADS 0U
+#endif
+
+namespace cista {
+
+// Algorithm: XXH64 (dependency free reimplementation)
+// Source: https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+//
+// Four independent lanes over 32 byte stripes keep the multipliers busy,
+// which makes it an order of magnitude faster than byte-wise FNV-1a.
+// Input is read as little endian on every platform.
+namespace xxh64_detail {
+
+constexpr auto const P1 = 11400714785074694791ULL;
+constexpr auto const P2 = 14029467366897019727ULL;
+constexpr auto const P3 = 1609587929392839161ULL;
+constexpr auto const P4 = 9650029242287828579ULL;
+constexpr auto const P5 = 2870177450012600261ULL;
+
+inline uint64_t rotl(uint64_t const x, int const r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(uint8_t const* p) {
+  return uint64_t{p[0]} | uint64_t{p[1]} << 8U | uint64_t{p[2]} << 16U |
+         uint64_t{p[3]} << 24U | uint64_t{p[4]} << 32U | uint64_t{p[5]} << 40U |
+         uint64_t{p[6]} << 48U | uint64_t{p[7]} << 56U;
+}
+
+inline uint64_t read32(uint8_t const* p) {
+  return uint64_t{p[0]} | uint64_t{p[1]} << 8U | uint64_t{p[2]} << 16U |
+         uint64_t{p[3]} << 24U;
+}
+
+inline uint64_t lane(uint64_t acc, uint64_t const input) {
+  acc += input * P2;
+  acc = rotl(acc, 31);
+  return acc * P1;
+}
+
+inline uint64_t merge_lane(uint64_t acc, uint64_t const val) {
+  acc ^= lane(0U, val);
+  return acc * P1 + P4;
+}
+
+}  // namespace xxh64_detail
+
+inline uint64_t xxh64(void const* data, size_t const size,
+                      uint64_t const seed = 0U) {
+  using namespace xxh64_detail;
+  auto p = static_cast<uint8_t const*>(data);
+  auto const end = p + size;
+  auto h = uint64_t{0U};
+
+  if (size >= 32U) {
+    auto v1 = seed + P1 + P2;
+    auto v2 = seed + P2;
+    auto v3 = seed;
+    auto v4 = seed - P1;
+    for (auto const limit = end - 32; p <= limit; p += 32) {
+      v1 = lane(v1, read64(p));
+      v2 = lane(v2, read64(p + 8));
+      v3 = lane(v3, read64(p + 16));
+      v4 = lane(v4, read64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge_lane(h, v1);
+    h = merge_lane(h, v2);
+    h = merge_lane(h, v3);
+    h = merge_lane(h, v4);
+  } else {
+    h = seed + P5;
+  }
+
+  h += static_cast<uint64_t>(size);
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= lane(0U, read64(p));
+    h = rotl(h, 27) * P1 + P4;
+  }
+  if (p + 4 <= end) {
+    h ^= read32(p) * P1;
+    h = rotl(h, 23) * P2 + P3;
+    p += 4;
+  }
+  for (; p != end; ++p) {
+    h ^= *p * P5;
+    h = rotl(h, 11) * P1;
+  }
+
+  h ^= h >> 33U;
+  h *= P2;
+  h ^= h >> 29U;
+  h *= P3;
+  h ^= h >> 32U;
+  return h;
+}
+
+// Checksum used for mode::WITH_INTEGRITY | mode::FAST_INTEGRITY.
+//
+// The data is split into CHECKSUM_CHUNK_SIZE chunks hashed independently,
+// the result is the hash of the chunk digests. This makes it possible to
+// hash chunks on several threads and to stream files block by block, while
+// the value only depends on the data, not on the thread count.
+constexpr auto const CHECKSUM_CHUNK_SIZE = 1U << 20U;
+
+inline uint64_t combine_checksum_digests(std::vector<uint64_t> const& digests,
+                                         size_t const size) {
+  auto h = xxh64(nullptr, 0U, static_cast<uint64_t>(size));
+  for (auto const d : digests) {
+    uint8_t le[8];
+    for (auto i = 0U; i != 8U; ++i) {
+      le[i] = static_cast<uint8_t>(d >> (8U * i));
+    }
+    h = xxh64(le, sizeof(le), h);
+  }
+  return h;
+}
+
+inline uint64_t chunked_checksum(void const* data, size_t const size,
+                                 unsigned threads = CISTA_CHECKSUM_THREADS) {
+  auto const bytes = static_cast<uint8_t const*>(data);
+  auto const n = (size + CHECKSUM_CHUNK_SIZE - 1U) / CHECKSUM_CHUNK_SIZE;
+  auto digests = std::vector<uint64_t>(n);
+
+  auto const hash_chunks = [&](size_t const from, size_t const to) {
+    chunk(CHECKSUM_CHUNK_SIZE,
+          std::min(to * CHECKSUM_CHUNK_SIZE, size) - from * CHECKSUM_CHUNK_SIZE,
+          [&](size_t const offset, unsigned const chunk_size) {
+            auto const pos = from * CHECKSUM_CHUNK_SIZE + offset;
+            digests[pos / CHECKSUM_CHUNK_SIZE] = xxh64(bytes + pos, chunk_size);
+          });
+  };
+
+  if (threads == 0U) {
+    threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  // Starting a thread costs about as much as hashing a few chunks.
+  threads = static_cast<unsigned>(
+      std::max(size_t{1U}, std::min(size_t{threads}, n / 4U)));
+
+  if (threads == 1U) {
+    hash_chunks(0U, n);
+  } else {
+    auto workers = std::vector<std::thread>{};
+    for (auto t = 1U; t < threads; ++t) {
+      workers.emplace_back(hash_chunks, n * t / threads,
+                           n * (t + 1U) / threads);
+    }
+    hash_chunks(0U, n / threads);
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+
+  return combine_checksum_digests(digests, size);
+}
+
+}  // namespace cista
+
 #include <cinttypes>
 #include <limits>
 
@@ -279,11 +444,12 @@ namespace cista {
 inline HANDLE open_file(char const* path, char const* mode) {
   bool read = std::strcmp(mode, "r") == 0;
   bool write = std::strcmp(mode, "w+") == 0;
+  bool modify = std::strcmp(mode, "r+") == 0;
 
-  verify(read || write, "open file mode not supported");
+  verify(read || write || modify, "open file mode not supported");
 
   DWORD access = read ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
-  DWORD create_mode = read ? OPEN_EXISTING : CREATE_ALWAYS;
+  DWORD create_mode = write ? CREATE_ALWAYS : OPEN_EXISTING;
 
   return CreateFileA(path, access, 0, nullptr, create_mode,
                      FILE_ATTRIBUTE_NORMAL, nullptr);
@@ -366,6 +532,24 @@ struct file {
     return c;
   }
 
+  uint64_t chunked_checksum(offset_t const start = 0) const {
+    auto const total = size_ - static_cast<size_t>(start);
+    auto digests = std::vector<uint64_t>{};
+    auto b = std::vector<char>(CHECKSUM_CHUNK_SIZE);
+    chunk(CHECKSUM_CHUNK_SIZE, total, [&](auto const from, auto const size) {
+      OVERLAPPED overlapped = {0};
+      overlapped.Offset = static_cast<DWORD>(start + from);
+      overlapped.OffsetHigh = static_cast<DWORD>((start + from) >> 32U);
+      DWORD bytes_read = {0};
+      verify(ReadFile(f_, b.data(), static_cast<DWORD>(size), &bytes_read,
+                      &overlapped),
+             "checksum read error");
+      verify(bytes_read == size, "checksum read error bytes read");
+      digests.emplace_back(xxh64(b.data(), size));
+    });
+    return combine_checksum_digests(digests, total);
+  }
+
   template <typename T>
   void write(std::size_t const pos, T const& val) {
     OVERLAPPED overlapped = {0};
@@ -429,8 +613,14 @@ struct file {
 }  // namespace cista
 #else
 
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 
 namespace cista {
@@ -502,6 +692,19 @@ struct file {
     return c;
   }
 
+  uint64_t chunked_checksum(offset_t const start = 0) const {
+    verify(size_ >= static_cast<size_t>(start), "invalid checksum offset");
+    verify(!std::fseek(f_, static_cast<long>(start), SEEK_SET), "fseek error");
+    auto const total = size_ - static_cast<size_t>(start);
+    auto digests = std::vector<uint64_t>{};
+    auto b = std::vector<char>(CHECKSUM_CHUNK_SIZE);
+    chunk(CHECKSUM_CHUNK_SIZE, total, [&](auto const, auto const s) {
+      verify(std::fread(b.data(), 1, s, f_) == s, "invalid read");
+      digests.emplace_back(xxh64(b.data(), s));
+    });
+    return combine_checksum_digests(digests, total);
+  }
+
   template <typename T>
   void write(std::size_t const pos, T const& val) {
     verify(!std::fseek(f_, static_cast<long>(pos), SEEK_SET), "seek error");
@@ -534,24 +737,274 @@ struct file {
   std::size_t size_ = 0u;
 };
 
+// Serialization target that streams to a file descriptor.
+//
+// Data is appended to a fixed size write-behind buffer which is flushed
+// sequentially with pwrite once it is full, so memory use does not grow
+// with the output. write(pos, val) patches bytes still in the buffer in
+// place and uses pwrite for bytes that were already flushed.
+//
+// With direct = true (Linux only) full buffers are written with O_DIRECT
+// through a second descriptor to bypass the page cache. Patches and the
+// last partial block go through the regular descriptor, because O_DIRECT
+// needs block aligned offsets and sizes.
+//
+// Call flush() before the object is destroyed to see write errors. The
+// destructor flushes too, but cannot report failures.
+struct fd_target {
+  static constexpr auto const DEFAULT_BUFFER_SIZE = std::size_t{8U << 20U};
+  static constexpr auto const DIRECT_ALIGNMENT = std::size_t{4096U};
+
+  explicit fd_target(char const* path,
+                     std::size_t const buffer_size = DEFAULT_BUFFER_SIZE,
+                     bool const direct = false)
+      : capacity_{(std::max(buffer_size, DIRECT_ALIGNMENT) +
+                   DIRECT_ALIGNMENT - 1U) &
+                  ~(DIRECT_ALIGNMENT - 1U)} {
+    fd_ = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    verify(fd_ != -1, "unable to open file");
+#ifdef O_DIRECT
+    if (direct) {
+      direct_fd_ = ::open(path, O_WRONLY | O_DIRECT);
+      if (direct_fd_ == -1) {
+        close_fds();
+        throw std::runtime_error{"unable to open file with O_DIRECT"};
+      }
+    }
+#else
+    (void)direct;
+#endif
+    void* mem = nullptr;
+    if (posix_memalign(&mem, DIRECT_ALIGNMENT, capacity_) != 0) {
+      close_fds();
+      throw std::bad_alloc{};
+    }
+    buf_ = static_cast<uint8_t*>(mem);
+  }
+
+  ~fd_target() {
+    try {
+      flush();
+    } catch (...) {
+    }
+    close_fds();
+    std::free(buf_);
+  }
+
+  fd_target(fd_target const&) = delete;
+  fd_target& operator=(fd_target const&) = delete;
+
+  offset_t write(void const* ptr, std::size_t const size,
+                 std::size_t const alignment = 0) {
+    if (alignment > 1U) {
+      auto const aligned = (size_ + alignment - 1U) & ~(alignment - 1U);
+      append_zeros(aligned - size_);
+    }
+    auto const start = size_;
+    auto src = static_cast<uint8_t const*>(ptr);
+    auto remaining = size;
+    while (remaining != 0U) {
+      if (used_ == capacity_) {
+        flush_block();
+      }
+      auto const n = std::min(remaining, capacity_ - used_);
+      std::memcpy(buf_ + used_, src, n);
+      used_ += n;
+      size_ += n;
+      src += n;
+      remaining -= n;
+    }
+    return static_cast<offset_t>(start);
+  }
+
+  template <typename T>
+  void write(std::size_t const pos, T const& val) {
+    auto const size = serialized_size<T>();
+    verify(pos + size <= size_, "out of bounds write");
+    auto const src = reinterpret_cast<uint8_t const*>(&val);
+    auto const flushed_part =
+        pos < flushed_ ? std::min(size, flushed_ - pos) : std::size_t{0U};
+    if (flushed_part != 0U) {
+      pwrite_all(fd_, src, flushed_part, pos);
+    }
+    if (flushed_part != size) {
+      std::memcpy(buf_ + (pos + flushed_part - flushed_), src + flushed_part,
+                  size - flushed_part);
+    }
+  }
+
+  uint64_t checksum(offset_t const start = 0) {
+    auto c = BASE_HASH;
+    read_back(start, 512U * 1024U, [&](char const* data, size_t const s) {
+      c = hash(std::string_view{data, s}, c);
+    });
+    return c;
+  }
+
+  uint64_t chunked_checksum(offset_t const start = 0) {
+    auto digests = std::vector<uint64_t>{};
+    read_back(start, CHECKSUM_CHUNK_SIZE,
+              [&](char const* data, size_t const s) {
+                digests.emplace_back(xxh64(data, s));
+              });
+    return combine_checksum_digests(digests,
+                                    size_ - static_cast<size_t>(start));
+  }
+
+  // Writes the buffered tail. The buffer stays usable for further writes.
+  void flush() {
+    if (used_ != 0U) {
+      pwrite_all(fd_, buf_, used_, flushed_);
+      if (direct_fd_ != -1) {
+        // Keep flushed_ block aligned for later O_DIRECT writes:
+        // the tail stays buffered and is rewritten by the next flush.
+        auto const keep = used_ & (DIRECT_ALIGNMENT - 1U);
+        auto const full = used_ - keep;
+        std::memmove(buf_, buf_ + full, keep);
+        flushed_ += full;
+        used_ = keep;
+      } else {
+        flushed_ += used_;
+        used_ = 0U;
+      }
+    }
+  }
+
+  std::size_t size() const { return size_; }
+
+private:
+  template <typename Fn>
+  void read_back(offset_t const start, unsigned const block_size, Fn&& fn) {
+    flush();
+    verify(size_ >= static_cast<size_t>(start), "invalid checksum offset");
+    auto block = std::vector<char>(block_size);
+    chunk(block_size, size_ - static_cast<size_t>(start),
+          [&](auto const offset, auto const s) {
+            auto const pos = static_cast<size_t>(start) + offset;
+            auto done = size_t{0U};
+            while (done != s) {
+              auto const n = ::pread(fd_, block.data() + done, s - done,
+                                     static_cast<off_t>(pos + done));
+              verify(n > 0, "checksum read error");
+              done += static_cast<size_t>(n);
+            }
+            fn(block.data(), s);
+          });
+  }
+
+  void flush_block() {
+    pwrite_all(direct_fd_ != -1 ? direct_fd_ : fd_, buf_, used_, flushed_);
+    flushed_ += used_;
+    used_ = 0U;
+  }
+
+  void append_zeros(std::size_t n) {
+    while (n != 0U) {
+      if (used_ == capacity_) {
+        flush_block();
+      }
+      auto const k = std::min(n, capacity_ - used_);
+      std::memset(buf_ + used_, 0, k);
+      used_ += k;
+      size_ += k;
+      n -= k;
+    }
+  }
+
+  static void pwrite_all(int const fd, uint8_t const* data, std::size_t size,
+                         std::size_t pos) {
+    while (size != 0U) {
+      auto const n = ::pwrite(fd, data, size, static_cast<off_t>(pos));
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      verify(n > 0, "write error");
+      data += n;
+      pos += static_cast<std::size_t>(n);
+      size -= static_cast<std::size_t>(n);
+    }
+  }
+
+  void close_fds() {
+    if (direct_fd_ != -1) {
+      ::close(direct_fd_);
+      direct_fd_ = -1;
+    }
+    if (fd_ != -1) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  int fd_{-1};
+  int direct_fd_{-1};
+  uint8_t* buf_{nullptr};
+  std::size_t capacity_;
+  std::size_t used_{0U};
+  std::size_t flushed_{0U};
+  std::size_t size_{0U};
+};
+
 }  // namespace cista
 
 #endif
 
 namespace cista {
 
+// Asks the OS to start reading the pages backing [ptr, ptr + size) without
+// waiting for them (MADV_WILLNEED). Useful before a batch of lookups into
+// a memory mapped file. No-op where not supported.
+inline void prefetch_range(void const* ptr, size_t const size) {
+#ifdef _MSC_VER
+  (void)ptr;
+  (void)size;
+#else
+  if (ptr == nullptr || size == 0U) {
+    return;
+  }
+  auto const page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+  auto const begin = reinterpret_cast<uintptr_t>(ptr) & ~(page - 1U);
+  auto const end = reinterpret_cast<uintptr_t>(ptr) + size;
+  ::madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+#endif
+}
+
 struct mmap {
   static constexpr auto const OFFSET = 0ULL;
   static constexpr auto const ENTIRE_FILE = std::numeric_limits<size_t>::max();
-  enum class protection { READ, WRITE };
+  // WRITE truncates the file, MODIFY opens an existing file for reading
+  // and writing. COPY_ON_WRITE maps the file privately: writes (e.g.
+  // pointer fixups in deserialize) only go to private copies of the touched
+  // pages, the file is never modified.
+  enum class protection { READ, WRITE, COPY_ON_WRITE, MODIFY };
+
+  // Access pattern hints applied when mapping (madvise / mmap flags).
+  // They are advisory: unsupported ones are ignored, e.g. on Windows.
+  enum class hint : unsigned {
+    NONE = 0U,
+    SEQUENTIAL = 1U << 0U,  // large read-ahead, for a first full pass
+    RANDOM = 1U << 1U,  // no read-ahead, for point lookups
+    POPULATE = 1U << 2U,  // fault in the whole file up front
+    HUGE_PAGES = 1U << 3U  // 2 MiB aligned mapping, MADV_HUGEPAGE
+  };
+
+  friend constexpr hint operator|(hint const a, hint const b) {
+    return hint{static_cast<unsigned>(a) | static_cast<unsigned>(b)};
+  }
+
+  static constexpr auto const HUGE_PAGE_SIZE = size_t{2U} << 20U;
 
   mmap() = default;
 
-  explicit mmap(char const* path, protection const prot = protection::WRITE)
-      : f_{path, prot == protection::READ ? "r" : "w+"},
+  explicit mmap(char const* path, protection const prot = protection::WRITE,
+                hint const h = hint::NONE)
+      : f_{path, prot == protection::WRITE    ? "w+"
+                 : prot == protection::MODIFY ? "r+"
+                                              : "r"},
         prot_{prot},
         size_{f_.size()},
         used_size_{f_.size()},
+        hint_{h},
         addr_{size_ == 0U ? nullptr : map()} {}
 
   ~mmap() {
@@ -573,6 +1026,7 @@ struct mmap {
         prot_{o.prot_},
         size_{o.size_},
         used_size_{o.used_size_},
+        hint_{o.hint_},
         addr_{o.addr_} {
     o.addr_ = nullptr;
   }
@@ -582,13 +1036,14 @@ struct mmap {
     prot_ = o.prot_;
     size_ = o.size_;
     used_size_ = o.used_size_;
+    hint_ = o.hint_;
     addr_ = o.addr_;
     o.addr_ = nullptr;
     return *this;
   }
 
   void sync() {
-    if (prot_ == protection::WRITE && addr_ != nullptr) {
+    if (writable() && addr_ != nullptr) {
 #ifdef _MSC_VER
       verify(::FlushViewOfFile(addr_, size_) != 0, "flush error");
       verify(::FlushFileBuffers(f_.f_) != 0, "flush error");
@@ -599,7 +1054,7 @@ struct mmap {
   }
 
   void resize(size_t const new_size) {
-    verify(prot_ == protection::WRITE, "read-only not resizable");
+    verify(writable(), "read-only not resizable");
     if (size_ < new_size) {
       resize_map(next_power_of_two(new_size));
     }
@@ -607,7 +1062,7 @@ struct mmap {
   }
 
   void reserve(size_t const new_size) {
-    verify(prot_ == protection::WRITE, "read-only not resizable");
+    verify(writable(), "read-only not resizable");
     if (size_ < new_size) {
       resize_map(next_power_of_two(new_size));
     }
@@ -628,7 +1083,22 @@ struct mmap {
   unsigned char& operator[](size_t i) { return *(data() + i); }
   unsigned char const& operator[](size_t i) const { return *(data() + i); }
 
+  // Starts reading the given byte range of the file in the background.
+  void prefetch(size_t const offset, size_t const size) const {
+    if (addr_ != nullptr && offset < used_size_) {
+      prefetch_range(data() + offset, std::min(size, used_size_ - offset));
+    }
+  }
+
 private:
+  bool writable() const {
+    return prot_ == protection::WRITE || prot_ == protection::MODIFY;
+  }
+
+  bool has(hint const h) const {
+    return (static_cast<unsigned>(hint_) & static_cast<unsigned>(h)) != 0U;
+  }
+
   void unmap() {
 #ifdef _MSC_VER
     if (addr_ != nullptr) {
@@ -652,28 +1122,83 @@ private:
     auto const size_low = static_cast<DWORD>(size_);
     auto const size_high = static_cast<DWORD>(size_ >> 32);
     const auto fm = ::CreateFileMapping(
-        f_.f_, 0, prot_ == protection::READ ? PAGE_READONLY : PAGE_READWRITE,
+        f_.f_, 0,
+        prot_ == protection::READ            ? PAGE_READONLY
+        : prot_ == protection::COPY_ON_WRITE ? PAGE_WRITECOPY
+                                             : PAGE_READWRITE,
         size_high, size_low, 0);
     verify(fm != INVALID_HANDLE_VALUE, "file mapping error");
     file_mapping_ = fm;
 
     auto const addr = ::MapViewOfFile(
-        fm, prot_ == protection::READ ? FILE_MAP_READ : FILE_MAP_WRITE, OFFSET,
-        OFFSET, size_);
+        fm,
+        prot_ == protection::READ            ? FILE_MAP_READ
+        : prot_ == protection::COPY_ON_WRITE ? FILE_MAP_COPY
+                                             : FILE_MAP_WRITE,
+        OFFSET, OFFSET, size_);
     verify(addr != nullptr, "map error");
 
     return addr;
 #else
-    auto const addr = ::mmap(nullptr, size_,
-                             prot_ == protection::READ ? PROT_READ : PROT_WRITE,
-                             MAP_SHARED, f_.fd(), OFFSET);
+    auto flags =
+        prot_ == protection::COPY_ON_WRITE ? MAP_PRIVATE : MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (has(hint::POPULATE)) {
+      flags |= MAP_POPULATE;
+    }
+#endif
+    auto const prot = prot_ == protection::READ    ? PROT_READ
+                      : prot_ == protection::WRITE ? PROT_WRITE
+                                                   : PROT_READ | PROT_WRITE;
+    auto const fixed = has(hint::HUGE_PAGES) ? reserve_aligned() : nullptr;
+    auto const addr =
+        ::mmap(fixed, size_, prot, fixed == nullptr ? flags : flags | MAP_FIXED,
+               f_.fd(), OFFSET);
+    if (addr == MAP_FAILED && fixed != nullptr) {
+      ::munmap(fixed, size_);
+    }
     verify(addr != MAP_FAILED, "map error");
+
+#ifdef MADV_HUGEPAGE
+    if (has(hint::HUGE_PAGES)) {
+      ::madvise(addr, size_, MADV_HUGEPAGE);
+    }
+#endif
+    if (has(hint::SEQUENTIAL)) {
+      ::madvise(addr, size_, MADV_SEQUENTIAL);
+    } else if (has(hint::RANDOM)) {
+      ::madvise(addr, size_, MADV_RANDOM);
+    }
     return addr;
 #endif
   }
 
+#ifndef _MSC_VER
+  // Reserves address space for size_ bytes starting at a huge page
+  // boundary. The file is then mapped over it with MAP_FIXED.
+  void* reserve_aligned() const {
+    auto const page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+    auto const reserved = size_ + HUGE_PAGE_SIZE;
+    auto const r = ::mmap(nullptr, reserved, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    verify(r != MAP_FAILED, "map error");
+
+    auto const begin = reinterpret_cast<uintptr_t>(r);
+    auto const end = begin + reserved;
+    auto const aligned = (begin + HUGE_PAGE_SIZE - 1U) & ~(HUGE_PAGE_SIZE - 1U);
+    auto const used_end = (aligned + size_ + page - 1U) & ~(page - 1U);
+    if (aligned != begin) {
+      ::munmap(r, aligned - begin);
+    }
+    if (used_end < end) {
+      ::munmap(reinterpret_cast<void*>(used_end), end - used_end);
+    }
+    return reinterpret_cast<void*>(aligned);
+  }
+#endif
+
   void resize_file() {
-    if (prot_ == protection::READ) {
+    if (!writable()) {
       return;
     }
 
@@ -693,7 +1218,7 @@ private:
   }
 
   void resize_map(size_t const new_size) {
-    if (prot_ == protection::READ) {
+    if (!writable()) {
       return;
     }
 
@@ -707,6 +1232,7 @@ private:
   protection prot_;
   size_t size_;
   size_t used_size_;
+  hint hint_{hint::NONE};
   void* addr_;
 #ifdef _MSC_VER
   HANDLE file_mapping_;
@@ -1181,6 +1707,9 @@ enum class mode {
   SERIALIZE_BIG_ENDIAN = 1U << 3U,
   DEEP_CHECK = 1U << 4U,
   CAST = 1U << 5U,
+  FAST_INTEGRITY = 1U << 6U,  // WITH_INTEGRITY uses chunked_checksum()
+  WITH_SCHEMA = 1U << 7U,  // field table for versioned_view
+  _SHALLOW = 1U << 28U,
   _CONST = 1U << 29U,
   _PHASE_II = 1U << 30U
 };
@@ -1284,6 +1813,22 @@ constexpr T convert_endian(T t) {
 #undef CISTA_BYTESWAP_32
 #undef CISTA_BYTESWAP_64
 
+// Group probing width of hash_storage. Define CISTA_SIMD_GROUP to probe 16
+// (SSE2) or 32 (AVX2) control bytes at once instead of the portable 8.
+// The width determines the probe sequence and the number of cloned control
+// bytes, i.e. it is part of the serialized layout: buffers have to be read
+// with the same setting they were written with (mode::WITH_VERSION detects a
+// mismatch, the width is part of the type hash).
+#if defined(CISTA_SIMD_GROUP) && defined(__AVX2__)
+#define CISTA_GROUP_AVX2
+#include <immintrin.h>
+#elif defined(CISTA_SIMD_GROUP) &&                        \
+    (defined(__SSE2__) || defined(_M_X64) ||               \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define CISTA_GROUP_SSE2
+#include <emmintrin.h>
+#endif
+
 namespace cista {
 
 // This class is a generic hash-based container.
@@ -1298,7 +1843,7 @@ namespace cista {
 // https://github.com/abseil/abseil-cpp/blob/master/absl/container/internal/raw_hash_set.h
 //
 // Missing features of this implemenation compared to the original:
-//   - SSE to speedup the lookup in the ctrl data structure
+//   - SSE lookup is opt-in (CISTA_SIMD_GROUP, see above)
 //   - sanitizer support (Sanitizer[Un]PoisonMemoryRegion)
 //   - overloads (conveniance as well to reduce copying) in the interface
 //   - allocator support
@@ -1306,18 +1851,62 @@ template <typename T, template <typename> typename Ptr, typename SizeType,
           typename GetKey, typename GetValue, typename Hash, typename Eq>
 struct hash_storage {
   static_assert(std::is_unsigned_v<SizeType>, "unsupported signed size type");
+#if defined(CISTA_GROUP_AVX2)
+  static constexpr SizeType const WIDTH = 32U;
+#elif defined(CISTA_GROUP_SSE2)
+  static constexpr SizeType const WIDTH = 16U;
+#else
   static constexpr SizeType const WIDTH = 8U;
+#endif
+
+  // Bytes of the shared control block used by empty containers.
+  // Must cover a full group plus the END byte.
+  static constexpr SizeType const EMPTY_GROUP_SIZE =
+      WIDTH == 8U ? 16U : 2U * WIDTH;
 
   using entry_t = T;
   using difference_type = ptrdiff_t;
   using size_type = SizeType;
+  using get_key_t = GetKey;
+  using get_value_t = GetValue;
+  using eq_t = Eq;
   using key_t =
       decay_t<decltype(std::declval<GetKey>().operator()(std::declval<T>()))>;
   using mapped_type =
       decay_t<decltype(std::declval<GetValue>().operator()(std::declval<T>()))>;
-  using group_t = uint64_t;
+#if defined(CISTA_GROUP_AVX2) || defined(CISTA_GROUP_SSE2)
+  // One bit per slot, as returned by movemask.
+  using mask_t = uint32_t;
+  static constexpr auto const MASK_SHIFT = 0U;
+#else
+  // One byte per slot, only its most significant bit is used.
+  using mask_t = uint64_t;
+  static constexpr auto const MASK_SHIFT = 3U;
+#endif
   using h2_t = uint8_t;
 
+  // Keys with a hash() member (e.g. hashed_string) carry their hash: it
+  // is compared before the key itself.
+  template <typename Key>
+  static constexpr auto stores_hash(int)
+      -> decltype(std::declval<Key const&>().hash(), bool{}) {
+    return true;
+  }
+  template <typename Key>
+  static constexpr bool stores_hash(...) {
+    return false;
+  }
+
+  static bool hash_matches(key_t const& k, size_type const hash) {
+    if constexpr (stores_hash<key_t>(0)) {
+      return static_cast<size_type>(k.hash()) == hash;
+    } else {
+      (void)k;
+      (void)hash;
+      return true;
+    }
+  }
+
   template <typename Key>
   size_type compute_hash(Key const& k) {
     if constexpr (std::is_same_v<decay_t<Key>, key_t>) {
@@ -1350,9 +1939,9 @@ struct hash_storage {
   };
 
   struct bit_mask {
-    static constexpr auto const SHIFT = 3U;
+    static constexpr auto const SHIFT = MASK_SHIFT;
 
-    explicit bit_mask(group_t mask) : mask_{mask} {}
+    explicit bit_mask(mask_t mask) : mask_{mask} {}
 
     bit_mask& operator++() {
       mask_ &= (mask_ - 1);
@@ -1371,18 +1960,67 @@ struct hash_storage {
     }
 
     size_type leading_zeros() const {
-      constexpr int total_significant_bits = 8 << SHIFT;
-      constexpr int extra_bits = sizeof(group_t) * 8 - total_significant_bits;
-      return ::cista::leading_zeros(mask_ << extra_bits) >> SHIFT;
+      constexpr int total_significant_bits = WIDTH << SHIFT;
+      constexpr int extra_bits = sizeof(mask_t) * 8 - total_significant_bits;
+      return ::cista::leading_zeros(
+                 static_cast<mask_t>(mask_ << extra_bits)) >>
+             SHIFT;
     }
 
     friend bool operator!=(bit_mask const& a, bit_mask const& b) {
       return a.mask_ != b.mask_;
     }
 
-    group_t mask_;
+    mask_t mask_;
   };
 
+#if defined(CISTA_GROUP_AVX2)
+  struct group {
+    explicit group(ctrl_t const* pos)
+        : ctrl_{_mm256_loadu_si256(reinterpret_cast<__m256i const*>(pos))} {}
+    bit_mask match(h2_t const hash) const {
+      return mask_of(
+          _mm256_cmpeq_epi8(_mm256_set1_epi8(static_cast<char>(hash)), ctrl_));
+    }
+    bit_mask match_empty() const {
+      return mask_of(_mm256_cmpeq_epi8(_mm256_set1_epi8(EMPTY), ctrl_));
+    }
+    bit_mask match_empty_or_deleted() const {
+      return mask_of(_mm256_cmpgt_epi8(_mm256_set1_epi8(END), ctrl_));
+    }
+    size_t count_leading_empty_or_deleted() const {
+      // 64bit: all 32 lanes set must not wrap around to zero.
+      return ::cista::trailing_zeros(
+          uint64_t{match_empty_or_deleted().mask_} + 1U);
+    }
+    static bit_mask mask_of(__m256i const v) {
+      return bit_mask{static_cast<mask_t>(_mm256_movemask_epi8(v))};
+    }
+    __m256i ctrl_;
+  };
+#elif defined(CISTA_GROUP_SSE2)
+  struct group {
+    explicit group(ctrl_t const* pos)
+        : ctrl_{_mm_loadu_si128(reinterpret_cast<__m128i const*>(pos))} {}
+    bit_mask match(h2_t const hash) const {
+      return mask_of(
+          _mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(hash)), ctrl_));
+    }
+    bit_mask match_empty() const {
+      return mask_of(_mm_cmpeq_epi8(_mm_set1_epi8(EMPTY), ctrl_));
+    }
+    bit_mask match_empty_or_deleted() const {
+      return mask_of(_mm_cmpgt_epi8(_mm_set1_epi8(END), ctrl_));
+    }
+    size_t count_leading_empty_or_deleted() const {
+      return ::cista::trailing_zeros(match_empty_or_deleted().mask_ + 1U);
+    }
+    static bit_mask mask_of(__m128i const v) {
+      return bit_mask{static_cast<mask_t>(_mm_movemask_epi8(v))};
+    }
+    __m128i ctrl_;
+  };
+#else
   struct group {
     static constexpr auto MSBS = 0x8080808080808080ULL;
     static constexpr auto LSBS = 0x0101010101010101ULL;
@@ -1408,8 +2046,9 @@ struct hash_storage {
       return (trailing_zeros(((~ctrl_ & (ctrl_ >> 7U)) | GAPS) + 1U) + 7U) >>
              3U;
     }
-    group_t ctrl_;
+    uint64_t ctrl_;
   };
+#endif
 
   struct iterator {
     using iterator_category = std::forward_iterator_tag;
@@ -1489,10 +2128,17 @@ struct hash_storage {
   };
 
   static inline ctrl_t* empty_group() {
-    alignas(16) static constexpr ctrl_t empty_group[] = {
-        END,   EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, EMPTY,
-        EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, EMPTY, EMPTY};
-    return const_cast<ctrl_t*>(empty_group);
+    struct empty_group_t {
+      constexpr empty_group_t() {
+        ctrl_[0] = END;
+        for (auto i = 1U; i != EMPTY_GROUP_SIZE; ++i) {
+          ctrl_[i] = EMPTY;
+        }
+      }
+      alignas(16) ctrl_t ctrl_[EMPTY_GROUP_SIZE]{};
+    };
+    static constexpr empty_group_t empty_group{};
+    return const_cast<ctrl_t*>(empty_group.ctrl_);
   }
 
   static inline bool is_empty(ctrl_t const c) { return c == EMPTY; }
@@ -1633,7 +2279,8 @@ struct hash_storage {
     for (auto seq = probe_seq{h1(hash), capacity_}; true; seq.next()) {
       group g{ctrl_ + seq.offset_};
       for (auto const i : g.match(h2(hash))) {
-        if (Eq{}(GetKey()(entries_[seq.offset(i)]), key)) {
+        auto const& k = GetKey()(entries_[seq.offset(i)]);
+        if (hash_matches(k, hash) && Eq{}(k, key)) {
           return iterator_at(seq.offset(i));
         }
       }
@@ -1786,7 +2433,8 @@ struct hash_storage {
     for (auto seq = probe_seq{h1(hash), capacity_}; true; seq.next()) {
       group g{ctrl_ + seq.offset_};
       for (auto const i : g.match(h2(hash))) {
-        if (Eq{}(GetKey()(entries_[seq.offset(i)]), key)) {
+        auto const& k = GetKey()(entries_[seq.offset(i)]);
+        if (hash_matches(k, hash) && Eq{}(k, key)) {
           return {seq.offset(i), false};
         }
       }
@@ -1868,6 +2516,7 @@ struct hash_storage {
         auto const new_index = target.offset_;
         set_ctrl(new_index, h2(hash));
         new (entries_ + new_index) T{std::move(old_entries[i])};
+        old_entries[i].~T();
       }
     }
 
@@ -3139,6 +3788,13 @@ inline void for_each_field(Fn&& fn) {
 
 }  // namespace cista
 
+// SSE2 is part of x86-64, string_equal() uses it whenever available.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CISTA_STRING_SSE2
+#include <emmintrin.h>
+#endif
+
 namespace cista {
 
 namespace detail {
@@ -3195,6 +3851,84 @@ constexpr bool is_string_like_v =
 template <typename A, typename B>
 constexpr bool is_ptr_same = is_pointer_v<A>&& is_pointer_v<B>;
 
+// Hash stored by hashed_string. Without CISTA_XXH3, hash() is byte-wise
+// FNV-1a; this uses XXH64 instead, which consumes 32 bytes per round.
+// Other string keys keep hash(), so existing hash maps stay valid.
+inline hash_t string_hash(std::string_view const s,
+                          hash_t const seed = BASE_HASH) {
+#if defined(CISTA_XXH3)
+  return hash(s, seed);
+#else
+  return xxh64(s.data(), s.size(), seed);
+#endif
+}
+
+template <typename T>
+std::string_view string_view_of(T const& s) {
+  if constexpr (is_char_array_v<T>) {
+    return {s, sizeof(s) - 1U};
+  } else {
+    return std::string_view{s};
+  }
+}
+
+namespace detail {
+
+inline bool equal16(char const* a, char const* b) {
+#if defined(CISTA_STRING_SSE2)
+  auto const x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(a));
+  auto const y = _mm_loadu_si128(reinterpret_cast<__m128i const*>(b));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+#else
+  uint64_t x[2], y[2];
+  std::memcpy(x, a, 16U);
+  std::memcpy(y, b, 16U);
+  return ((x[0] ^ y[0]) | (x[1] ^ y[1])) == 0U;
+#endif
+}
+
+template <typename Word>
+bool equal_ends(char const* a, char const* b, std::size_t const n) {
+  Word x[2], y[2];
+  std::memcpy(&x[0], a, sizeof(Word));
+  std::memcpy(&x[1], a + n - sizeof(Word), sizeof(Word));
+  std::memcpy(&y[0], b, sizeof(Word));
+  std::memcpy(&y[1], b + n - sizeof(Word), sizeof(Word));
+  return ((x[0] ^ y[0]) | (x[1] ^ y[1])) == 0U;
+}
+
+}  // namespace detail
+
+// Compares 16 bytes per step. Shorter strings and the tail are compared
+// with two overlapping loads instead of a byte loop.
+inline bool string_equal(std::string_view const a, std::string_view const b) {
+  auto const n = a.size();
+  if (n != b.size()) {
+    return false;
+  }
+  auto const x = a.data();
+  auto const y = b.data();
+  if (n >= 16U) {
+    for (auto i = std::size_t{0U}; i < n - 16U; i += 16U) {
+      if (!detail::equal16(x + i, y + i)) {
+        return false;
+      }
+    }
+    return detail::equal16(x + n - 16U, y + n - 16U);
+  } else if (n >= 8U) {
+    return detail::equal_ends<uint64_t>(x, y, n);
+  } else if (n >= 4U) {
+    return detail::equal_ends<uint32_t>(x, y, n);
+  } else {
+    for (auto i = std::size_t{0U}; i != n; ++i) {
+      if (x[i] != y[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+}
+
 template <typename T>
 struct hashing {
   template <typename A, typename B>
@@ -3287,30 +4021,130 @@ hash_t build_hash(Args... args) {
   return h;
 }
 
-}  // namespace cista
+// String key that stores string_hash() of its content next to it. In a
+// hash_storage the stored hash is compared before the characters, so a
+// probe does not touch the characters of a non-matching long string.
+// Lookups can use any string type, e.g. std::string_view.
+template <typename Ptr>
+struct basic_hashed_string {
+  basic_hashed_string() : hash_{string_hash({})} {}
+  basic_hashed_string(std::string_view s) : str_{s}, hash_{string_hash(s)} {}
+  basic_hashed_string(std::string const& s)
+      : basic_hashed_string{std::string_view{s}} {}
+  basic_hashed_string(char const* s)
+      : basic_hashed_string{std::string_view{s}} {}
+
+  std::string_view view() const { return str_.view(); }
+  operator std::string_view() const { return view(); }
+  std::string str() const { return str_.str(); }
 
-namespace cista {
+  char const* data() const { return str_.data(); }
+  std::size_t size() const { return str_.size(); }
+  bool empty() const { return str_.empty(); }
+  char const* begin() const { return data(); }
+  char const* end() const { return data() + size(); }
 
-struct get_first {
-  template <typename T>
-  auto&& operator()(T&& t) {
-    return t.first;
+  hash_t hash() const { return hash_; }
+
+  friend bool operator==(basic_hashed_string const& a,
+                         basic_hashed_string const& b) {
+    return a.hash_ == b.hash_ && string_equal(a.view(), b.view());
+  }
+  friend bool operator!=(basic_hashed_string const& a,
+                         basic_hashed_string const& b) {
+    return !(a == b);
   }
-};
 
-struct get_second {
-  template <typename T>
-  auto&& operator()(T&& t) {
-    return t.second;
+  friend std::ostream& operator<<(std::ostream& out,
+                                  basic_hashed_string const& s) {
+    return out << s.view();
   }
+
+  basic_string<Ptr> str_;
+  hash_t hash_;
 };
 
-namespace raw {
-template <typename Key, typename Value, typename Hash = hashing<Key>,
-          typename Eq = equal_to<Key>>
-using hash_map = hash_storage<pair<Key, Value>, ptr, uint32_t, get_first,
-                              get_second, Hash, Eq>;
-}  // namespace raw
+// Lookups with other string types hash them the way hashed_string does.
+template <typename Ptr>
+struct hashing<basic_hashed_string<Ptr>> {
+  template <typename T1>
+  static constexpr hashing create() {
+    static_assert(std::is_same_v<decay_t<T1>, basic_hashed_string<Ptr>> ||
+                      is_string_like_v<decay_t<T1>>,
+                  "Incompatible types");
+    return hashing{};
+  }
+
+  template <typename S>
+  hash_t operator()(S const& s, hash_t const seed = BASE_HASH) const {
+    if constexpr (std::is_same_v<decay_t<S>, basic_hashed_string<Ptr>>) {
+      return s.hash();
+    } else {
+      return string_hash(string_view_of(s), seed);
+    }
+  }
+};
+
+struct string_equal_to {
+  template <typename A, typename B>
+  bool operator()(A const& a, B const& b) const {
+    return string_equal(string_view_of(a), string_view_of(b));
+  }
+};
+
+template <typename Ptr>
+struct equal_to<generic_string<Ptr>> : string_equal_to {};
+
+template <typename Ptr>
+struct equal_to<basic_string<Ptr>> : string_equal_to {};
+
+template <typename Ptr>
+struct equal_to<basic_string_view<Ptr>> : string_equal_to {};
+
+template <typename Ptr>
+struct equal_to<basic_hashed_string<Ptr>> {
+  template <typename B>
+  bool operator()(basic_hashed_string<Ptr> const& a, B const& b) const {
+    if constexpr (std::is_same_v<decay_t<B>, basic_hashed_string<Ptr>>) {
+      return a == b;
+    } else {
+      return string_equal(a.view(), string_view_of(b));
+    }
+  }
+};
+
+namespace raw {
+using hashed_string = basic_hashed_string<ptr<char const>>;
+}  // namespace raw
+
+namespace offset {
+using hashed_string = basic_hashed_string<ptr<char const>>;
+}  // namespace offset
+
+}  // namespace cista
+
+namespace cista {
+
+struct get_first {
+  template <typename T>
+  auto&& operator()(T&& t) {
+    return t.first;
+  }
+};
+
+struct get_second {
+  template <typename T>
+  auto&& operator()(T&& t) {
+    return t.second;
+  }
+};
+
+namespace raw {
+template <typename Key, typename Value, typename Hash = hashing<Key>,
+          typename Eq = equal_to<Key>>
+using hash_map = hash_storage<pair<Key, Value>, ptr, uint32_t, get_first,
+                              get_second, Hash, Eq>;
+}  // namespace raw
 
 namespace offset {
 template <typename Key, typename Value, typename Hash = hashing<Key>,
@@ -3345,6 +4179,343 @@ using hash_set = hash_storage<T, ptr, uint32_t, identity, identity, Hash, Eq>;
 
 }  // namespace cista
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace cista {
+
+namespace detail {
+
+// Relaxed atomic loads and stores of plain memory. Seqlock readers run
+// concurrently with the writer; with plain accesses that would be a data
+// race even though torn results are thrown away.
+template <typename T>
+T load_relaxed(T const& x) {
+#if defined(__cpp_lib_atomic_ref)
+  return std::atomic_ref<T>{const_cast<T&>(x)}.load(std::memory_order_relaxed);
+#elif defined(__GNUC__) || defined(__clang__)
+  return __atomic_load_n(&x, __ATOMIC_RELAXED);
+#else
+  return *static_cast<T const volatile*>(&x);
+#endif
+}
+
+template <typename T>
+void store_relaxed(T& x, T const v) {
+#if defined(__cpp_lib_atomic_ref)
+  std::atomic_ref<T>{x}.store(v, std::memory_order_relaxed);
+#elif defined(__GNUC__) || defined(__clang__)
+  __atomic_store_n(&x, v, __ATOMIC_RELAXED);
+#else
+  *static_cast<T volatile*>(&x) = v;
+#endif
+}
+
+// Trivially copyable T as a sequence of words of its own alignment.
+template <typename T>
+using word_of_t = std::conditional_t<
+    alignof(T) >= 8U, uint64_t,
+    std::conditional_t<alignof(T) >= 4U, uint32_t,
+                       std::conditional_t<alignof(T) >= 2U, uint16_t,
+                                          uint8_t>>>;
+
+template <typename T>
+T copy_relaxed(T const& src) {
+  using word_t = word_of_t<T>;
+  word_t words[sizeof(T) / sizeof(word_t)];
+  auto const from = reinterpret_cast<word_t const*>(&src);
+  for (auto i = std::size_t{0U}; i != std::size(words); ++i) {
+    words[i] = load_relaxed(from[i]);
+  }
+  T copy;
+  std::memcpy(static_cast<void*>(&copy), words, sizeof(T));
+  return copy;
+}
+
+template <typename T>
+void assign_relaxed(T& dst, T const& src) {
+  using word_t = word_of_t<T>;
+  word_t words[sizeof(T) / sizeof(word_t)];
+  std::memcpy(words, static_cast<void const*>(&src), sizeof(T));
+  auto const to = reinterpret_cast<word_t*>(&dst);
+  for (auto i = std::size_t{0U}; i != std::size(words); ++i) {
+    store_relaxed(to[i], words[i]);
+  }
+}
+
+}  // namespace detail
+
+// Read-mostly hash map for many reader threads and one writer at a time.
+// Keeps the swiss-table layout of hash_storage.
+//
+// Readers never lock: they run the lookup optimistically and retry if
+// the sequence counter shows a concurrent write (seqlock). Writers are
+// serialized by a mutex and update the table in place. A write that would
+// have to rehash instead builds the larger table aside and publishes it
+// atomically (RCU-style). Readers announce themselves in one of two
+// counters picked by a global epoch. Writers advance the epoch once the
+// older counter drains, and free a replaced table two epochs after it
+// was retired, when no reader that could have seen it is left.
+//
+// Readers may see a half-written entry before they discard the attempt.
+// Both sides therefore access ctrl bytes and entries in the shared table
+// with relaxed atomics, key and value have to be trivially copyable, and
+// lookups return a copy of the value instead of an iterator.
+template <typename Map>
+struct concurrent_hash_storage {
+  using map_t = Map;
+  using key_t = typename Map::key_t;
+  using mapped_type = typename Map::mapped_type;
+  using entry_t = typename Map::entry_t;
+
+  static_assert(std::is_trivially_copyable_v<entry_t>,
+                "concurrent hash map: entries must be trivially copyable");
+
+  concurrent_hash_storage()
+      : current_{std::make_unique<map_t>()}, table_{current_.get()} {}
+
+  concurrent_hash_storage(concurrent_hash_storage const&) = delete;
+  concurrent_hash_storage& operator=(concurrent_hash_storage const&) = delete;
+
+  template <typename Key>
+  std::optional<mapped_type> find(Key const& key) const {
+    return read([&](map_t const& m) -> std::optional<mapped_type> {
+      auto const e = lookup(m, key);
+      if (!e.has_value()) {
+        return std::nullopt;
+      }
+      return typename Map::get_value_t{}(*e);
+    });
+  }
+
+  template <typename Key>
+  bool contains(Key const& key) const {
+    return read([&](map_t const& m) { return lookup(m, key).has_value(); });
+  }
+
+  template <typename... Args>
+  bool emplace(Args&&... args) {
+    auto entry = entry_t{std::forward<Args>(args)...};
+    auto const lock = std::lock_guard{write_mutex_};
+    collect();
+    if (current_->find(typename Map::get_key_t{}(entry)) != current_->end()) {
+      return false;
+    }
+    reserve_one();
+    write([&]() { insert_new(entry); });
+    size_.store(current_->size(), std::memory_order_relaxed);
+    return true;
+  }
+
+  bool insert_or_assign(key_t const& key, mapped_type const& value) {
+    auto const lock = std::lock_guard{write_mutex_};
+    collect();
+    auto const it = current_->find(key);
+    if (it != current_->end()) {
+      auto updated = *it;
+      typename Map::get_value_t{}(updated) = value;
+      write([&]() { detail::assign_relaxed(*it, updated); });
+      return false;
+    }
+    reserve_one();
+    write([&]() { insert_new(entry_t{key, value}); });
+    size_.store(current_->size(), std::memory_order_relaxed);
+    return true;
+  }
+
+  template <typename Key>
+  size_t erase(Key const& key) {
+    auto const lock = std::lock_guard{write_mutex_};
+    collect();
+    auto const it = current_->find(key);
+    if (it == current_->end()) {
+      return 0U;
+    }
+    write([&]() { erase_slot(it); });
+    size_.store(current_->size(), std::memory_order_relaxed);
+    return 1U;
+  }
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+  bool empty() const { return size() == 0U; }
+
+  // Writes free retired tables on their own. This does the same without
+  // a write, e.g. once the map stops changing. Returns how many retired
+  // tables are still held because a reader might be using them.
+  size_t reclaim() {
+    auto const lock = std::lock_guard{write_mutex_};
+    collect();
+    collect();
+    return retired_.size();
+  }
+
+  // Direct access for the writer side, e.g. to serialize a snapshot.
+  // The caller has to make sure no write happens concurrently.
+  map_t const& unsafe_table() const { return *current_; }
+
+private:
+  // Marks the calling thread as a reader of the current epoch until
+  // destroyed. A table retired in epoch e can only be seen by readers
+  // registered in an epoch <= e.
+  struct reader_guard {
+    explicit reader_guard(concurrent_hash_storage const& m) {
+      while (true) {
+        auto const e = m.epoch_.load(std::memory_order_seq_cst);
+        count_ = &m.readers_[e & 1U];
+        count_->fetch_add(1U, std::memory_order_seq_cst);
+        if (m.epoch_.load(std::memory_order_seq_cst) == e) {
+          return;
+        }
+        count_->fetch_sub(1U, std::memory_order_release);
+      }
+    }
+    ~reader_guard() { count_->fetch_sub(1U, std::memory_order_release); }
+    reader_guard(reader_guard const&) = delete;
+    reader_guard& operator=(reader_guard const&) = delete;
+    std::atomic<size_t>* count_;
+  };
+
+  template <typename Fn>
+  auto read(Fn&& fn) const {
+    auto const guard = reader_guard{*this};
+    while (true) {
+      auto const before = seq_.load(std::memory_order_acquire);
+      if ((before & 1U) != 0U) {
+        std::this_thread::yield();
+        continue;
+      }
+      auto const result = fn(*table_.load(std::memory_order_acquire));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq_.load(std::memory_order_relaxed) == before) {
+        return result;
+      }
+    }
+  }
+
+  // hash_storage::find() with relaxed atomic reads of the shared table.
+  // The header fields used here do not change after publication.
+  template <typename Key>
+  static std::optional<entry_t> lookup(map_t const& m, Key const& key) {
+    auto const hash = const_cast<map_t&>(m).compute_hash(key);
+    for (auto seq = typename map_t::probe_seq{map_t::h1(hash), m.capacity_};
+         true; seq.next()) {
+      typename map_t::ctrl_t ctrl[map_t::WIDTH];
+      for (auto i = std::size_t{0U}; i != map_t::WIDTH; ++i) {
+        ctrl[i] = detail::load_relaxed(m.ctrl_[seq.offset_ + i]);
+      }
+      auto const g = typename map_t::group{ctrl};
+      for (auto const i : g.match(map_t::h2(hash))) {
+        auto const e = detail::copy_relaxed(m.entries_[seq.offset(i)]);
+        auto const& k = typename Map::get_key_t{}(e);
+        if (map_t::hash_matches(k, hash) && typename Map::eq_t{}(k, key)) {
+          return e;
+        }
+      }
+      if (g.match_empty()) {
+        return std::nullopt;
+      }
+    }
+  }
+
+  // hash_storage::emplace() for a key that is not present, with relaxed
+  // atomic stores. reserve_one() made sure no rehash is needed.
+  void insert_new(entry_t const& entry) {
+    auto& m = *current_;
+    auto const hash = m.compute_hash(typename Map::get_key_t{}(entry));
+    auto const i = m.find_first_non_full(hash).offset_;
+    detail::assign_relaxed(m.entries_[i], entry);
+    m.growth_left_ -= map_t::is_empty(m.ctrl_[i]) ? 1U : 0U;
+    set_ctrl(i, map_t::h2(hash));
+    ++m.size_;
+  }
+
+  // hash_storage::erase_meta_only() with relaxed atomic stores.
+  void erase_slot(typename map_t::iterator const it) {
+    auto& m = *current_;
+    auto const i = static_cast<std::size_t>(it.ctrl_ - m.ctrl_);
+    auto const wnf = m.was_never_full(i);
+    set_ctrl(i, static_cast<typename map_t::h2_t>(wnf ? map_t::EMPTY
+                                                      : map_t::DELETED));
+    m.growth_left_ += wnf ? 1U : 0U;
+    --m.size_;
+  }
+
+  void set_ctrl(std::size_t const i, typename map_t::h2_t const c) {
+    auto& m = *current_;
+    auto const v = static_cast<typename map_t::ctrl_t>(c);
+    detail::store_relaxed(m.ctrl_[i], v);
+    detail::store_relaxed(m.ctrl_[((i - map_t::WIDTH) & m.capacity_) + 1U +
+                                  ((map_t::WIDTH - 1U) & m.capacity_)],
+                          v);
+  }
+
+  template <typename Fn>
+  void write(Fn&& fn) {
+    auto const s = seq_.load(std::memory_order_relaxed);
+    seq_.store(s + 1U, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    fn();
+    seq_.store(s + 2U, std::memory_order_release);
+  }
+
+  // Makes sure the next insert into current_ cannot trigger an in-place
+  // rehash. Readers keep using the old table until the new one is published.
+  void reserve_one() {
+    if (current_->growth_left_ != 0U) {
+      return;
+    }
+    auto next = std::make_unique<map_t>();
+    next->resize(static_cast<typename Map::size_type>(
+        current_->capacity_ == 0U ? 1U : current_->capacity_ * 2U + 1U));
+    for (auto const& entry : *current_) {
+      next->emplace(entry);
+    }
+    table_.store(next.get(), std::memory_order_seq_cst);
+    retired_.emplace_back(epoch_.load(std::memory_order_relaxed),
+                          std::move(current_));
+    current_ = std::move(next);
+  }
+
+  // Advances the epoch from e to e + 1 if no reader of epoch e - 1 is left
+  // (it shares its counter with e + 1). Every reader that registered in
+  // an epoch < e is then gone, and so are the users of tables retired then.
+  void collect() {
+    auto const e = epoch_.load(std::memory_order_relaxed);
+    if (readers_[(e + 1U) & 1U].load(std::memory_order_seq_cst) != 0U) {
+      return;
+    }
+    retired_.erase(
+        std::remove_if(begin(retired_), end(retired_),
+                       [&](auto const& r) { return r.first < e; }),
+        end(retired_));
+    epoch_.store(e + 1U, std::memory_order_seq_cst);
+  }
+
+  std::unique_ptr<map_t> current_;
+  std::atomic<map_t const*> table_;
+  std::atomic<uint64_t> seq_{0U};
+  std::atomic<size_t> size_{0U};
+  std::mutex write_mutex_;
+  std::atomic<uint64_t> epoch_{0U};
+  mutable std::atomic<size_t> readers_[2]{0U, 0U};
+  std::vector<std::pair<uint64_t, std::unique_ptr<map_t>>> retired_;
+};
+
+namespace raw {
+template <typename Key, typename Value, typename Hash = hashing<Key>,
+          typename Eq = equal_to<Key>>
+using concurrent_hash_map =
+    concurrent_hash_storage<hash_map<Key, Value, Hash, Eq>>;
+}  // namespace raw
+
+}  // namespace cista
+
 #include <cassert>
 #include <cinttypes>
 #include <cstdlib>
@@ -3722,1120 +4893,3536 @@ CISTA_TO_VEC
 
 }  // namespace cista
 
-#include <cstdio>
-#include <cstring>
-
-#include <memory>
+namespace cista {
 
+// Vector of vectors, all buckets share one data vector. A bucket costs one
+// IndexVec entry (4 bytes for vecvec<T>) instead of a vector header, which
+// adds up for many small vectors. Buckets can only be added at the end.
+// Both members are plain vectors, so the layout is as zero-copy readable
+// as theirs.
+template <typename DataVec, typename IndexVec>
+struct basic_vecvec {
+  using data_value_type = typename DataVec::value_type;
+  using index_value_type = typename IndexVec::value_type;
+
+  template <typename V>
+  struct bucket_view {
+    using value_type = V;
+    using iterator = V*;
+
+    V* begin() const { return begin_; }
+    V* end() const { return end_; }
+    friend V* begin(bucket_view const& b) { return b.begin(); }
+    friend V* end(bucket_view const& b) { return b.end(); }
+
+    V& operator[](size_t const i) const { return begin_[i]; }
+    V& at(size_t const i) const {
+      if (i >= size()) {
+        throw std::out_of_range{"vecvec::bucket::at(): invalid index"};
+      }
+      return begin_[i];
+    }
+    V& front() const { return *begin_; }
+    V& back() const { return *(end_ - 1); }
 
-// Credits: Manu Sánchez (@Manu343726)
-// https://github.com/Manu343726/ctti/blob/master/include/ctti/detail/pretty_function.hpp
+    size_t size() const { return static_cast<size_t>(end_ - begin_); }
+    bool empty() const { return begin_ == end_; }
 
-#include <string>
-#include <string_view>
+    V* begin_;
+    V* end_;
+  };
 
-namespace cista {
+  using bucket = bucket_view<data_value_type>;
+  using const_bucket = bucket_view<data_value_type const>;
 
-#if defined(_MSC_VER)
-#define CISTA_SIG __FUNCSIG__
-#elif defined(__clang__) || defined(__GNUC__)
-#define CISTA_SIG __PRETTY_FUNCTION__
-#else
-#error unsupported compiler
-#endif
+  template <typename VecVec, typename Bucket>
+  struct iterator_base {
+    Bucket operator*() const { return (*v_)[i_]; }
+    iterator_base& operator++() {
+      ++i_;
+      return *this;
+    }
+    friend bool operator==(iterator_base const& a, iterator_base const& b) {
+      return a.i_ == b.i_;
+    }
+    friend bool operator!=(iterator_base const& a, iterator_base const& b) {
+      return a.i_ != b.i_;
+    }
 
-inline void remove_all(std::string& s, std::string_view substr) {
-  auto pos = std::size_t{};
-  while ((pos = s.find(substr, pos)) != std::string::npos) {
-    s.erase(pos, substr.length());
-  }
-}
+    VecVec* v_;
+    size_t i_;
+  };
 
-inline void canonicalize_type_name(std::string& s) {
-  remove_all(s, "{anonymous}::");  // GCC
-  remove_all(s, "(anonymous namespace)::");  // Clang
-  remove_all(s, "`anonymous-namespace'::");  // MSVC
-  remove_all(s, "struct");  // MSVC "struct my_struct" vs "my_struct"
-  remove_all(s, "const");  // MSVC "char const*"" vs "const char*"
-  remove_all(s, " ");  // MSVC
-}
+  using iterator = iterator_base<basic_vecvec, bucket>;
+  using const_iterator = iterator_base<basic_vecvec const, const_bucket>;
 
-template <typename T>
-constexpr std::string_view type_str() {
-#if defined(__clang__)
-  constexpr std::string_view prefix =
-      "std::string_view cista::type_str() [T = ";
-  constexpr std::string_view suffix = "]";
-#elif defined(_MSC_VER)
-  constexpr std::string_view prefix =
-      "class std::basic_string_view<char,struct std::char_traits<char> > "
-      "__cdecl cista::type_str<";
-  constexpr std::string_view suffix = ">(void)";
-#else
-  constexpr std::string_view prefix =
-      "constexpr std::string_view cista::type_str() [with T = ";
-  constexpr std::string_view suffix =
-      "; std::string_view = std::basic_string_view<char>]";
-#endif
+  bucket operator[](size_t const i) {
+    return {data_.begin() + bucket_starts_[i],
+            data_.begin() + bucket_starts_[i + 1U]};
+  }
 
-  auto sig = std::string_view{CISTA_SIG};
-  sig.remove_prefix(prefix.size());
-  sig.remove_suffix(suffix.size());
-  return sig;
-}
+  const_bucket operator[](size_t const i) const {
+    return {data_.begin() + bucket_starts_[i],
+            data_.begin() + bucket_starts_[i + 1U]};
+  }
 
-template <typename T>
-std::string canonical_type_str() {
-  auto const base = type_str<T>();
-  std::string s{base.data(), base.length()};
-  canonicalize_type_name(s);
-  return s;
-}
+  bucket at(size_t const i) {
+    if (i >= size()) {
+      throw std::out_of_range{"vecvec::at(): invalid index"};
+    }
+    return (*this)[i];
+  }
 
-}  // namespace cista
+  const_bucket at(size_t const i) const {
+    if (i >= size()) {
+      throw std::out_of_range{"vecvec::at(): invalid index"};
+    }
+    return (*this)[i];
+  }
 
-#undef CISTA_SIG
+  bucket front() { return (*this)[0U]; }
+  const_bucket front() const { return (*this)[0U]; }
+  bucket back() { return (*this)[size() - 1U]; }
+  const_bucket back() const { return (*this)[size() - 1U]; }
 
-namespace cista {
+  iterator begin() { return {this, 0U}; }
+  iterator end() { return {this, size()}; }
+  const_iterator begin() const { return {this, 0U}; }
+  const_iterator end() const { return {this, size()}; }
+  friend iterator begin(basic_vecvec& v) { return v.begin(); }
+  friend iterator end(basic_vecvec& v) { return v.end(); }
+  friend const_iterator begin(basic_vecvec const& v) { return v.begin(); }
+  friend const_iterator end(basic_vecvec const& v) { return v.end(); }
 
-constexpr auto const MAX_ALIGN = 16;
-using byte_buf = std::vector<uint8_t>;
+  size_t size() const {
+    return bucket_starts_.empty() ? 0U : bucket_starts_.size() - 1U;
+  }
+  bool empty() const { return size() == 0U; }
 
-template <typename Buf = byte_buf>
-struct buf {
-  buf() = default;
-  explicit buf(Buf&& buf) : buf_{std::forward<Buf>(buf)} {}
+  template <typename It>
+  void emplace_back(It first, It last) {
+    if (bucket_starts_.empty()) {
+      bucket_starts_.emplace_back(index_value_type{0U});
+    }
+    for (; first != last; ++first) {
+      data_.emplace_back(*first);
+    }
+    verify(data_.size() <= std::numeric_limits<index_value_type>::max(),
+           "vecvec: index type overflow");
+    bucket_starts_.emplace_back(static_cast<index_value_type>(data_.size()));
+  }
 
-  uint8_t* addr(offset_t const offset) { return (&buf_[0]) + offset; }
-  uint8_t* base() { return &buf_[0]; }
+  template <typename Container>
+  void emplace_back(Container const& c) {
+    emplace_back(std::begin(c), std::end(c));
+  }
 
-  uint64_t checksum(offset_t const start = 0) const {
-    return hash(std::string_view{
-        reinterpret_cast<char const*>(&buf_[static_cast<size_t>(start)]),
-        buf_.size() - static_cast<size_t>(start)});
+  void emplace_back(std::initializer_list<data_value_type> init) {
+    emplace_back(init.begin(), init.end());
   }
 
-  template <typename T>
-  void write(std::size_t const pos, T const& val) {
-    verify(buf_.size() >= pos + serialized_size<T>(), "out of bounds write");
-    std::memcpy(&buf_[pos], &val, serialized_size<T>());
+  void clear() {
+    data_.clear();
+    bucket_starts_.clear();
   }
 
-  offset_t write(void const* ptr, std::size_t const size,
-                 std::size_t alignment = 0) {
-    auto aligned_size = size;
+  DataVec data_;
+  IndexVec bucket_starts_;
+};
 
-    if (alignment != 0 && alignment != 1 && buf_.size() != 0) {
-      auto unaligned_ptr = static_cast<void*>(addr(curr_offset_));
-      auto space = std::numeric_limits<std::size_t>::max();
-      auto const aligned_ptr =
-          std::align(alignment, size, unaligned_ptr, space);
-      auto const new_offset = static_cast<offset_t>(
-          aligned_ptr ? static_cast<uint8_t*>(aligned_ptr) - base() : 0);
-      auto const adjustment =
-          static_cast<std::size_t>(new_offset - curr_offset_);
-      curr_offset_ += adjustment;
-      aligned_size += adjustment;
-    }
+namespace raw {
 
-    auto const space_left =
-        static_cast<int64_t>(buf_.size()) - static_cast<int64_t>(curr_offset_);
-    if (space_left < static_cast<int64_t>(aligned_size)) {
-      auto const missing = static_cast<std::size_t>(
-          static_cast<int64_t>(aligned_size) - space_left);
-      buf_.resize(buf_.size() + missing);
-    }
+template <typename T, typename SizeType = uint32_t>
+using vecvec = basic_vecvec<vector<T>, vector<SizeType>>;
 
-    auto const start = curr_offset_;
-    std::memcpy(addr(curr_offset_), ptr, size);
-    curr_offset_ += size;
-    return start;
-  }
+}  // namespace raw
 
-  unsigned char& operator[](size_t i) { return buf_[i]; }
-  unsigned char const& operator[](size_t i) const { return buf_[i]; }
-  size_t size() const { return buf_.size(); }
+namespace offset {
 
-  Buf buf_;
-  offset_t curr_offset_{0};
-};
+template <typename T, typename SizeType = uint32_t>
+using vecvec = basic_vecvec<vector<T>, vector<SizeType>>;
 
-template <typename Buf>
-buf(Buf &&)->buf<Buf>;
+}  // namespace offset
 
 }  // namespace cista
 
-#include <map>
+namespace cista {
 
+namespace detail {
 
-#include <type_traits>
+// One Vec per member type. Nested instead of std::tuple to stay an
+// aggregate, i.e. serializable like any other struct.
+template <template <typename> typename Vec, typename... Ts>
+struct soa_columns;
 
-namespace cista {
+template <template <typename> typename Vec, typename T>
+struct soa_columns<Vec, T> {
+  Vec<T> head_;
+};
 
-template <typename T>
-struct indexed : public T {
-  using value_type = T;
-  using T::T;
-  using T::operator=;
+template <template <typename> typename Vec, typename T, typename... Rest>
+struct soa_columns<Vec, T, Rest...> {
+  Vec<T> head_;
+  soa_columns<Vec, Rest...> tail_;
 };
 
-template <typename Ptr>
-struct is_indexed_helper : std::false_type {};
+template <template <typename> typename Vec, typename Tuple>
+struct soa_columns_for;
 
-template <typename T>
-struct is_indexed_helper<indexed<T>> : std::true_type {};
+template <template <typename> typename Vec, typename... Ts>
+struct soa_columns_for<Vec, std::tuple<Ts...>> {
+  using type = soa_columns<Vec, std::remove_reference_t<Ts>...>;
+};
 
-template <class T>
-constexpr inline bool is_indexed_v =
-    is_indexed_helper<std::remove_cv_t<T>>::value;
+template <std::size_t I, typename Columns>
+auto& soa_column(Columns& c) {
+  if constexpr (I == 0U) {
+    return c.head_;
+  } else {
+    return soa_column<I - 1U>(c.tail_);
+  }
+}
 
-}  // namespace cista
+}  // namespace detail
 
-namespace cista {
+// Struct of arrays: every member of T (as seen by to_tuple) is stored in
+// its own vector. Scanning one member only touches that column, which is a
+// contiguous array (column<I>().data()) suitable for vectorized loops.
+// Rows are accessed through proxies: s[i].get<I>() or s[i].value().
+template <typename T, template <typename> typename Vec>
+struct basic_soa {
+  using value_type = T;
+  using tuple_t = decltype(to_tuple(std::declval<T&>()));
+  using columns_t = typename detail::soa_columns_for<Vec, tuple_t>::type;
+  static constexpr auto const COLUMNS = arity<T>();
+  static_assert(COLUMNS != 0U, "soa needs at least one member");
+
+  template <std::size_t I>
+  using member_t = std::remove_reference_t<std::tuple_element_t<I, tuple_t>>;
+
+  template <typename Soa>
+  struct row_proxy {
+    template <std::size_t I>
+    auto& get() const {
+      return soa_->template column<I>()[i_];
+    }
 
-template <typename T>
-hash_t type2str_hash() {
-  return hash_combine(hash(canonical_type_str<decay_t<T>>()), sizeof(T));
-}
+    T value() const {
+      auto v = T{};
+      auto t = to_tuple(v);
+      soa_->for_each_column([&](auto i, auto& col) {
+        std::get<decltype(i)::value>(t) = col[i_];
+      });
+      return v;
+    }
 
-template <typename T>
-hash_t type_hash(T const& el, hash_t h, std::map<hash_t, unsigned>& done) {
-  using Type = decay_t<T>;
+    row_proxy const& operator=(T const& v) const {
+      auto t = to_tuple(v);
+      soa_->for_each_column([&](auto i, auto& col) {
+        col[i_] = std::get<decltype(i)::value>(t);
+      });
+      return *this;
+    }
 
-  auto const base_hash = type2str_hash<Type>();
-  auto [it, inserted] =
-      done.try_emplace(base_hash, static_cast<unsigned>(done.size()));
-  if (!inserted) {
-    return hash_combine(h, it->second);
+    Soa* soa_;
+    std::size_t i_;
+  };
+
+  using row = row_proxy<basic_soa>;
+  using const_row = row_proxy<basic_soa const>;
+
+  template <typename Soa, typename Row>
+  struct iterator_base {
+    Row operator*() const { return {soa_, i_}; }
+    iterator_base& operator++() {
+      ++i_;
+      return *this;
+    }
+    friend bool operator==(iterator_base const& a, iterator_base const& b) {
+      return a.i_ == b.i_;
+    }
+    friend bool operator!=(iterator_base const& a, iterator_base const& b) {
+      return a.i_ != b.i_;
+    }
+
+    Soa* soa_;
+    std::size_t i_;
+  };
+
+  using iterator = iterator_base<basic_soa, row>;
+  using const_iterator = iterator_base<basic_soa const, const_row>;
+
+  template <std::size_t I>
+  Vec<member_t<I>>& column() {
+    return detail::soa_column<I>(columns_);
   }
 
-  if constexpr (is_pointer_v<Type>) {
-    using PointeeType = remove_pointer_t<Type>;
-    if constexpr (std::is_same_v<PointeeType, void>) {
-      return hash_combine(h, hash("void*"));
-    } else {
-      return type_hash(remove_pointer_t<Type>{},
-                       hash_combine(h, hash("pointer")), done);
+  template <std::size_t I>
+  Vec<member_t<I>> const& column() const {
+    return detail::soa_column<I>(columns_);
+  }
+
+  // Calls fn(std::integral_constant<size_t, I>, column<I>()) for all I.
+  template <typename Fn>
+  void for_each_column(Fn&& fn) {
+    for_each_column(std::forward<Fn>(fn),
+                    std::make_index_sequence<COLUMNS>{});
+  }
+
+  template <typename Fn>
+  void for_each_column(Fn&& fn) const {
+    for_each_column(std::forward<Fn>(fn),
+                    std::make_index_sequence<COLUMNS>{});
+  }
+
+  row operator[](std::size_t const i) { return {this, i}; }
+  const_row operator[](std::size_t const i) const { return {this, i}; }
+
+  row at(std::size_t const i) {
+    if (i >= size()) {
+      throw std::out_of_range{"soa::at(): invalid index"};
     }
-  } else if constexpr (std::is_integral_v<Type>) {
-    return hash_combine(h, hash("i"), sizeof(Type));
-  } else if constexpr (std::is_scalar_v<Type>) {
-    return hash_combine(h, type2str_hash<T>());
-  } else {
-    static_assert(to_tuple_works_v<Type>, "Please implement custom type hash.");
-    h = hash_combine(h, hash("struct"));
-    for_each_field(el,
-                   [&](auto const& member) { h = type_hash(member, h, done); });
-    return h;
+    return (*this)[i];
   }
-}
 
-template <typename T, size_t Size>
-hash_t type_hash(array<T, Size> const&, hash_t h,
-                 std::map<hash_t, unsigned>& done) {
-  h = hash_combine(h, hash("array"));
-  h = hash_combine(h, Size);
-  return type_hash(T{}, h, done);
-}
+  const_row at(std::size_t const i) const {
+    if (i >= size()) {
+      throw std::out_of_range{"soa::at(): invalid index"};
+    }
+    return (*this)[i];
+  }
 
-template <typename T, typename Ptr, bool Indexed, typename TemplateSizeType>
-hash_t type_hash(basic_vector<T, Ptr, Indexed, TemplateSizeType> const&,
-                 hash_t h, std::map<hash_t, unsigned>& done) {
-  h = hash_combine(h, hash("vector"));
-  return type_hash(T{}, h, done);
-}
+  iterator begin() { return {this, 0U}; }
+  iterator end() { return {this, size()}; }
+  const_iterator begin() const { return {this, 0U}; }
+  const_iterator end() const { return {this, size()}; }
+  friend iterator begin(basic_soa& s) { return s.begin(); }
+  friend iterator end(basic_soa& s) { return s.end(); }
+  friend const_iterator begin(basic_soa const& s) { return s.begin(); }
+  friend const_iterator end(basic_soa const& s) { return s.end(); }
 
-template <typename T, typename Ptr>
-hash_t type_hash(basic_unique_ptr<T, Ptr> const&, hash_t h,
-                 std::map<hash_t, unsigned>& done) {
-  h = hash_combine(h, hash("unique_ptr"));
-  return type_hash(T{}, h, done);
-}
+  std::size_t size() const { return column<0U>().size(); }
+  bool empty() const { return size() == 0U; }
 
-template <typename T, template <typename> typename Ptr,
-          typename TemplateSizeType, typename GetKey, typename GetValue,
-          typename Hash, typename Eq>
-hash_t type_hash(
-    hash_storage<T, Ptr, TemplateSizeType, GetKey, GetValue, Hash, Eq> const&,
-    hash_t h, std::map<hash_t, unsigned>& done) {
-  h = hash_combine(h, hash("hash_storage"));
-  return type_hash(T{}, h, done);
-}
+  void push_back(T const& v) {
+    auto t = to_tuple(v);
+    for_each_column([&](auto i, auto& col) {
+      col.push_back(std::get<decltype(i)::value>(t));
+    });
+  }
 
-template <typename Ptr>
-hash_t type_hash(generic_string<Ptr> const&, hash_t h,
-                 std::map<hash_t, unsigned>&) {
-  return hash_combine(h, hash("string"));
-}
+  void reserve(std::size_t const n) {
+    for_each_column([&](auto, auto& col) { col.reserve(n); });
+  }
 
-template <typename Ptr>
-hash_t type_hash(basic_string<Ptr> const&, hash_t h,
-                 std::map<hash_t, unsigned>&) {
-  return hash_combine(h, hash("string"));
-}
+  void clear() {
+    for_each_column([&](auto, auto& col) { col.clear(); });
+  }
 
-template <typename Ptr>
-hash_t type_hash(basic_string_view<Ptr> const&, hash_t h,
-                 std::map<hash_t, unsigned>&) {
-  return hash_combine(h, hash("string"));
-}
+  columns_t columns_;
+
+private:
+  template <typename Fn, std::size_t... I>
+  void for_each_column(Fn&& fn, std::index_sequence<I...>) {
+    (fn(std::integral_constant<std::size_t, I>{}, column<I>()), ...);
+  }
+
+  template <typename Fn, std::size_t... I>
+  void for_each_column(Fn&& fn, std::index_sequence<I...>) const {
+    (fn(std::integral_constant<std::size_t, I>{}, column<I>()), ...);
+  }
+};
+
+namespace raw {
 
 template <typename T>
-hash_t type_hash(indexed<T> const&, hash_t h,
-                 std::map<hash_t, unsigned>& done) {
-  return type_hash(T{}, h, done);
-}
+using soa = basic_soa<T, vector>;
+
+}  // namespace raw
+
+namespace offset {
 
 template <typename T>
-hash_t type_hash() {
-  auto done = std::map<hash_t, unsigned>{};
-  return type_hash(T{}, BASE_HASH, done);
-}
+using soa = basic_soa<T, vector>;
 
-}  // namespace cista
+}  // namespace offset
 
-#define CISTA_UNUSED_PARAM(param) (void)(param);
+}  // namespace cista
 
-#ifndef cista_member_offset
-#define cista_member_offset(s, m) (static_cast<cista::offset_t>(offsetof(s, m)))
-#endif
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 namespace cista {
 
-// =============================================================================
-// SERIALIZE
-// -----------------------------------------------------------------------------
-struct pending_offset {
-  void const* origin_ptr_;
-  offset_t pos_;
-};
+// Minimal LZ77 block codec in the spirit of LZ4: a sequence is a token
+// (literal length and match length - 4 as nibbles, 15 continues in 255
+// steps), the literals, a 16 bit little endian match offset and the match
+// length extension. The last sequence has literals only.
+namespace lz {
 
-struct vector_range {
-  bool contains(void const* begin, void const* ptr) const {
-    auto const ptr_int = reinterpret_cast<uintptr_t>(ptr);
-    auto const from = reinterpret_cast<uintptr_t>(begin);
-    auto const to =
-        reinterpret_cast<uintptr_t>(begin) + static_cast<uintptr_t>(size_);
-    return ptr_int >= from && ptr_int < to;
+constexpr auto const MIN_MATCH = std::size_t{4U};
+constexpr auto const MAX_OFFSET = std::size_t{65535U};
+constexpr auto const HASH_BITS = 12U;
+
+inline uint32_t read32(uint8_t const* p) {
+  auto v = uint32_t{0U};
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline void write_length(std::vector<uint8_t>& out, std::size_t len) {
+  for (; len >= 255U; len -= 255U) {
+    out.push_back(255U);
   }
+  out.push_back(static_cast<uint8_t>(len));
+}
 
-  offset_t offset_of(void const* begin, void const* ptr) const {
-    return start_ + reinterpret_cast<intptr_t>(ptr) -
-           reinterpret_cast<intptr_t>(begin);
+inline void write_sequence(std::vector<uint8_t>& out, uint8_t const* literals,
+                           std::size_t const literal_len,
+                           std::size_t const offset,
+                           std::size_t const match_len) {
+  auto const lit_nibble = std::min(literal_len, std::size_t{15U});
+  auto const match_nibble =
+      match_len == 0U ? 0U : std::min(match_len - MIN_MATCH, std::size_t{15U});
+  out.push_back(static_cast<uint8_t>(lit_nibble << 4U | match_nibble));
+  if (lit_nibble == 15U) {
+    write_length(out, literal_len - 15U);
+  }
+  out.insert(end(out), literals, literals + literal_len);
+  if (match_len != 0U) {
+    out.push_back(static_cast<uint8_t>(offset & 0xFFU));
+    out.push_back(static_cast<uint8_t>(offset >> 8U));
+    if (match_nibble == 15U) {
+      write_length(out, match_len - MIN_MATCH - 15U);
+    }
   }
+}
 
-  offset_t start_;
-  size_t size_;
-};
+// Appends the compressed form of [in, in + size) to out.
+inline void compress(uint8_t const* in, std::size_t const size,
+                     std::vector<uint8_t>& out) {
+  auto table = std::vector<uint32_t>(1U << HASH_BITS, 0U);
+  auto const hash = [](uint32_t const v) {
+    return (v * 2654435761U) >> (32U - HASH_BITS);
+  };
 
-template <typename Target, mode Mode>
-struct serialization_context {
-  static constexpr auto const MODE = Mode;
+  auto anchor = std::size_t{0U};
+  auto i = std::size_t{0U};
+  while (size >= MIN_MATCH && i <= size - MIN_MATCH) {
+    auto const v = read32(in + i);
+    auto& slot = table[hash(v)];
+    auto const candidate = std::size_t{slot};
+    slot = static_cast<uint32_t>(i);
+    if (candidate >= i || i - candidate > MAX_OFFSET ||
+        read32(in + candidate) != v) {
+      // Skip faster through data that does not compress.
+      i += 1U + ((i - anchor) >> 6U);
+      continue;
+    }
 
-  explicit serialization_context(Target& t) : t_{t} {}
+    auto len = MIN_MATCH;
+    while (i + len < size && in[candidate + len] == in[i + len]) {
+      ++len;
+    }
+    write_sequence(out, in + anchor, i - anchor, i - candidate, len);
+    i += len;
+    anchor = i;
+  }
+  write_sequence(out, in + anchor, size - anchor, 0U, 0U);
+}
+
+// Decompresses [in, in + size) into exactly out_size bytes at out.
+inline void decompress(uint8_t const* in, std::size_t const size, uint8_t* out,
+                       std::size_t const out_size) {
+  auto const read_length = [&](std::size_t& pos, std::size_t len) {
+    auto b = uint8_t{255U};
+    while (b == 255U) {
+      verify(pos < size, "lz: truncated length");
+      b = in[pos++];
+      len += b;
+    }
+    return len;
+  };
+
+  auto pos = std::size_t{0U};
+  auto written = std::size_t{0U};
+  while (true) {
+    verify(pos < size, "lz: truncated sequence");
+    auto const token = in[pos++];
+
+    auto literal_len = static_cast<std::size_t>(token >> 4U);
+    if (literal_len == 15U) {
+      literal_len = read_length(pos, literal_len);
+    }
+    verify(size - pos >= literal_len && out_size - written >= literal_len,
+           "lz: literals out of bounds");
+    std::memcpy(out + written, in + pos, literal_len);
+    pos += literal_len;
+    written += literal_len;
+
+    if (pos == size) {
+      break;
+    }
 
-  static bool compare(std::pair<void const*, vector_range> const& a,
-                      std::pair<void const*, vector_range> const& b) {
-    return a.first < b.first;
+    verify(size - pos >= 2U, "lz: truncated offset");
+    auto const offset = std::size_t{in[pos]} | std::size_t{in[pos + 1U]} << 8U;
+    pos += 2U;
+    auto match_len = static_cast<std::size_t>(token & 0x0FU);
+    if (match_len == 15U) {
+      match_len = read_length(pos, match_len);
+    }
+    match_len += MIN_MATCH;
+    verify(offset != 0U && offset <= written &&
+               out_size - written >= match_len,
+           "lz: match out of bounds");
+    // Byte by byte: the match may overlap the bytes it produces.
+    for (auto i = std::size_t{0U}; i != match_len; ++i, ++written) {
+      out[written] = out[written - offset];
+    }
   }
+  verify(written == out_size, "lz: size mismatch");
+}
 
-  offset_t write(void const* ptr, std::size_t const size,
-                 std::size_t const alignment = 0) {
-    return t_.write(ptr, size, alignment);
+}  // namespace lz
+
+// Decompressed blocks of compressed_vectors, least recently used ones are
+// dropped when more than capacity bytes are held. Entries are keyed by the
+// address, size and hash of the compressed block, so a new buffer that
+// reuses the memory of a freed one does not get its blocks. Blocks handed
+// out stay valid after their eviction. Thread safe, the decompression runs
+// outside the lock.
+struct block_cache {
+  struct key {
+    friend bool operator==(key const& a, key const& b) {
+      return a.data_ == b.data_ && a.size_ == b.size_ && a.hash_ == b.hash_;
+    }
+    void const* data_;
+    std::size_t size_;
+    uint64_t hash_;
+  };
+
+  explicit block_cache(std::size_t const capacity = 64U * 1024U * 1024U)
+      : capacity_{capacity} {}
+
+  template <typename Load>
+  std::shared_ptr<void const> get(key const& key, std::size_t const size,
+                                  Load&& load) {
+    {
+      auto const lock = std::lock_guard{mutex_};
+      if (auto const it = index_.find(key); it != end(index_)) {
+        ++hits_;
+        lru_.splice(begin(lru_), lru_, it->second);
+        return it->second->data_;
+      }
+      ++misses_;
+    }
+
+    auto data = load();
+
+    auto const lock = std::lock_guard{mutex_};
+    if (auto const it = index_.find(key); it != end(index_)) {
+      lru_.splice(begin(lru_), lru_, it->second);
+      return it->second->data_;  // Loaded concurrently.
+    }
+    lru_.push_front(entry{key, size, data});
+    index_.emplace(key, begin(lru_));
+    size_ += size;
+    while (size_ > capacity_ && lru_.size() > 1U) {
+      size_ -= lru_.back().size_;
+      index_.erase(lru_.back().key_);
+      lru_.pop_back();
+    }
+    return data;
   }
 
-  template <typename T>
-  void write(offset_t const pos, T const& val) {
-    t_.write(static_cast<std::size_t>(pos), val);
+  void clear() {
+    auto const lock = std::lock_guard{mutex_};
+    lru_.clear();
+    index_.clear();
+    size_ = 0U;
   }
 
-  template <typename T>
+  std::size_t size() const {
+    auto const lock = std::lock_guard{mutex_};
+    return size_;
+  }
+
+  std::size_t hits() const {
+    auto const lock = std::lock_guard{mutex_};
+    return hits_;
+  }
+
+  std::size_t misses() const {
+    auto const lock = std::lock_guard{mutex_};
+    return misses_;
+  }
+
+private:
+  struct entry {
+    key key_;
+    std::size_t size_;
+    std::shared_ptr<void const> data_;
+  };
+
+  struct key_hash {
+    std::size_t operator()(key const& k) const {
+      return static_cast<std::size_t>(
+          k.hash_ ^ reinterpret_cast<std::uintptr_t>(k.data_));
+    }
+  };
+
+  std::size_t capacity_;
+  std::size_t size_{0U}, hits_{0U}, misses_{0U};
+  std::list<entry> lru_;
+  std::unordered_map<key, typename std::list<entry>::iterator, key_hash>
+      index_;
+  std::mutex mutable mutex_;
+};
+
+inline block_cache& default_block_cache() {
+  static block_cache cache;
+  return cache;
+}
+
+// Read-only vector for rarely used data. The elements are split into
+// blocks of block_size_ elements, each compressed with lz::compress(), so
+// the serialized buffer only holds the compressed bytes. Reading an
+// element decompresses its block into a block_cache (by default
+// default_block_cache()). Data that is read often belongs in a plain
+// vector, which stays zero-copy.
+//
+// Elements are copied bytewise: T has to be trivially copyable, must not
+// contain pointers and is stored in host byte order (no endian
+// conversion). Like vecvec this is an aggregate of plain members.
+template <typename T, template <typename> typename Vec>
+struct basic_compressed_vector {
+  static_assert(std::is_trivially_copyable_v<T> && !std::is_pointer_v<T>,
+                "compressed_vector stores plain data only");
+  static constexpr auto const DEFAULT_BLOCK_SIZE =
+      static_cast<uint32_t>(std::max(std::size_t{1U}, 65536U / sizeof(T)));
+
+  using value_type = T;
+
+  // Pins one decompressed block.
+  struct const_block {
+    T const* begin() const { return static_cast<T const*>(data_.get()); }
+    T const* end() const { return begin() + size_; }
+    friend T const* begin(const_block const& b) { return b.begin(); }
+    friend T const* end(const_block const& b) { return b.end(); }
+    T const& operator[](std::size_t const i) const { return begin()[i]; }
+    std::size_t size() const { return size_; }
+
+    std::shared_ptr<void const> data_;
+    std::size_t size_{0U};
+  };
+
+  struct const_iterator {
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T const*;
+    using reference = T const&;
+
+    T const& operator*() const {
+      auto const b = i_ / v_->block_size_;
+      if (block_.data_ == nullptr || b != block_index_) {
+        block_ = v_->block(b, *cache_);
+        block_index_ = b;
+      }
+      return block_[i_ % v_->block_size_];
+    }
+    T const* operator->() const { return &**this; }
+    const_iterator& operator++() {
+      ++i_;
+      return *this;
+    }
+    friend bool operator==(const_iterator const& a, const_iterator const& b) {
+      return a.i_ == b.i_;
+    }
+    friend bool operator!=(const_iterator const& a, const_iterator const& b) {
+      return a.i_ != b.i_;
+    }
+
+    basic_compressed_vector const* v_;
+    block_cache* cache_;
+    std::size_t i_;
+    mutable const_block block_{};
+    mutable std::size_t block_index_{0U};
+  };
+
+  template <typename It>
+  void assign(It first, It last,
+              uint32_t const block_size = DEFAULT_BLOCK_SIZE) {
+    verify(block_size != 0U, "compressed_vector: block size 0");
+    clear();
+    block_size_ = block_size;
+
+    auto block = std::vector<T>{};
+    block.reserve(block_size);
+    auto compressed = std::vector<uint8_t>{};
+    auto const flush = [&]() {
+      compressed.clear();
+      lz::compress(reinterpret_cast<uint8_t const*>(block.data()),
+                   block.size() * sizeof(T), compressed);
+      if (block_starts_.empty()) {
+        block_starts_.emplace_back(uint64_t{0U});
+      }
+      for (auto const b : compressed) {
+        data_.emplace_back(b);
+      }
+      block_hashes_.emplace_back(xxh64(compressed.data(), compressed.size()));
+      block_starts_.emplace_back(static_cast<uint64_t>(data_.size()));
+      size_ += block.size();
+      block.clear();
+    };
+    for (; first != last; ++first) {
+      block.emplace_back(*first);
+      if (block.size() == block_size) {
+        flush();
+      }
+    }
+    if (!block.empty()) {
+      flush();
+    }
+  }
+
+  template <typename Container>
+  void assign(Container const& c,
+              uint32_t const block_size = DEFAULT_BLOCK_SIZE) {
+    assign(std::begin(c), std::end(c), block_size);
+  }
+
+  void clear() {
+    size_ = 0U;
+    data_.clear();
+    block_starts_.clear();
+    block_hashes_.clear();
+  }
+
+  const_block block(std::size_t const b,
+                    block_cache& cache = default_block_cache()) const {
+    auto const first = b * block_size_;
+    auto const count = std::min(std::size_t{block_size_},
+                                static_cast<std::size_t>(size_) - first);
+    auto const compressed = data_.data() + block_starts_[b];
+    auto const compressed_size =
+        static_cast<std::size_t>(block_starts_[b + 1U] - block_starts_[b]);
+    auto const hash = block_hashes_[b];
+    return {cache.get({compressed, compressed_size, hash}, count * sizeof(T),
+                      [&]() {
+                        verify(xxh64(compressed, compressed_size) == hash,
+                               "compressed_vector: block hash mismatch");
+                        auto const v = std::make_shared<std::vector<T>>(count);
+                        lz::decompress(compressed, compressed_size,
+                                       reinterpret_cast<uint8_t*>(v->data()),
+                                       count * sizeof(T));
+                        return std::shared_ptr<void const>{v, v->data()};
+                      }),
+            count};
+  }
+
+  T at(std::size_t const i, block_cache& cache = default_block_cache()) const {
+    if (i >= size()) {
+      throw std::out_of_range{"compressed_vector::at(): invalid index"};
+    }
+    return block(i / block_size_, cache)[i % block_size_];
+  }
+
+  T operator[](std::size_t const i) const {
+    return block(i / block_size_)[i % block_size_];
+  }
+
+  const_iterator begin(block_cache& cache = default_block_cache()) const {
+    return {this, &cache, 0U};
+  }
+  const_iterator end(block_cache& cache = default_block_cache()) const {
+    return {this, &cache, size()};
+  }
+  friend const_iterator begin(basic_compressed_vector const& v) {
+    return v.begin();
+  }
+  friend const_iterator end(basic_compressed_vector const& v) {
+    return v.end();
+  }
+
+  std::size_t size() const { return static_cast<std::size_t>(size_); }
+  bool empty() const { return size_ == 0U; }
+  std::size_t block_count() const {
+    return block_starts_.empty() ? 0U : block_starts_.size() - 1U;
+  }
+  std::size_t compressed_size() const { return data_.size(); }
+
+  uint64_t size_{0U};
+  uint32_t block_size_{DEFAULT_BLOCK_SIZE};
+  uint32_t padding_{0U};
+  Vec<uint8_t> data_;
+  Vec<uint64_t> block_starts_;
+  Vec<uint64_t> block_hashes_;  // xxh64 of each compressed block
+};
+
+namespace raw {
+
+template <typename T>
+using compressed_vector = basic_compressed_vector<T, vector>;
+
+}  // namespace raw
+
+namespace offset {
+
+template <typename T>
+using compressed_vector = basic_compressed_vector<T, vector>;
+
+}  // namespace offset
+
+}  // namespace cista
+
+#include <cstdio>
+#include <cstring>
+
+#include <memory>
+
+
+// Credits: Manu Sánchez (@Manu343726)
+// https://github.com/Manu343726/ctti/blob/master/include/ctti/detail/pretty_function.hpp
+
+#include <string>
+#include <string_view>
+
+namespace cista {
+
+#if defined(_MSC_VER)
+#define CISTA_SIG __FUNCSIG__
+#elif defined(__clang__) || defined(__GNUC__)
+#define CISTA_SIG __PRETTY_FUNCTION__
+#else
+#error unsupported compiler
+#endif
+
+inline void remove_all(std::string& s, std::string_view substr) {
+  auto pos = std::size_t{};
+  while ((pos = s.find(substr, pos)) != std::string::npos) {
+    s.erase(pos, substr.length());
+  }
+}
+
+inline void canonicalize_type_name(std::string& s) {
+  remove_all(s, "{anonymous}::");  // GCC
+  remove_all(s, "(anonymous namespace)::");  // Clang
+  remove_all(s, "`anonymous-namespace'::");  // MSVC
+  remove_all(s, "struct");  // MSVC "struct my_struct" vs "my_struct"
+  remove_all(s, "const");  // MSVC "char const*"" vs "const char*"
+  remove_all(s, " ");  // MSVC
+}
+
+template <typename T>
+constexpr std::string_view type_str() {
+#if defined(__clang__)
+  constexpr std::string_view prefix =
+      "std::string_view cista::type_str() [T = ";
+  constexpr std::string_view suffix = "]";
+#elif defined(_MSC_VER)
+  constexpr std::string_view prefix =
+      "class std::basic_string_view<char,struct std::char_traits<char> > "
+      "__cdecl cista::type_str<";
+  constexpr std::string_view suffix = ">(void)";
+#else
+  constexpr std::string_view prefix =
+      "constexpr std::string_view cista::type_str() [with T = ";
+  constexpr std::string_view suffix =
+      "; std::string_view = std::basic_string_view<char>]";
+#endif
+
+  auto sig = std::string_view{CISTA_SIG};
+  sig.remove_prefix(prefix.size());
+  sig.remove_suffix(suffix.size());
+  return sig;
+}
+
+template <typename T>
+std::string canonical_type_str() {
+  auto const base = type_str<T>();
+  std::string s{base.data(), base.length()};
+  canonicalize_type_name(s);
+  return s;
+}
+
+}  // namespace cista
+
+#undef CISTA_SIG
+
+namespace cista {
+
+constexpr auto const MAX_ALIGN = 16;
+using byte_buf = std::vector<uint8_t>;
+
+template <typename Buf = byte_buf>
+struct buf {
+  buf() = default;
+  explicit buf(Buf&& buf) : buf_{std::forward<Buf>(buf)} {}
+
+  uint8_t* addr(offset_t const offset) { return (&buf_[0]) + offset; }
+  uint8_t* base() { return &buf_[0]; }
+
+  uint64_t checksum(offset_t const start = 0) const {
+    return hash(std::string_view{
+        reinterpret_cast<char const*>(&buf_[static_cast<size_t>(start)]),
+        buf_.size() - static_cast<size_t>(start)});
+  }
+
+  uint64_t chunked_checksum(offset_t const start = 0) const {
+    return ::cista::chunked_checksum(&buf_[static_cast<size_t>(start)],
+                                     buf_.size() - static_cast<size_t>(start));
+  }
+
+  template <typename T>
+  void write(std::size_t const pos, T const& val) {
+    verify(buf_.size() >= pos + serialized_size<T>(), "out of bounds write");
+    std::memcpy(&buf_[pos], &val, serialized_size<T>());
+  }
+
+  offset_t write(void const* ptr, std::size_t const size,
+                 std::size_t alignment = 0) {
+    if (alignment != 0 && alignment != 1 && buf_.size() != 0) {
+      auto unaligned_ptr = static_cast<void*>(addr(curr_offset_));
+      auto space = std::numeric_limits<std::size_t>::max();
+      auto const aligned_ptr =
+          std::align(alignment, size, unaligned_ptr, space);
+      auto const new_offset = static_cast<offset_t>(
+          aligned_ptr ? static_cast<uint8_t*>(aligned_ptr) - base() : 0);
+      auto const adjustment =
+          static_cast<std::size_t>(new_offset - curr_offset_);
+      curr_offset_ += adjustment;
+    }
+
+    auto const start = curr_offset_;
+    auto const end = static_cast<std::size_t>(start) + size;
+    if constexpr (is_appendable_v<Buf>) {
+      if (static_cast<std::size_t>(start) >= buf_.size()) {
+        // Append: padding and data are written once, without resize()
+        // zeroing the bytes first.
+        grow(end);
+        buf_.insert(buf_.end(), static_cast<std::size_t>(start) - buf_.size(),
+                    uint8_t{0U});
+        auto const bytes = static_cast<uint8_t const*>(ptr);
+        buf_.insert(buf_.end(), bytes, bytes + size);
+        curr_offset_ += size;
+        return start;
+      }
+      grow(end);
+    }
+    if (buf_.size() < end) {
+      buf_.resize(end);
+    }
+
+    std::memcpy(addr(curr_offset_), ptr, size);
+    curr_offset_ += size;
+    return start;
+  }
+
+  // Pre-allocates space for the given total size, e.g. from
+  // serialization_size(). The result is the same without it.
+  void reserve(std::size_t const size) { buf_.reserve(size); }
+
+  unsigned char& operator[](size_t i) { return buf_[i]; }
+  unsigned char const& operator[](size_t i) const { return buf_[i]; }
+  size_t size() const { return buf_.size(); }
+
+  Buf buf_;
+  offset_t curr_offset_{0};
+
+private:
+  template <typename B, typename = void>
+  struct is_appendable : std::false_type {};
+
+  template <typename B>
+  struct is_appendable<
+      B, std::void_t<decltype(std::declval<B&>().capacity()),
+                     decltype(std::declval<B&>().insert(
+                         std::declval<B&>().end(), std::size_t{}, uint8_t{}))>>
+      : std::true_type {};
+
+  template <typename B>
+  static constexpr auto const is_appendable_v = is_appendable<B>::value;
+
+  // Doubles the capacity instead of relying on the growth of insert().
+  void grow(std::size_t const min_size) {
+    if (buf_.capacity() < min_size) {
+      buf_.reserve(std::max(min_size, 2U * buf_.capacity()));
+    }
+  }
+};
+
+template <typename Buf>
+buf(Buf &&)->buf<Buf>;
+
+}  // namespace cista
+
+#include <map>
+
+
+#include <type_traits>
+
+namespace cista {
+
+template <typename T>
+struct indexed : public T {
+  using value_type = T;
+  using T::T;
+  using T::operator=;
+};
+
+template <typename Ptr>
+struct is_indexed_helper : std::false_type {};
+
+template <typename T>
+struct is_indexed_helper<indexed<T>> : std::true_type {};
+
+template <class T>
+constexpr inline bool is_indexed_v =
+    is_indexed_helper<std::remove_cv_t<T>>::value;
+
+}  // namespace cista
+
+namespace cista {
+
+// prefetch(x) starts reading the memory directly owned by container x
+// (see prefetch_range). prefetch_subtree(x) does this for x and everything
+// reachable through owning members. It has to read the container headers
+// on the way, which faults in those pages synchronously.
+template <typename T, typename Ptr, bool Indexed, typename TemplateSizeType>
+void prefetch(basic_vector<T, Ptr, Indexed, TemplateSizeType> const& v) {
+  prefetch_range(v.data(), v.size() * sizeof(T));
+}
+
+template <typename Ptr>
+void prefetch(generic_string<Ptr> const& s) {
+  prefetch_range(s.data(), s.size());
+}
+
+template <typename T, typename Ptr>
+void prefetch(basic_unique_ptr<T, Ptr> const& p) {
+  prefetch_range(p.get(), sizeof(T));
+}
+
+template <typename T, template <typename> typename Ptr,
+          typename TemplateSizeType, typename GetKey, typename GetValue,
+          typename Hash, typename Eq>
+void prefetch(hash_storage<T, Ptr, TemplateSizeType, GetKey, GetValue, Hash,
+                           Eq> const& h) {
+  using Type =
+      hash_storage<T, Ptr, TemplateSizeType, GetKey, GetValue, Hash, Eq>;
+  if (h.entries_ != nullptr) {
+    prefetch_range(ptr_cast(h.entries_),
+                   h.capacity_ * sizeof(T) +
+                       (h.capacity_ + 1U + Type::WIDTH) *
+                           sizeof(typename Type::ctrl_t));
+  }
+}
+
+template <typename T>
+void prefetch_subtree(T const& el);
+
+template <typename T, typename Ptr, bool Indexed, typename TemplateSizeType>
+void prefetch_subtree(
+    basic_vector<T, Ptr, Indexed, TemplateSizeType> const& v) {
+  prefetch(v);
+  if constexpr (!std::is_scalar_v<T>) {
+    for (auto const& e : v) {
+      prefetch_subtree(e);
+    }
+  }
+}
+
+template <typename Ptr>
+void prefetch_subtree(generic_string<Ptr> const& s) {
+  prefetch(s);
+}
+
+template <typename Ptr>
+void prefetch_subtree(basic_string<Ptr> const& s) {
+  prefetch(s);
+}
+
+template <typename Ptr>
+void prefetch_subtree(basic_string_view<Ptr> const& s) {
+  prefetch(s);
+}
+
+template <typename T, typename Ptr>
+void prefetch_subtree(basic_unique_ptr<T, Ptr> const& p) {
+  if (p.get() != nullptr) {
+    prefetch(p);
+    prefetch_subtree(*p);
+  }
+}
+
+template <typename T, template <typename> typename Ptr,
+          typename TemplateSizeType, typename GetKey, typename GetValue,
+          typename Hash, typename Eq>
+void prefetch_subtree(hash_storage<T, Ptr, TemplateSizeType, GetKey,
+                                   GetValue, Hash, Eq> const& h) {
+  prefetch(h);
+  if constexpr (!std::is_scalar_v<T>) {
+    for (auto const& e : h) {
+      prefetch_subtree(e);
+    }
+  }
+}
+
+template <typename T>
+void prefetch_subtree(T const& el) {
+  using Type = decay_t<T>;
+  if constexpr (is_indexed_v<Type>) {
+    prefetch_subtree(static_cast<typename Type::value_type const&>(el));
+  } else if constexpr (!std::is_scalar_v<Type> && to_tuple_works_v<Type>) {
+    for_each_field(const_cast<Type&>(el),
+                   [](auto const& f) { prefetch_subtree(f); });
+  } else {
+    (void)el;
+  }
+}
+
+}  // namespace cista
+
+namespace cista {
+
+template <typename T>
+hash_t type2str_hash() {
+  return hash_combine(hash(canonical_type_str<decay_t<T>>()), sizeof(T));
+}
+
+template <typename T>
+hash_t type_hash(T const& el, hash_t h, std::map<hash_t, unsigned>& done) {
+  using Type = decay_t<T>;
+
+  auto const base_hash = type2str_hash<Type>();
+  auto [it, inserted] =
+      done.try_emplace(base_hash, static_cast<unsigned>(done.size()));
+  if (!inserted) {
+    return hash_combine(h, it->second);
+  }
+
+  if constexpr (is_pointer_v<Type>) {
+    using PointeeType = remove_pointer_t<Type>;
+    if constexpr (std::is_same_v<PointeeType, void>) {
+      return hash_combine(h, hash("void*"));
+    } else {
+      return type_hash(remove_pointer_t<Type>{},
+                       hash_combine(h, hash("pointer")), done);
+    }
+  } else if constexpr (std::is_integral_v<Type>) {
+    return hash_combine(h, hash("i"), sizeof(Type));
+  } else if constexpr (std::is_scalar_v<Type>) {
+    return hash_combine(h, type2str_hash<T>());
+  } else {
+    static_assert(to_tuple_works_v<Type>, "Please implement custom type hash.");
+    h = hash_combine(h, hash("struct"));
+    for_each_field(el,
+                   [&](auto const& member) { h = type_hash(member, h, done); });
+    return h;
+  }
+}
+
+template <typename T, size_t Size>
+hash_t type_hash(array<T, Size> const&, hash_t h,
+                 std::map<hash_t, unsigned>& done) {
+  h = hash_combine(h, hash("array"));
+  h = hash_combine(h, Size);
+  return type_hash(T{}, h, done);
+}
+
+template <typename T, typename Ptr, bool Indexed, typename TemplateSizeType>
+hash_t type_hash(basic_vector<T, Ptr, Indexed, TemplateSizeType> const&,
+                 hash_t h, std::map<hash_t, unsigned>& done) {
+  h = hash_combine(h, hash("vector"));
+  return type_hash(T{}, h, done);
+}
+
+template <typename T, typename Ptr>
+hash_t type_hash(basic_unique_ptr<T, Ptr> const&, hash_t h,
+                 std::map<hash_t, unsigned>& done) {
+  h = hash_combine(h, hash("unique_ptr"));
+  return type_hash(T{}, h, done);
+}
+
+template <typename T, template <typename> typename Ptr,
+          typename TemplateSizeType, typename GetKey, typename GetValue,
+          typename Hash, typename Eq>
+hash_t type_hash(
+    hash_storage<T, Ptr, TemplateSizeType, GetKey, GetValue, Hash, Eq> const&,
+    hash_t h, std::map<hash_t, unsigned>& done) {
+  using Type =
+      hash_storage<T, Ptr, TemplateSizeType, GetKey, GetValue, Hash, Eq>;
+  h = hash_combine(h, hash("hash_storage"));
+  if constexpr (Type::WIDTH != 8U) {
+    // Probe sequence and ctrl layout depend on the group width.
+    h = hash_combine(h, Type::WIDTH);
+  }
+  return type_hash(T{}, h, done);
+}
+
+template <typename Ptr>
+hash_t type_hash(generic_string<Ptr> const&, hash_t h,
+                 std::map<hash_t, unsigned>&) {
+  return hash_combine(h, hash("string"));
+}
+
+template <typename Ptr>
+hash_t type_hash(basic_string<Ptr> const&, hash_t h,
+                 std::map<hash_t, unsigned>&) {
+  return hash_combine(h, hash("string"));
+}
+
+template <typename Ptr>
+hash_t type_hash(basic_string_view<Ptr> const&, hash_t h,
+                 std::map<hash_t, unsigned>&) {
+  return hash_combine(h, hash("string"));
+}
+
+template <typename Ptr>
+hash_t type_hash(basic_hashed_string<Ptr> const&, hash_t h,
+                 std::map<hash_t, unsigned>&) {
+  return hash_combine(h, hash("hashed_string"));
+}
+
+template <typename T>
+hash_t type_hash(indexed<T> const&, hash_t h,
+                 std::map<hash_t, unsigned>& done) {
+  return type_hash(T{}, h, done);
+}
+
+template <typename T, template <typename> typename Vec>
+hash_t type_hash(basic_compressed_vector<T, Vec> const&, hash_t h,
+                 std::map<hash_t, unsigned>& done) {
+  h = hash_combine(h, hash("compressed_vector"));
+  return type_hash(T{}, h, done);
+}
+
+template <typename T>
+hash_t type_hash() {
+  auto done = std::map<hash_t, unsigned>{};
+  return type_hash(T{}, BASE_HASH, done);
+}
+
+}  // namespace cista
+
+#define CISTA_UNUSED_PARAM(param) (void)(param);
+
+#ifndef cista_member_offset
+#define cista_member_offset(s, m) (static_cast<cista::offset_t>(offsetof(s, m)))
+#endif
+
+#include <array>
+#include <exception>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+namespace cista {
+
+// =============================================================================
+// SERIALIZE
+// -----------------------------------------------------------------------------
+struct pending_offset {
+  void const* origin_ptr_;
+  offset_t pos_;
+};
+
+struct vector_range {
+  bool contains(void const* begin, void const* ptr) const {
+    auto const ptr_int = reinterpret_cast<uintptr_t>(ptr);
+    auto const from = reinterpret_cast<uintptr_t>(begin);
+    auto const to =
+        reinterpret_cast<uintptr_t>(begin) + static_cast<uintptr_t>(size_);
+    return ptr_int >= from && ptr_int < to;
+  }
+
+  offset_t offset_of(void const* begin, void const* ptr) const {
+    return start_ + reinterpret_cast<intptr_t>(ptr) -
+           reinterpret_cast<intptr_t>(begin);
+  }
+
+  offset_t start_;
+  size_t size_;
+};
+
+// Element arrays of the serialized indexed vectors, for pointers into them.
+// A flat array: appending is cheap and the (rare) single lookups sort it
+// lazily. Pointers are resolved in bulk by resolve_pending() instead.
+struct vector_range_index {
+  using entry_t = std::pair<void const*, vector_range>;
+
+  static bool compare(entry_t const& a, entry_t const& b) {
+    return std::less<void const*>{}(a.first, b.first);
+  }
+
+  template <typename Ptr>
+  void emplace(Ptr const& begin, vector_range const& r) {
+    ranges_.emplace_back(static_cast<void const*>(begin), r);
+  }
+
+  void insert(vector_range_index const& o) {
+    ranges_.insert(std::end(ranges_), std::begin(o.ranges_),
+                   std::end(o.ranges_));
+  }
+
+  // Sorts the entries added since the last call and merges them in.
+  void sort() {
+    if (sorted_ == ranges_.size()) {
+      return;
+    }
+    auto const middle =
+        std::next(std::begin(ranges_), static_cast<std::ptrdiff_t>(sorted_));
+    std::sort(middle, std::end(ranges_), compare);
+    std::inplace_merge(std::begin(ranges_), middle, std::end(ranges_),
+                       compare);
+    sorted_ = ranges_.size();
+  }
+
+  std::optional<offset_t> find(void const* ptr) {
+    sort();
+    auto const it =
+        std::upper_bound(std::begin(ranges_), std::end(ranges_),
+                         entry_t{ptr, vector_range{}}, compare);
+    if (it == std::begin(ranges_)) {
+      return std::nullopt;
+    }
+    auto const pred = std::prev(it);
+    return pred->second.contains(pred->first, ptr)
+               ? std::make_optional(pred->second.offset_of(pred->first, ptr))
+               : std::nullopt;
+  }
+
+  bool empty() const { return ranges_.empty(); }
+
+  std::vector<entry_t> ranges_;
+  std::size_t sorted_{0U};
+};
+
+template <typename Target, mode Mode>
+struct serialization_context {
+  static constexpr auto const MODE = Mode;
+  static constexpr auto const PARALLEL = false;
+
+  explicit serialization_context(Target& t) : t_{t} {}
+
+  offset_t write(void const* ptr, std::size_t const size,
+                 std::size_t const alignment = 0) {
+    return t_.write(ptr, size, alignment);
+  }
+
+  template <typename T>
+  void write(offset_t const pos, T const& val) {
+    t_.write(static_cast<std::size_t>(pos), val);
+  }
+
+  template <typename T>
   bool resolve_pointer(offset_ptr<T> const& ptr, offset_t const pos,
                        bool add_pending = true) {
     return resolve_pointer(ptr.get(), pos, add_pending);
   }
 
-  template <typename Ptr>
-  bool resolve_pointer(Ptr ptr, offset_t const pos, bool add_pending = true) {
-    if (std::is_same_v<decay_t<remove_pointer_t<Ptr>>, void> && add_pending) {
-      write(pos, convert_endian<MODE>(NULLPTR_OFFSET));
-      return true;
-    } else if (ptr == nullptr) {
-      write(pos, convert_endian<MODE>(NULLPTR_OFFSET));
-      return true;
-    } else if (auto const it = offsets_.find(ptr_cast(ptr));
-               it != end(offsets_)) {
-      write(pos, convert_endian<MODE>(it->second - pos));
-      return true;
-    } else if (auto const offset = resolve_vector_range_ptr(ptr);
-               offset.has_value()) {
-      write(pos, convert_endian<MODE>(*offset - pos));
-      return true;
-    } else if (add_pending) {
-      write(pos, convert_endian<MODE>(NULLPTR_OFFSET));
-      pending_.emplace_back(pending_offset{ptr_cast(ptr), pos});
-      return true;
+  // Pointers into vectors are not looked up here: they are resolved
+  // together by resolve_pending() once all vectors are known.
+  template <typename Ptr>
+  bool resolve_pointer(Ptr ptr, offset_t const pos, bool add_pending = true) {
+    if (std::is_same_v<decay_t<remove_pointer_t<Ptr>>, void> && add_pending) {
+      write(pos, convert_endian<MODE>(NULLPTR_OFFSET));
+      return true;
+    } else if (ptr == nullptr) {
+      write(pos, convert_endian<MODE>(NULLPTR_OFFSET));
+      return true;
+    } else if (auto const it = offsets_.find(ptr_cast(ptr));
+               it != end(offsets_)) {
+      write(pos, convert_endian<MODE>(it->second - pos));
+      return true;
+    } else if (add_pending) {
+      write(pos, convert_endian<MODE>(NULLPTR_OFFSET));
+      pending_.emplace_back(pending_offset{ptr_cast(ptr), pos});
+      return true;
+    } else if (auto const offset = vector_ranges_.find(ptr_cast(ptr));
+               offset.has_value()) {
+      write(pos, convert_endian<MODE>(*offset - pos));
+      return true;
+    }
+    return false;
+  }
+
+  // Resolves all pending pointers in one pass: the ones still missing in
+  // offsets_ are sorted and merged with the sorted vector ranges.
+  // Returns the pointers that could not be resolved.
+  std::vector<pending_offset> resolve_pending() {
+    auto rest = std::vector<pending_offset>{};
+    for (auto const& p : pending_) {
+      if (auto const it = offsets_.find(p.origin_ptr_); it != end(offsets_)) {
+        write(p.pos_, convert_endian<MODE>(it->second - p.pos_));
+      } else {
+        rest.emplace_back(p);
+      }
+    }
+    pending_.clear();
+
+    std::sort(begin(rest), end(rest),
+              [](pending_offset const& a, pending_offset const& b) {
+                return std::less<void const*>{}(a.origin_ptr_, b.origin_ptr_);
+              });
+    vector_ranges_.sort();
+
+    auto unresolved = std::vector<pending_offset>{};
+    auto const& ranges = vector_ranges_.ranges_;
+    auto r = begin(ranges);
+    for (auto const& p : rest) {
+      while (r != end(ranges) && std::next(r) != end(ranges) &&
+             !std::less<void const*>{}(p.origin_ptr_, std::next(r)->first)) {
+        ++r;
+      }
+      if (r != end(ranges) && r->second.contains(r->first, p.origin_ptr_)) {
+        write(p.pos_,
+              convert_endian<MODE>(r->second.offset_of(r->first, p.origin_ptr_) -
+                                   p.pos_));
+      } else {
+        unresolved.emplace_back(p);
+      }
+    }
+    return unresolved;
+  }
+
+  uint64_t checksum(offset_t const from) const {
+    if constexpr (is_mode_enabled(MODE, mode::FAST_INTEGRITY)) {
+      return t_.chunked_checksum(from);
+    } else {
+      return t_.checksum(from);
+    }
+  }
+
+  cista::raw::hash_map<void const*, offset_t> offsets_;
+  vector_range_index vector_ranges_;
+  std::vector<pending_offset> pending_;
+  Target& t_;
+};
+
+template <typename Ctx, typename T>
+void serialize(Ctx& c, T const* origin, offset_t const pos) {
+  using Type = decay_t<T>;
+  if constexpr (std::is_union_v<Type>) {
+    static_assert(std::is_standard_layout_v<Type> &&
+                  std::is_trivially_copyable_v<Type>);
+  } else if constexpr (is_pointer_v<Type>) {
+    c.resolve_pointer(*origin, pos);
+  } else if constexpr (is_indexed_v<Type>) {
+    c.offsets_.emplace(origin, pos);
+    serialize(c, static_cast<typename Type::value_type const*>(origin), pos);
+  } else if constexpr (!std::is_scalar_v<Type>) {
+    static_assert(to_tuple_works_v<Type>, "Please implement custom serializer");
+    for_each_ptr_field(*origin, [&](auto& member) {
+      auto const member_offset =
+          static_cast<offset_t>(reinterpret_cast<intptr_t>(member) -
+                                reinterpret_cast<intptr_t>(origin));
+      serialize(c, member, pos + member_offset);
+    });
+  } else if constexpr (std::numeric_limits<Type>::is_integer ||
+                       std::is_floating_point_v<Type>) {
+    c.write(pos, convert_endian<Ctx::MODE>(*origin));
+  } else {
+    (void)origin;
+    (void)pos;
+  }
+}
+
+template <typename Ctx, typename T, typename Ptr, bool Indexed,
+          typename TemplateSizeType>
+void serialize(Ctx& c,
+               basic_vector<T, Ptr, Indexed, TemplateSizeType> const* origin,
+               offset_t const pos) {
+  using Type = basic_vector<T, Ptr, Indexed, TemplateSizeType>;
+
+  auto const size = serialized_size<T>() * origin->used_size_;
+  auto const start = origin->el_ == nullptr
+                         ? NULLPTR_OFFSET
+                         : c.write(static_cast<T const*>(origin->el_), size,
+                                   std::alignment_of_v<T>);
+
+  c.write(pos + cista_member_offset(Type, el_),
+          convert_endian<Ctx::MODE>(
+              start == NULLPTR_OFFSET
+                  ? start
+                  : start - cista_member_offset(Type, el_) - pos));
+  c.write(pos + cista_member_offset(Type, allocated_size_),
+          convert_endian<Ctx::MODE>(origin->used_size_));
+  c.write(pos + cista_member_offset(Type, used_size_),
+          convert_endian<Ctx::MODE>(origin->used_size_));
+  c.write(pos + cista_member_offset(Type, self_allocated_), false);
+
+  if constexpr (Indexed) {
+    if (origin->el_ != nullptr) {
+      c.vector_ranges_.emplace(origin->el_, vector_range{start, size});
+    }
+  }
+
+  if (origin->el_ != nullptr) {
+    if constexpr (Ctx::PARALLEL) {
+      if (c.serialize_parallel(static_cast<T const*>(origin->el_),
+                               origin->used_size_, start)) {
+        return;
+      }
+    }
+    auto i = 0u;
+    for (auto it = start; it != start + static_cast<offset_t>(size);
+         it += serialized_size<T>()) {
+      serialize(c, static_cast<T const*>(origin->el_ + i++), it);
+    }
+  }
+}
+
+template <typename Ctx, typename Ptr>
+void serialize(Ctx& c, generic_string<Ptr> const* origin, offset_t const pos) {
+  using Type = generic_string<Ptr>;
+
+  if (origin->is_short()) {
+    return;
+  }
+
+  auto const start = (origin->h_.ptr_ == nullptr)
+                         ? NULLPTR_OFFSET
+                         : c.write(origin->data(), origin->size());
+  c.write(pos + cista_member_offset(Type, h_.ptr_),
+          convert_endian<Ctx::MODE>(
+              start == NULLPTR_OFFSET
+                  ? start
+                  : start - cista_member_offset(Type, h_.ptr_) - pos));
+  c.write(pos + cista_member_offset(Type, h_.size_),
+          convert_endian<Ctx::MODE>(origin->h_.size_));
+  c.write(pos + cista_member_offset(Type, h_.self_allocated_), false);
+}
+
+template <typename Ctx, typename Ptr>
+void serialize(Ctx& c, basic_string<Ptr> const* origin, offset_t const pos) {
+  serialize(c, static_cast<generic_string<Ptr> const*>(origin), pos);
+}
+
+template <typename Ctx, typename Ptr>
+void serialize(Ctx& c, basic_string_view<Ptr> const* origin,
+               offset_t const pos) {
+  serialize(c, static_cast<generic_string<Ptr> const*>(origin), pos);
+}
+
+template <typename Ctx, typename Ptr>
+void serialize(Ctx& c, basic_hashed_string<Ptr> const* origin,
+               offset_t const pos) {
+  using Type = basic_hashed_string<Ptr>;
+  serialize(c, &origin->str_, pos + cista_member_offset(Type, str_));
+  c.write(pos + cista_member_offset(Type, hash_),
+          convert_endian<Ctx::MODE>(origin->hash_));
+}
+
+template <typename Ctx, typename T, typename Ptr>
+void serialize(Ctx& c, basic_unique_ptr<T, Ptr> const* origin,
+               offset_t const pos) {
+  using Type = basic_unique_ptr<T, Ptr>;
+
+  auto const start =
+      origin->el_ == nullptr
+          ? NULLPTR_OFFSET
+          : c.write(origin->el_, serialized_size<T>(), std::alignment_of_v<T>);
+
+  c.write(pos + cista_member_offset(Type, el_),
+          convert_endian<Ctx::MODE>(
+              start == NULLPTR_OFFSET
+                  ? start
+                  : start - cista_member_offset(Type, el_) - pos));
+  c.write(pos + cista_member_offset(Type, self_allocated_), false);
+
+  if (origin->el_ != nullptr) {
+    c.offsets_[origin->el_] = start;
+    serialize(c, ptr_cast(origin->el_), start);
+  }
+}
+
+template <typename Ctx, typename T, template <typename> typename Ptr,
+          typename GetKey, typename GetValue, typename Hash, typename Eq>
+void serialize(
+    Ctx& c,
+    hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq> const* origin,
+    offset_t const pos) {
+  using Type = hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>;
+
+  auto const start = origin->entries_ == nullptr
+                         ? NULLPTR_OFFSET
+                         : c.write(origin->entries_,
+                                   origin->capacity_ * serialized_size<T>() +
+                                       (origin->capacity_ + 1 + Type::WIDTH) *
+                                           sizeof(typename Type::ctrl_t),
+                                   std::alignment_of_v<T>);
+  auto const ctrl_start =
+      start == NULLPTR_OFFSET
+          ? c.write(Type::empty_group(),
+                    Type::EMPTY_GROUP_SIZE * sizeof(typename Type::ctrl_t),
+                    std::alignment_of_v<typename Type::ctrl_t>)
+          : start +
+                static_cast<offset_t>(origin->capacity_ * serialized_size<T>());
+
+  c.write(pos + cista_member_offset(Type, entries_),
+          convert_endian<Ctx::MODE>(
+              start == NULLPTR_OFFSET
+                  ? start
+                  : start - cista_member_offset(Type, entries_) - pos));
+  c.write(pos + cista_member_offset(Type, ctrl_),
+          convert_endian<Ctx::MODE>(
+              ctrl_start == NULLPTR_OFFSET
+                  ? ctrl_start
+                  : ctrl_start - cista_member_offset(Type, ctrl_) - pos));
+
+  c.write(pos + cista_member_offset(Type, self_allocated_), false);
+
+  c.write(pos + cista_member_offset(Type, size_),
+          convert_endian<Ctx::MODE>(origin->size_));
+  c.write(pos + cista_member_offset(Type, capacity_),
+          convert_endian<Ctx::MODE>(origin->capacity_));
+  c.write(pos + cista_member_offset(Type, growth_left_),
+          convert_endian<Ctx::MODE>(origin->growth_left_));
+
+  if (origin->entries_ != nullptr) {
+    auto i = 0u;
+    for (auto it = start;
+         it != start + static_cast<offset_t>(origin->capacity_ *
+                                             serialized_size<T>());
+         it += serialized_size<T>(), ++i) {
+      if (Type::is_full(origin->ctrl_[i])) {
+        serialize(c, static_cast<T*>(origin->entries_ + i), it);
+      }
+    }
+  }
+}
+
+template <typename Ctx, typename T, size_t Size>
+void serialize(Ctx& c, array<T, Size> const* origin, offset_t const pos) {
+  auto const size =
+      static_cast<offset_t>(serialized_size<T>() * origin->size());
+  auto i = 0u;
+  for (auto it = pos; it != pos + size; it += serialized_size<T>()) {
+    serialize(c, origin->el_ + i++, it);
+  }
+}
+
+constexpr offset_t schema_start(mode const m) {
+  offset_t start = 0;
+  if (is_mode_enabled(m, mode::WITH_VERSION)) {
+    start += sizeof(uint64_t);
+  }
+  return start;
+}
+
+constexpr offset_t integrity_start(mode const m) {
+  auto start = schema_start(m);
+  if (is_mode_enabled(m, mode::WITH_SCHEMA)) {
+    start += sizeof(uint64_t);
+  }
+  return start;
+}
+
+constexpr offset_t data_start(mode const m) {
+  auto start = integrity_start(m);
+  if (is_mode_enabled(m, mode::WITH_INTEGRITY)) {
+    start += sizeof(uint64_t);
+  }
+  return start;
+}
+
+// mode::WITH_SCHEMA appends a description of the root type to the buffer:
+// its type hash and, for structs, one entry per field. The buffer header
+// stores the offset of this table.
+struct schema_header {
+  uint64_t root_hash_;
+  uint32_t root_size_;
+  uint32_t field_count_;
+};
+
+struct schema_field {
+  uint64_t type_hash_;
+  uint32_t tag_;
+  uint32_t offset_;
+  uint32_t size_;
+  uint32_t padding_;
+};
+
+namespace detail {
+
+template <typename T, typename = void>
+struct has_field_tags : std::false_type {};
+
+template <typename T>
+struct has_field_tags<T, std::void_t<decltype(T::cista_field_tags())>>
+    : std::true_type {};
+
+}  // namespace detail
+
+// The tag identifies a field across versions of a struct. It is the field
+// index unless the struct declares its own tags:
+//   static constexpr auto cista_field_tags() { return std::array{0U, 2U}; }
+template <typename T>
+constexpr uint32_t field_tag(std::size_t const i) {
+  if constexpr (detail::has_field_tags<T>::value) {
+    constexpr auto const tags = T::cista_field_tags();
+    static_assert(tags.size() == arity<T>(), "one tag per field");
+    return static_cast<uint32_t>(tags[i]);
+  } else {
+    return static_cast<uint32_t>(i);
+  }
+}
+
+template <typename Ctx, typename T>
+offset_t serialize_schema(Ctx& c, T const& value) {
+  constexpr auto const Mode = Ctx::MODE;
+  using Type = decay_t<T>;
+
+  auto fields = std::vector<schema_field>{};
+  if constexpr (!std::is_scalar_v<Type> && to_tuple_works_v<Type>) {
+    auto i = std::size_t{0U};
+    for_each_ptr_field(value, [&](auto const& member) {
+      using Member = decay_t<remove_pointer_t<decay_t<decltype(member)>>>;
+      auto const offset = reinterpret_cast<uint8_t const*>(member) -
+                          reinterpret_cast<uint8_t const*>(&value);
+      fields.push_back(schema_field{
+          convert_endian<Mode>(type_hash<Member>()),
+          convert_endian<Mode>(field_tag<Type>(i++)),
+          convert_endian<Mode>(static_cast<uint32_t>(offset)),
+          convert_endian<Mode>(static_cast<uint32_t>(sizeof(Member))), 0U});
+    });
+  }
+
+  auto const header = schema_header{
+      convert_endian<Mode>(type_hash<Type>()),
+      convert_endian<Mode>(static_cast<uint32_t>(sizeof(Type))),
+      convert_endian<Mode>(static_cast<uint32_t>(fields.size()))};
+  auto const start =
+      c.write(&header, sizeof(header), std::alignment_of_v<schema_header>);
+  if (!fields.empty()) {
+    c.write(fields.data(), fields.size() * sizeof(schema_field));
+  }
+  return start;
+}
+
+template <typename Ctx, typename T>
+void serialize_root(Ctx& c, T& value) {
+  constexpr auto const Mode = Ctx::MODE;
+
+  if constexpr (is_mode_enabled(Mode, mode::WITH_VERSION)) {
+    auto const h = convert_endian<Mode>(type_hash<decay_t<T>>());
+    c.write(&h, sizeof(h));
+  }
+
+  auto schema_offset = offset_t{0};
+  if constexpr (is_mode_enabled(Mode, mode::WITH_SCHEMA)) {
+    auto const start = uint64_t{0U};
+    schema_offset = c.write(&start, sizeof(start));
+  }
+
+  auto integrity_offset = offset_t{0};
+  if constexpr (is_mode_enabled(Mode, mode::WITH_INTEGRITY)) {
+    auto const h = hash_t{};
+    integrity_offset = c.write(&h, sizeof(h));
+  }
+
+  serialize(c, &value,
+            c.write(&value, serialized_size<T>(),
+                    std::alignment_of_v<decay_t<decltype(value)>>));
+
+  for (auto const& p : c.resolve_pending()) {
+    printf("warning: dangling pointer at %" PRI_O " (origin=%p)\n", p.pos_,
+           p.origin_ptr_);
+  }
+
+  if constexpr (is_mode_enabled(Mode, mode::WITH_SCHEMA)) {
+    c.write(schema_offset, convert_endian<Mode>(static_cast<uint64_t>(
+                               serialize_schema(c, value))));
+  }
+
+  if constexpr (is_mode_enabled(Mode, mode::WITH_INTEGRITY)) {
+    auto const csum =
+        c.checksum(integrity_offset + static_cast<offset_t>(sizeof(hash_t)));
+    c.write(integrity_offset, convert_endian<Mode>(csum));
+  }
+}
+
+template <mode const Mode = mode::NONE, typename Target, typename T>
+void serialize(Target& t, T& value) {
+  serialization_context<Target, Mode> c{t};
+  serialize_root(c, value);
+}
+
+template <mode const Mode = mode::NONE, typename T>
+byte_buf serialize(T& el) {
+  auto b = buf{};
+  serialize<Mode>(b, el);
+  return std::move(b.buf_);
+}
+
+// Dry run target: computes the layout without writing anything.
+struct size_target {
+  offset_t write(void const*, std::size_t const size,
+                 std::size_t const alignment = 0) {
+    if (alignment > 1U) {
+      curr_offset_ = static_cast<offset_t>(
+          (static_cast<std::size_t>(curr_offset_) + alignment - 1U) &
+          ~(alignment - 1U));
+    }
+    auto const start = curr_offset_;
+    curr_offset_ += static_cast<offset_t>(size);
+    return start;
+  }
+
+  template <typename T>
+  void write(std::size_t, T const&) {}
+
+  uint64_t checksum(offset_t) const { return 0U; }
+  uint64_t chunked_checksum(offset_t) const { return 0U; }
+
+  offset_t curr_offset_{0};
+};
+
+// Writes into a region of an already sized buffer that is reserved for one
+// worker. Alignment is computed on offsets, like size_target does, which
+// matches buf as long as the buffer start is aligned to REGION_ALIGNMENT.
+struct region_target {
+  static constexpr auto const REGION_ALIGNMENT = std::size_t{16U};
+
+  offset_t write(void const* ptr, std::size_t const size,
+                 std::size_t const alignment = 0) {
+    verify(alignment <= REGION_ALIGNMENT, "region: alignment not supported");
+    if (alignment > 1U) {
+      curr_offset_ = static_cast<offset_t>(
+          (static_cast<std::size_t>(curr_offset_) + alignment - 1U) &
+          ~(alignment - 1U));
+    }
+    verify(curr_offset_ + static_cast<offset_t>(size) <= end_,
+           "region: out of bounds write");
+    auto const start = curr_offset_;
+    std::memcpy(base_ + curr_offset_, ptr, size);
+    curr_offset_ += static_cast<offset_t>(size);
+    return start;
+  }
+
+  template <typename T>
+  void write(std::size_t const pos, T const& val) {
+    verify(size_ >= pos + serialized_size<T>(), "out of bounds write");
+    std::memcpy(base_ + pos, &val, serialized_size<T>());
+  }
+
+  uint64_t checksum(offset_t) const { return 0U; }
+
+  uint8_t* base_;
+  std::size_t size_;
+  offset_t curr_offset_;
+  offset_t end_;
+};
+
+// Serializes large vectors reached from the root with several threads.
+//
+// The elements of a vector are split into chunks. Each chunk owns one
+// region after the element array that receives everything reachable from
+// its elements (strings, nested vectors, ...). A first parallel pass sizes
+// the regions with size_target, then the buffer is grown once and a second
+// parallel pass writes every region in place. Vectors nested inside a chunk
+// are serialized by its worker sequentially.
+//
+// Workers only know the pointers of their own region. Their offsets_,
+// vector_ranges_ and pending_ are merged afterwards, so pointers across
+// regions are fixed up in the final pending pass of serialize_root.
+template <mode Mode>
+struct parallel_serialization_context
+    : public serialization_context<buf<byte_buf>, Mode> {
+  static constexpr auto const PARALLEL = true;
+
+  parallel_serialization_context(buf<byte_buf>& t, unsigned const threads,
+                                 std::size_t const min_chunk_size)
+      : serialization_context<buf<byte_buf>, Mode>{t},
+        threads_{threads == 0U ? 1U : threads},
+        min_chunk_size_{min_chunk_size == 0U ? 1U : min_chunk_size} {}
+
+  template <typename T, typename SizeType>
+  bool serialize_parallel(T const* el, SizeType const n,
+                          offset_t const start) {
+    auto const chunks = std::min(static_cast<std::size_t>(threads_),
+                                 static_cast<std::size_t>(n) / min_chunk_size_);
+    if (chunks < 2U) {
+      return false;
+    }
+
+    auto const chunk_begin = [&](std::size_t const chunk) {
+      return static_cast<std::size_t>(n) * chunk / chunks;
+    };
+    auto const serialize_chunk = [&](auto& ctx, std::size_t const chunk) {
+      for (auto i = chunk_begin(chunk); i != chunk_begin(chunk + 1U); ++i) {
+        serialize(ctx, el + i,
+                  start + static_cast<offset_t>(i * serialized_size<T>()));
+      }
+    };
+
+    auto sizes = std::vector<offset_t>(chunks);
+    run(chunks, [&](std::size_t const chunk) {
+      auto t = size_target{};
+      auto ctx = serialization_context<size_target, Mode>{t};
+      serialize_chunk(ctx, chunk);
+      sizes[chunk] = t.curr_offset_;
+    });
+
+    auto const align = [](offset_t const x) {
+      constexpr auto const a =
+          static_cast<offset_t>(region_target::REGION_ALIGNMENT);
+      return (x + a - 1) & ~(a - 1);
+    };
+    auto& t = this->t_;
+    auto region_starts = std::vector<offset_t>(chunks);
+    auto regions_end = t.curr_offset_;
+    for (auto i = std::size_t{0U}; i != chunks; ++i) {
+      region_starts[i] = align(regions_end);
+      regions_end = region_starts[i] + sizes[i];
+    }
+    if (t.buf_.size() < static_cast<std::size_t>(regions_end)) {
+      t.buf_.resize(static_cast<std::size_t>(regions_end));
+    }
+    t.curr_offset_ = regions_end;
+
+    using worker_ctx = serialization_context<region_target, Mode>;
+    auto targets = std::vector<region_target>{};
+    auto contexts = std::vector<std::unique_ptr<worker_ctx>>{};
+    for (auto i = std::size_t{0U}; i != chunks; ++i) {
+      targets.emplace_back(region_target{t.base(), t.buf_.size(),
+                                         region_starts[i],
+                                         region_starts[i] + sizes[i]});
+    }
+    for (auto& target : targets) {
+      contexts.emplace_back(std::make_unique<worker_ctx>(target));
+    }
+    run(chunks, [&](std::size_t const chunk) {
+      serialize_chunk(*contexts[chunk], chunk);
+      verify(targets[chunk].curr_offset_ == targets[chunk].end_,
+             "region: size mismatch between passes");
+    });
+
+    for (auto const& ctx : contexts) {
+      for (auto const& [ptr, pos] : ctx->offsets_) {
+        this->offsets_.emplace(ptr, pos);
+      }
+      this->vector_ranges_.insert(ctx->vector_ranges_);
+      this->pending_.insert(std::end(this->pending_), begin(ctx->pending_),
+                            std::end(ctx->pending_));
+    }
+    return true;
+  }
+
+  template <typename Fn>
+  static void run(std::size_t const n, Fn&& fn) {
+    auto errors = std::vector<std::exception_ptr>(n);
+    auto workers = std::vector<std::thread>{};
+    auto const guarded = [&](std::size_t const i) {
+      try {
+        fn(i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    };
+    for (auto i = std::size_t{1U}; i < n; ++i) {
+      workers.emplace_back(guarded, i);
+    }
+    guarded(0U);
+    for (auto& w : workers) {
+      w.join();
+    }
+    for (auto const& e : errors) {
+      if (e) {
+        std::rethrow_exception(e);
+      }
+    }
+  }
+
+  unsigned threads_;
+  std::size_t min_chunk_size_;
+};
+
+// Like serialize(), but vectors with at least 2 * min_chunk_size elements
+// are serialized by up to `threads` threads. Apart from the padding between
+// regions the result is a regular buffer for deserialize().
+template <mode const Mode = mode::NONE, typename T>
+byte_buf serialize_parallel(
+    T& el, unsigned const threads = std::thread::hardware_concurrency(),
+    std::size_t const min_chunk_size = 1024U) {
+  auto b = buf{};
+  parallel_serialization_context<Mode> c{b, threads, min_chunk_size};
+  serialize_root(c, el);
+  return std::move(b.buf_);
+}
+
+// Size of the buffer serialize<Mode>(value) produces, computed by a dry run
+// that does not write anything. Pass it to buf::reserve() to allocate once.
+template <mode const Mode = mode::NONE, typename T>
+std::size_t serialization_size(T& value) {
+  auto t = size_target{};
+  serialization_context<size_target, Mode> c{t};
+  serialize_root(c, value);
+  return static_cast<std::size_t>(t.curr_offset_);
+}
+
+// =============================================================================
+// DESERIALIZE
+// -----------------------------------------------------------------------------
+template <typename Arg, typename... Args>
+Arg checked_addition(Arg a1, Args... aN) {
+  using Type = decay_t<Arg>;
+
+  auto add_if_ok = [&](Arg x) {
+    if (x == 0) {
+      return;
+    } else if (x < 0) {
+      if (a1 < std::numeric_limits<Type>::min() - x) {
+        throw std::overflow_error("addition overflow");
+      }
+    } else if (x > 0) {
+      if (a1 > std::numeric_limits<Type>::max() - x) {
+        throw std::overflow_error("addition overflow");
+      }
+    }
+    a1 = a1 + x;
+  };
+  (add_if_ok(aN), ...);
+  return a1;
+}
+
+template <typename Arg, typename... Args>
+Arg checked_multiplication(Arg a1, Args... aN) {
+  using Type = decay_t<Arg>;
+  auto multiply_if_ok = [&](auto x) {
+    if (a1 != 0 && ((std::numeric_limits<Type>::max() / a1) < x)) {
+      throw std::overflow_error("addition overflow");
+    }
+    a1 = a1 * x;
+  };
+  (multiply_if_ok(aN), ...);
+  return a1;
+}
+
+template <mode Mode>
+struct deserialization_context {
+  static constexpr auto const MODE = Mode;
+
+  deserialization_context(uint8_t* from, uint8_t* to)
+      : from_{reinterpret_cast<intptr_t>(from)},
+        to_{reinterpret_cast<intptr_t>(to)} {}
+
+  template <typename T>
+  void convert_endian(T& el) const {
+    if constexpr (endian_conversion_necessary<MODE>()) {
+      el = ::cista::convert_endian<MODE>(el);
+    }
+  }
+
+  template <typename Ptr>
+  void deserialize_ptr(Ptr** ptr) const {
+    auto const offset =
+        reinterpret_cast<offset_t>(::cista::convert_endian<MODE>(*ptr));
+    static_assert(is_mode_disabled(MODE, mode::_CONST),
+                  "raw pointer deserialize is not const");
+    *ptr = offset == NULLPTR_OFFSET
+               ? nullptr
+               : reinterpret_cast<Ptr*>(
+                     checked_addition(reinterpret_cast<offset_t>(ptr), offset));
+  }
+
+  template <typename T>
+  constexpr static size_t type_size() {
+    using Type = decay_t<T>;
+    if constexpr (std::is_same_v<Type, void>) {
+      return 0;
+    } else {
+      return sizeof(Type);
+    }
+  }
+
+  template <typename T>
+  void check_ptr(offset_ptr<T> const& el,
+                 size_t const size = type_size<T>()) const {
+    checked_addition(el.offset_, reinterpret_cast<intptr_t>(&el));
+    check_ptr(el.get(), size);
+  }
+
+  template <typename T>
+  void check_ptr(T* el, size_t const size = type_size<T>()) const {
+    if constexpr ((MODE & mode::UNCHECKED) == mode::UNCHECKED) {
+      return;
+    }
+
+    if (el == nullptr || to_ == 0U) {
+      return;
+    }
+
+    auto const pos = reinterpret_cast<intptr_t>(el);
+    verify(pos >= from_, "underflow");
+    verify(checked_addition(pos, static_cast<intptr_t>(size)) <= to_,
+           "overflow");
+    verify(size < static_cast<size_t>(std::numeric_limits<intptr_t>::max()),
+           "size out of bounds");
+
+    if constexpr (!std::is_same_v<T, void>) {
+      verify((pos &
+              static_cast<intptr_t>(std::alignment_of<decay_t<T>>() - 1)) == 0U,
+             "ptr alignment");
+    }
+  }
+
+  static void check_bool(bool const& b) {
+    auto const val = *reinterpret_cast<uint8_t const*>(&b);
+    verify(val <= 1U, "valid bool");
+  }
+
+  void require(bool condition, char const* msg) const {
+    if constexpr ((MODE & mode::UNCHECKED) == mode::UNCHECKED) {
+      return;
+    }
+
+    if (!condition) {
+      throw std::runtime_error(msg);
+    }
+  }
+
+  intptr_t from_, to_;
+};
+
+template <mode Mode>
+struct deep_check_context : public deserialization_context<Mode> {
+  using parent = deserialization_context<Mode>;
+
+  using parent::parent;
+
+  template <typename T>
+  bool add_checked(T const* v) const {
+    return checked_.emplace(type_hash<T>(), static_cast<void const*>(v)).second;
+  }
+
+  std::set<std::pair<hash_t, void const*>> mutable checked_;
+};
+
+template <mode const Mode = mode::NONE>
+void check_integrity(uint8_t const* from, uint8_t const* to) {
+  if constexpr ((Mode & mode::WITH_INTEGRITY) == mode::WITH_INTEGRITY) {
+    auto const data = from + data_start(Mode);
+    auto const size = static_cast<size_t>(to - data);
+    auto const expected = convert_endian<Mode>(
+        *reinterpret_cast<uint64_t const*>(from + integrity_start(Mode)));
+    if constexpr (is_mode_enabled(Mode, mode::FAST_INTEGRITY)) {
+      verify(expected == chunked_checksum(data, size), "invalid checksum");
+    } else {
+      verify(expected ==
+                 hash(std::string_view{reinterpret_cast<char const*>(data),
+                                       size}),
+             "invalid checksum");
+    }
+  } else {
+    CISTA_UNUSED_PARAM(from)
+    CISTA_UNUSED_PARAM(to)
+  }
+}
+
+template <typename T, mode const Mode = mode::NONE>
+void check(uint8_t const* from, uint8_t const* to) {
+  verify(to - from > data_start(Mode), "invalid range");
+
+  if constexpr ((Mode & mode::WITH_VERSION) == mode::WITH_VERSION) {
+    verify(convert_endian<Mode>(*reinterpret_cast<hash_t const*>(from)) ==
+               type_hash<T>(),
+           "invalid version");
+  }
+
+  check_integrity<Mode>(from, to);
+}
+
+// --- GENERIC ---
+template <typename Ctx, typename T>
+void convert_endian_and_ptr(Ctx const& c, T* el) {
+  using Type = decay_t<T>;
+  if constexpr (std::is_pointer_v<Type>) {
+    c.deserialize_ptr(el);
+  } else if constexpr (std::numeric_limits<Type>::is_integer ||
+                       std::is_floating_point_v<Type>) {
+    c.convert_endian(*el);
+  } else {
+    CISTA_UNUSED_PARAM(c)
+    CISTA_UNUSED_PARAM(el)
+  }
+}
+
+template <typename Ctx, typename T>
+void check_state(Ctx const& c, T* el) {
+  using Type = decay_t<T>;
+  if constexpr (std::is_pointer_v<Type> && !std::is_same_v<Type, void*>) {
+    c.check_ptr(*el);
+  } else {
+    CISTA_UNUSED_PARAM(c)
+    CISTA_UNUSED_PARAM(el)
+  }
+}
+
+template <typename Ctx, typename T, typename Fn>
+void recurse(Ctx& c, T* el, Fn&& fn) {
+  using Type = decay_t<T>;
+  if constexpr (is_indexed_v<Type>) {
+    fn(static_cast<typename T::value_type*>(el));
+  } else if constexpr (std::is_aggregate_v<Type> && !std::is_union_v<Type>) {
+    for_each_ptr_field(*el, [&](auto& f) { fn(f); });
+  } else if constexpr (is_mode_enabled(Ctx::MODE, mode::_PHASE_II) &&
+                       std::is_pointer_v<Type>) {
+    if (*el != nullptr && c.add_checked(el)) {
+      fn(*el);
     }
-    return false;
+  } else {
+    CISTA_UNUSED_PARAM(c)
+    CISTA_UNUSED_PARAM(el)
+    CISTA_UNUSED_PARAM(fn)
   }
+}
 
-  template <typename Ptr>
-  std::optional<offset_t> resolve_vector_range_ptr(Ptr ptr) {
-    if (vector_ranges_.empty()) {
-      return std::nullopt;
-    } else if (auto const vec_it = vector_ranges_.upper_bound(ptr);
-               vec_it == begin(vector_ranges_)) {
-      return std::nullopt;
-    } else {
-      auto const pred = std::prev(vec_it);
-      return pred->second.contains(pred->first, ptr)
-                 ? std::make_optional(pred->second.offset_of(pred->first, ptr))
-                 : std::nullopt;
+template <typename Ctx, typename T>
+void deserialize(Ctx const& c, T* el) {
+  c.check_ptr(el);
+  if constexpr (is_mode_disabled(Ctx::MODE, mode::_PHASE_II)) {
+    convert_endian_and_ptr(c, el);
+  }
+  if constexpr (is_mode_disabled(Ctx::MODE, mode::UNCHECKED)) {
+    check_state(c, el);
+  }
+  recurse(c, el, [&](auto* entry) { deserialize(c, entry); });
+}
+
+// --- OFFSET_PTR<T> ---
+template <typename Ctx, typename T>
+void convert_endian_and_ptr(Ctx const& c, offset_ptr<T>* el) {
+  c.convert_endian(el->offset_);
+}
+
+template <typename Ctx, typename T>
+void check_state(Ctx const& c, offset_ptr<T>* el) {
+  c.check_ptr(*el);
+}
+
+template <typename Ctx, typename T, typename Fn>
+void recurse(Ctx& c, offset_ptr<T>* el, Fn&& fn) {
+  if constexpr (is_mode_enabled(Ctx::MODE, mode::_PHASE_II)) {
+    if (*el != nullptr && c.add_checked(el)) {
+      fn(static_cast<T*>(*el));
     }
+  } else {
+    CISTA_UNUSED_PARAM(c)
+    CISTA_UNUSED_PARAM(el)
+    CISTA_UNUSED_PARAM(fn)
   }
+}
 
-  uint64_t checksum(offset_t const from) const { return t_.checksum(from); }
+// --- VECTOR<T> ---
+template <typename Ctx, typename T, typename Ptr, bool Indexed,
+          typename TemplateSizeType>
+void convert_endian_and_ptr(
+    Ctx const& c, basic_vector<T, Ptr, Indexed, TemplateSizeType>* el) {
+  deserialize(c, &el->el_);
+  c.convert_endian(el->allocated_size_);
+  c.convert_endian(el->used_size_);
+}
 
-  cista::raw::hash_map<void const*, offset_t> offsets_;
-  std::map<void const*, vector_range> vector_ranges_;
-  std::vector<pending_offset> pending_;
-  Target& t_;
-};
+template <typename Ctx, typename T, typename Ptr, bool Indexed,
+          typename TemplateSizeType>
+void check_state(Ctx const& c,
+                 basic_vector<T, Ptr, Indexed, TemplateSizeType>* el) {
+  c.check_ptr(el->el_,
+              checked_multiplication(static_cast<size_t>(el->allocated_size_),
+                                     sizeof(T)));
+  c.check_bool(el->self_allocated_);
+  c.require(!el->self_allocated_, "vec self-allocated");
+  c.require(el->used_size_ <= el->allocated_size_, "vec size mismatch");
+  c.require((el->size() == 0) == (el->el_ == nullptr), "vec size=0 <=> ptr=0");
+}
 
-template <typename Ctx, typename T>
-void serialize(Ctx& c, T const* origin, offset_t const pos) {
-  using Type = decay_t<T>;
-  if constexpr (std::is_union_v<Type>) {
-    static_assert(std::is_standard_layout_v<Type> &&
-                  std::is_trivially_copyable_v<Type>);
-  } else if constexpr (is_pointer_v<Type>) {
-    c.resolve_pointer(*origin, pos);
-  } else if constexpr (is_indexed_v<Type>) {
-    c.offsets_.emplace(origin, pos);
-    serialize(c, static_cast<typename Type::value_type const*>(origin), pos);
-  } else if constexpr (!std::is_scalar_v<Type>) {
-    static_assert(to_tuple_works_v<Type>, "Please implement custom serializer");
-    for_each_ptr_field(*origin, [&](auto& member) {
-      auto const member_offset =
-          static_cast<offset_t>(reinterpret_cast<intptr_t>(member) -
-                                reinterpret_cast<intptr_t>(origin));
-      serialize(c, member, pos + member_offset);
+template <typename Ctx, typename T, typename Ptr, bool Indexed,
+          typename TemplateSizeType, typename Fn>
+void recurse(Ctx&, basic_vector<T, Ptr, Indexed, TemplateSizeType>* el,
+             Fn&& fn) {
+  if constexpr (is_mode_disabled(Ctx::MODE, mode::_SHALLOW)) {
+    for (auto& m : *el) {
+      fn(&m);
+    }
+  }
+}
+
+// --- VECVEC ---
+// The index is validated after both vectors were checked (and converted),
+// before that its entries must not be read.
+template <typename Ctx, typename DataVec, typename IndexVec, typename Fn>
+void recurse(Ctx& c, basic_vecvec<DataVec, IndexVec>* el, Fn&& fn) {
+  fn(&el->data_);
+  fn(&el->bucket_starts_);
+  if constexpr (is_mode_disabled(Ctx::MODE, mode::UNCHECKED) &&
+                is_mode_disabled(Ctx::MODE, mode::_SHALLOW)) {
+    auto const& starts = el->bucket_starts_;
+    if (starts.empty()) {
+      c.require(el->data_.empty(), "vecvec data without index");
+      return;
+    }
+    c.require(starts[0] == 0U, "vecvec first bucket start");
+    for (auto i = size_t{1U}; i < starts.size(); ++i) {
+      c.require(starts[i - 1U] <= starts[i], "vecvec bucket order");
+    }
+    c.require(starts.back() == el->data_.size(), "vecvec last bucket end");
+  } else {
+    CISTA_UNUSED_PARAM(c)
+  }
+}
+
+// --- COMPRESSED VECTOR ---
+// Only the block index is checked here, the compressed bytes are verified
+// while decompressing.
+template <typename Ctx, typename T, template <typename> typename Vec,
+          typename Fn>
+void recurse(Ctx& c, basic_compressed_vector<T, Vec>* el, Fn&& fn) {
+  static_assert(!endian_conversion_necessary<Ctx::MODE>() || sizeof(T) == 1U,
+                "compressed_vector is stored in host byte order");
+  fn(&el->data_);
+  fn(&el->block_starts_);
+  fn(&el->block_hashes_);
+  if constexpr (is_mode_disabled(Ctx::MODE, mode::UNCHECKED) &&
+                is_mode_disabled(Ctx::MODE, mode::_SHALLOW)) {
+    auto const& starts = el->block_starts_;
+    c.require(el->block_size_ != 0U, "compressed_vector block size");
+    auto const blocks = el->size_ / el->block_size_ +
+                        (el->size_ % el->block_size_ != 0U ? 1U : 0U);
+    if (starts.empty()) {
+      c.require(blocks == 0U && el->data_.empty() && el->block_hashes_.empty(),
+                "compressed_vector data without index");
+      return;
+    }
+    c.require(starts.size() - 1U == blocks, "compressed_vector block count");
+    c.require(el->block_hashes_.size() == blocks,
+              "compressed_vector block hash count");
+    c.require(starts[0] == 0U, "compressed_vector first block start");
+    for (auto i = size_t{1U}; i < starts.size(); ++i) {
+      c.require(starts[i - 1U] < starts[i], "compressed_vector block order");
+    }
+    c.require(starts.back() == el->data_.size(),
+              "compressed_vector last block end");
+  } else {
+    CISTA_UNUSED_PARAM(c)
+  }
+}
+
+// --- SOA ---
+template <typename Ctx, typename T, template <typename> typename Vec,
+          typename Fn>
+void recurse(Ctx& c, basic_soa<T, Vec>* el, Fn&& fn) {
+  el->for_each_column([&](auto, auto& col) { fn(&col); });
+  if constexpr (is_mode_disabled(Ctx::MODE, mode::UNCHECKED)) {
+    auto const size = el->size();
+    el->for_each_column([&](auto, auto& col) {
+      c.require(col.size() == size, "soa column size mismatch");
     });
-  } else if constexpr (std::numeric_limits<Type>::is_integer ||
-                       std::is_floating_point_v<Type>) {
-    c.write(pos, convert_endian<Ctx::MODE>(*origin));
   } else {
-    (void)origin;
-    (void)pos;
+    CISTA_UNUSED_PARAM(c)
+  }
+}
+
+// --- STRING ---
+template <typename Ctx, typename Ptr>
+void convert_endian_and_ptr(Ctx const& c, generic_string<Ptr>* el) {
+  if (*reinterpret_cast<uint8_t const*>(&el->s_.is_short_) == 0U) {
+    deserialize(c, &el->h_.ptr_);
+    c.convert_endian(el->h_.size_);
+  }
+}
+
+template <typename Ctx, typename Ptr>
+void check_state(Ctx const& c, generic_string<Ptr>* el) {
+  c.check_bool(el->s_.is_short_);
+  if (!el->is_short()) {
+    c.check_ptr(el->h_.ptr_, el->h_.size_);
+    c.check_bool(el->h_.self_allocated_);
+    c.require(!el->h_.self_allocated_, "string self-allocated");
+    c.require((el->h_.size_ == 0) == (el->h_.ptr_ == nullptr),
+              "str size=0 <=> ptr=0");
+  }
+}
+
+template <typename Ctx, typename Ptr, typename Fn>
+void recurse(Ctx&, generic_string<Ptr>*, Fn&&) {}
+
+template <typename Ctx, typename Ptr>
+void convert_endian_and_ptr(Ctx const& c, basic_string<Ptr>* el) {
+  convert_endian_and_ptr(c, static_cast<generic_string<Ptr>*>(el));
+}
+
+template <typename Ctx, typename Ptr>
+void check_state(Ctx const& c, basic_string<Ptr>* el) {
+  check_state(c, static_cast<generic_string<Ptr>*>(el));
+}
+
+template <typename Ctx, typename Ptr, typename Fn>
+void recurse(Ctx&, basic_string<Ptr>*, Fn&&) {}
+
+template <typename Ctx, typename Ptr>
+void convert_endian_and_ptr(Ctx const& c, basic_string_view<Ptr>* el) {
+  convert_endian_and_ptr(c, static_cast<generic_string<Ptr>*>(el));
+}
+
+template <typename Ctx, typename Ptr>
+void check_state(Ctx const& c, basic_string_view<Ptr>* el) {
+  check_state(c, static_cast<generic_string<Ptr>*>(el));
+}
+
+template <typename Ctx, typename Ptr, typename Fn>
+void recurse(Ctx&, basic_string_view<Ptr>*, Fn&&) {}
+
+// --- HASHED_STRING ---
+template <typename Ctx, typename Ptr>
+void convert_endian_and_ptr(Ctx const& c, basic_hashed_string<Ptr>* el) {
+  c.convert_endian(el->hash_);
+}
+
+template <typename Ctx, typename Ptr, typename Fn>
+void recurse(Ctx&, basic_hashed_string<Ptr>* el, Fn&& fn) {
+  fn(&el->str_);
+}
+
+// --- UNIQUE_PTR<T> ---
+template <typename Ctx, typename T, typename Ptr>
+void convert_endian_and_ptr(Ctx const& c, basic_unique_ptr<T, Ptr>* el) {
+  deserialize(c, &el->el_);
+}
+
+template <typename Ctx, typename T, typename Ptr>
+void check_state(Ctx const& c, basic_unique_ptr<T, Ptr>* el) {
+  c.check_bool(el->self_allocated_);
+  c.require(!el->self_allocated_, "unique_ptr self-allocated");
+}
+
+template <typename Ctx, typename T, typename Ptr, typename Fn>
+void recurse(Ctx&, basic_unique_ptr<T, Ptr>* el, Fn&& fn) {
+  if constexpr (is_mode_disabled(Ctx::MODE, mode::_SHALLOW)) {
+    if (el->el_ != nullptr) {
+      fn(static_cast<T*>(el->el_));
+    }
   }
 }
 
-template <typename Ctx, typename T, typename Ptr, bool Indexed,
-          typename TemplateSizeType>
-void serialize(Ctx& c,
-               basic_vector<T, Ptr, Indexed, TemplateSizeType> const* origin,
-               offset_t const pos) {
-  using Type = basic_vector<T, Ptr, Indexed, TemplateSizeType>;
+// --- HASH_STORAGE<T> ---
+template <typename Ctx, typename T, template <typename> typename Ptr,
+          typename GetKey, typename GetValue, typename Hash, typename Eq>
+void convert_endian_and_ptr(
+    Ctx const& c,
+    hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>* el) {
+  deserialize(c, &el->entries_);
+  deserialize(c, &el->ctrl_);
+  c.convert_endian(el->size_);
+  c.convert_endian(el->capacity_);
+  c.convert_endian(el->growth_left_);
+}
+
+template <typename Ctx, typename T, template <typename> typename Ptr,
+          typename GetKey, typename GetValue, typename Hash, typename Eq>
+void check_state(
+    Ctx const& c,
+    hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>* el) {
+  using Type = decay_t<remove_pointer_t<decltype(el)>>;
+  c.require(el->ctrl_ != nullptr, "hash storage: ctrl must be set");
+  c.check_ptr(
+      el->entries_,
+      checked_addition(
+          checked_multiplication(
+              el->capacity_, static_cast<typename Type::size_type>(sizeof(T))),
+          checked_addition(el->capacity_, 1U, Type::WIDTH)));
+  c.check_ptr(el->ctrl_, checked_addition(el->capacity_, 1U, Type::WIDTH));
+  c.require(el->entries_ == nullptr ||
+                reinterpret_cast<uint8_t const*>(ptr_cast(el->ctrl_)) ==
+                    reinterpret_cast<uint8_t const*>(ptr_cast(el->entries_)) +
+                        checked_multiplication(
+                            static_cast<size_t>(el->capacity_), sizeof(T)),
+            "hash storage: entries!=null -> ctrl = entries+capacity");
+  c.require(
+      (el->entries_ == nullptr) == (el->capacity_ == 0U && el->size_ == 0U),
+      "hash storage: entries=null <=> size=capacity=0");
+
+  c.check_bool(el->self_allocated_);
+  c.require(!el->self_allocated_, "hash storage: self-allocated");
 
-  auto const size = serialized_size<T>() * origin->used_size_;
-  auto const start = origin->el_ == nullptr
-                         ? NULLPTR_OFFSET
-                         : c.write(static_cast<T const*>(origin->el_), size,
-                                   std::alignment_of_v<T>);
+  c.require(el->ctrl_[el->capacity_] == Type::END,
+            "hash storage: end ctrl byte");
+  c.require(std::all_of(ptr_cast(el->ctrl_),
+                        ptr_cast(el->ctrl_) + el->capacity_ + 1U + Type::WIDTH,
+                        [](typename Type::ctrl_t const ctrl) {
+                          return Type::is_empty(ctrl) ||
+                                 Type::is_deleted(ctrl) ||
+                                 Type::is_full(ctrl) ||
+                                 ctrl == Type::ctrl_t::END;
+                        }),
+            "hash storage: ctrl bytes must be empty or deleted or full");
 
-  c.write(pos + cista_member_offset(Type, el_),
-          convert_endian<Ctx::MODE>(
-              start == NULLPTR_OFFSET
-                  ? start
-                  : start - cista_member_offset(Type, el_) - pos));
-  c.write(pos + cista_member_offset(Type, allocated_size_),
-          convert_endian<Ctx::MODE>(origin->used_size_));
-  c.write(pos + cista_member_offset(Type, used_size_),
-          convert_endian<Ctx::MODE>(origin->used_size_));
-  c.write(pos + cista_member_offset(Type, self_allocated_), false);
+  using st_t = typename Type::size_type;
+  auto [empty, full, deleted] = std::accumulate(
+      ptr_cast(el->ctrl_), ptr_cast(el->ctrl_) + el->capacity_,
+      std::tuple{st_t{0U}, st_t{0U}, st_t{0U}},
+      [&](std::tuple<st_t, st_t, st_t> const acc,
+          typename Type::ctrl_t const& ctrl) {
+        auto const [empty, full, deleted] = acc;
+        return std::tuple{Type::is_empty(ctrl) ? empty + 1 : empty,
+                          Type::is_full(ctrl) ? full + 1 : full,
+                          Type::is_deleted(ctrl) ? deleted + 1 : deleted};
+      });
 
-  if constexpr (Indexed) {
-    if (origin->el_ != nullptr) {
-      c.vector_ranges_.emplace(origin->el_, vector_range{start, size});
+  c.require(el->size_ == full, "hash storage: size");
+  c.require(empty + full + deleted == el->capacity_,
+            "hash storage: empty + full + deleted = capacity");
+
+  // Inserting into an empty slot consumes growth, erasing either returns it
+  // (slot becomes empty) or leaves a tombstone, resize starts over with
+  // growth_left = capacity_to_growth(capacity) - size.
+  auto const max_growth = Type::capacity_to_growth(el->capacity_);
+  c.require(el->size_ + deleted <= max_growth &&
+                el->growth_left_ == max_growth - el->size_ - deleted,
+            "hash storage: growth left");
+}
+
+template <typename Ctx, typename T, template <typename> typename Ptr,
+          typename GetKey, typename GetValue, typename Hash, typename Eq,
+          typename Fn>
+void recurse(Ctx&,
+             hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>* el,
+             Fn&& fn) {
+  if constexpr (is_mode_disabled(Ctx::MODE, mode::_SHALLOW)) {
+    for (auto& m : *el) {
+      fn(&m);
     }
   }
+}
 
-  if (origin->el_ != nullptr) {
-    auto i = 0u;
-    for (auto it = start; it != start + static_cast<offset_t>(size);
-         it += serialized_size<T>()) {
-      serialize(c, static_cast<T const*>(origin->el_ + i++), it);
-    }
+// --- ARRAY<T> ---
+template <typename Ctx, typename T, size_t Size, typename Fn>
+void recurse(Ctx&, array<T, Size>* el, Fn&& fn) {
+  for (auto& m : *el) {
+    fn(&m);
   }
 }
 
-template <typename Ctx, typename Ptr>
-void serialize(Ctx& c, generic_string<Ptr> const* origin, offset_t const pos) {
-  using Type = generic_string<Ptr>;
+template <typename T, mode const Mode = mode::NONE, typename CharT>
+T* deserialize(CharT* from, CharT* to = nullptr) {
+  static_assert(sizeof(decltype(from[0])) == 1U, "byte container");
+  if constexpr (is_mode_enabled(Mode, mode::CAST)) {
+    CISTA_UNUSED_PARAM(to)
+    return reinterpret_cast<T*>(from);
+  } else {
+    check<T, Mode>(from, to);
+    auto const el = reinterpret_cast<T*>(from + data_start(Mode));
 
-  if (origin->is_short()) {
-    return;
+    deserialization_context<Mode> c{from, to};
+    deserialize(c, el);
+
+    if constexpr ((Mode & mode::DEEP_CHECK) == mode::DEEP_CHECK) {
+      deep_check_context<Mode | mode::_PHASE_II> c1{from, to};
+      deserialize(c1, el);
+    }
+
+    return el;
   }
+}
 
-  auto const start = (origin->h_.ptr_ == nullptr)
-                         ? NULLPTR_OFFSET
-                         : c.write(origin->data(), origin->size());
-  c.write(pos + cista_member_offset(Type, h_.ptr_),
-          convert_endian<Ctx::MODE>(
-              start == NULLPTR_OFFSET
-                  ? start
-                  : start - cista_member_offset(Type, h_.ptr_) - pos));
-  c.write(pos + cista_member_offset(Type, h_.size_),
-          convert_endian<Ctx::MODE>(origin->h_.size_));
-  c.write(pos + cista_member_offset(Type, h_.self_allocated_), false);
+template <typename T, mode const Mode = mode::NONE>
+T const* deserialize(std::string_view c) {
+  static_assert(!endian_conversion_necessary<Mode>(), "cannot be const");
+  return deserialize<T const, Mode | mode::_CONST>(
+      reinterpret_cast<uint8_t const*>(&c[0]),
+      reinterpret_cast<uint8_t const*>(&c[0] + c.size()));
 }
 
-template <typename Ctx, typename Ptr>
-void serialize(Ctx& c, basic_string<Ptr> const* origin, offset_t const pos) {
-  serialize(c, static_cast<generic_string<Ptr> const*>(origin), pos);
+template <typename T, mode const Mode = mode::NONE, typename Container>
+T const* deserialize(Container const& c) {
+  static_assert(sizeof(decay_t<decltype(c[0])>) == 1U, "byte size entries");
+  static_assert(!endian_conversion_necessary<Mode>(), "cannot be const");
+  return deserialize<T const, Mode | mode::_CONST>(
+      reinterpret_cast<uint8_t const*>(&c[0]),
+      reinterpret_cast<uint8_t const*>(&c[0] + c.size()));
 }
 
-template <typename Ctx, typename Ptr>
-void serialize(Ctx& c, basic_string_view<Ptr> const* origin,
-               offset_t const pos) {
-  serialize(c, static_cast<generic_string<Ptr> const*>(origin), pos);
+template <typename T, mode const Mode = mode::NONE, typename Container>
+T* deserialize(Container& c) {
+  static_assert(sizeof(decay_t<decltype(c[0])>) == 1U, "byte size entries");
+  return deserialize<T, Mode>(reinterpret_cast<uint8_t*>(&c[0]),
+                              reinterpret_cast<uint8_t*>(&c[0] + c.size()));
 }
 
-template <typename Ctx, typename T, typename Ptr>
-void serialize(Ctx& c, basic_unique_ptr<T, Ptr> const* origin,
-               offset_t const pos) {
-  using Type = basic_unique_ptr<T, Ptr>;
+template <typename T, mode const Mode = mode::NONE>
+T* unchecked_deserialize(uint8_t* from, uint8_t* to = nullptr) {
+  return deserialize<T, Mode | mode::UNCHECKED>(from, to);
+}
 
-  auto const start =
-      origin->el_ == nullptr
-          ? NULLPTR_OFFSET
-          : c.write(origin->el_, serialized_size<T>(), std::alignment_of_v<T>);
+template <typename T, mode const Mode = mode::NONE, typename Container>
+T* unchecked_deserialize(Container& c) {
+  return unchecked_deserialize<T, Mode>(&c[0], &c[0] + c.size());
+}
 
-  c.write(pos + cista_member_offset(Type, el_),
-          convert_endian<Ctx::MODE>(
-              start == NULLPTR_OFFSET
-                  ? start
-                  : start - cista_member_offset(Type, el_) - pos));
-  c.write(pos + cista_member_offset(Type, self_allocated_), false);
+// Validates a buffer on demand instead of walking it completely in
+// deserialize(), so opening a large mmap only touches the pages in use.
+//
+// The constructor checks the header (version, integrity if requested) and
+// the root object itself. Before following a vector, string, unique_ptr or
+// pointer, pass the target to shallow() - it checks the object and its
+// inline members (e.g. that a vector's elements lie inside the buffer) but
+// not what they point to. deep() checks a whole subtree like DEEP_CHECK
+// does. Both remember what they validated and are thread safe.
+// check_all_async() validates everything on a background thread; once it
+// has finished, shallow() and deep() return immediately.
+//
+// The buffer is used read-only, so this is limited to data that needs no
+// endian conversion and no raw pointer fixup (offset containers).
+// WITH_INTEGRITY still hashes the whole buffer in the constructor.
+template <typename T, mode const Mode = mode::NONE>
+struct lazy_checked {
+  static constexpr auto const MODE = Mode | mode::_CONST;
+  static_assert(!endian_conversion_necessary<Mode>(), "cannot be const");
 
-  if (origin->el_ != nullptr) {
-    c.offsets_[origin->el_] = start;
-    serialize(c, ptr_cast(origin->el_), start);
+  lazy_checked(uint8_t const* from, uint8_t const* to) : from_{from}, to_{to} {
+    check<T, Mode>(from, to);
+    root_ = reinterpret_cast<T const*>(from + data_start(Mode));
+    shallow(root_);
   }
-}
-
-template <typename Ctx, typename T, template <typename> typename Ptr,
-          typename GetKey, typename GetValue, typename Hash, typename Eq>
-void serialize(
-    Ctx& c,
-    hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq> const* origin,
-    offset_t const pos) {
-  using Type = hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>;
 
-  auto const start = origin->entries_ == nullptr
-                         ? NULLPTR_OFFSET
-                         : c.write(origin->entries_,
-                                   origin->capacity_ * serialized_size<T>() +
-                                       (origin->capacity_ + 1 + Type::WIDTH) *
-                                           sizeof(typename Type::ctrl_t),
-                                   std::alignment_of_v<T>);
-  auto const ctrl_start =
-      start == NULLPTR_OFFSET
-          ? c.write(Type::empty_group(), 16 * sizeof(typename Type::ctrl_t),
-                    std::alignment_of_v<typename Type::ctrl_t>)
-          : start +
-                static_cast<offset_t>(origin->capacity_ * serialized_size<T>());
+  template <typename Container>
+  explicit lazy_checked(Container const& c)
+      : lazy_checked{reinterpret_cast<uint8_t const*>(&c[0]),
+                     reinterpret_cast<uint8_t const*>(&c[0] + c.size())} {}
 
-  c.write(pos + cista_member_offset(Type, entries_),
-          convert_endian<Ctx::MODE>(
-              start == NULLPTR_OFFSET
-                  ? start
-                  : start - cista_member_offset(Type, entries_) - pos));
-  c.write(pos + cista_member_offset(Type, ctrl_),
-          convert_endian<Ctx::MODE>(
-              ctrl_start == NULLPTR_OFFSET
-                  ? ctrl_start
-                  : ctrl_start - cista_member_offset(Type, ctrl_) - pos));
+  lazy_checked(lazy_checked const&) = delete;
+  lazy_checked& operator=(lazy_checked const&) = delete;
 
-  c.write(pos + cista_member_offset(Type, self_allocated_), false);
+  ~lazy_checked() {
+    if (background_.joinable()) {
+      background_.join();
+    }
+  }
 
-  c.write(pos + cista_member_offset(Type, size_),
-          convert_endian<Ctx::MODE>(origin->size_));
-  c.write(pos + cista_member_offset(Type, capacity_),
-          convert_endian<Ctx::MODE>(origin->capacity_));
-  c.write(pos + cista_member_offset(Type, growth_left_),
-          convert_endian<Ctx::MODE>(origin->growth_left_));
+  T const* root() const { return root_; }
+  T const* operator->() const { return root_; }
+  T const& operator*() const { return *root_; }
 
-  if (origin->entries_ != nullptr) {
-    auto i = 0u;
-    for (auto it = start;
-         it != start + static_cast<offset_t>(origin->capacity_ *
-                                             serialized_size<T>());
-         it += serialized_size<T>(), ++i) {
-      if (Type::is_full(origin->ctrl_[i])) {
-        serialize(c, static_cast<T*>(origin->entries_ + i), it);
-      }
+  template <typename U>
+  U const* shallow(U const* el) const {
+    if (!is_checked<U, false>(el)) {
+      auto c = deserialization_context<MODE | mode::_SHALLOW>{
+          const_cast<uint8_t*>(from_), const_cast<uint8_t*>(to_)};
+      deserialize(c, mutable_ptr(el));
+      mark_checked<U, false>(el);
     }
+    return el;
   }
-}
 
-template <typename Ctx, typename T, size_t Size>
-void serialize(Ctx& c, array<T, Size> const* origin, offset_t const pos) {
-  auto const size =
-      static_cast<offset_t>(serialized_size<T>() * origin->size());
-  auto i = 0u;
-  for (auto it = pos; it != pos + size; it += serialized_size<T>()) {
-    serialize(c, origin->el_ + i++, it);
+  template <typename U>
+  U const* deep(U const* el) const {
+    if (!is_checked<U, true>(el)) {
+      auto c = deserialization_context<MODE>{const_cast<uint8_t*>(from_),
+                                             const_cast<uint8_t*>(to_)};
+      deserialize(c, mutable_ptr(el));
+      auto c1 = deep_check_context<MODE | mode::_PHASE_II>{
+          const_cast<uint8_t*>(from_), const_cast<uint8_t*>(to_)};
+      deserialize(c1, mutable_ptr(el));
+      mark_checked<U, true>(el);
+    }
+    return el;
   }
-}
 
-constexpr offset_t integrity_start(mode const m) {
-  offset_t start = 0;
-  if (is_mode_enabled(m, mode::WITH_VERSION)) {
-    start += sizeof(uint64_t);
+  void check_all_async() {
+    if (background_.joinable() || all_checked_) {
+      return;
+    }
+    background_ = std::thread{[this]() {
+      try {
+        deep(root_);
+        all_checked_ = true;
+      } catch (...) {
+        error_ = std::current_exception();
+      }
+    }};
   }
-  return start;
-}
 
-constexpr offset_t data_start(mode const m) {
-  auto start = integrity_start(m);
-  if (is_mode_enabled(m, mode::WITH_INTEGRITY)) {
-    start += sizeof(uint64_t);
+  // Waits for check_all_async() and rethrows its error, if any.
+  void wait() {
+    if (background_.joinable()) {
+      background_.join();
+    }
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
   }
-  return start;
-}
 
-template <mode const Mode = mode::NONE, typename Target, typename T>
-void serialize(Target& t, T& value) {
-  serialization_context<Target, Mode> c{t};
-
-  if constexpr (is_mode_enabled(Mode, mode::WITH_VERSION)) {
-    auto const h = convert_endian<Mode>(type_hash<decay_t<T>>());
-    c.write(&h, sizeof(h));
-  }
+  bool all_checked() const { return all_checked_; }
 
-  auto integrity_offset = offset_t{0};
-  if constexpr (is_mode_enabled(Mode, mode::WITH_INTEGRITY)) {
-    auto const h = hash_t{};
-    integrity_offset = c.write(&h, sizeof(h));
+private:
+  // The type specific checks take mutable pointers. Nothing is written:
+  // MODE rules out endian conversion and raw pointer fixup.
+  template <typename U>
+  static U* mutable_ptr(U const* el) {
+    return const_cast<U*>(el);
   }
 
-  serialize(c, &value,
-            c.write(&value, serialized_size<T>(),
-                    std::alignment_of_v<decay_t<decltype(value)>>));
+  template <typename U, bool Deep>
+  static void const* tag() {
+    static char const t = 0;
+    return &t;
+  }
 
-  for (auto& p : c.pending_) {
-    if (!c.resolve_pointer(p.origin_ptr_, p.pos_, false)) {
-      printf("warning: dangling pointer at %" PRI_O " (origin=%p)\n", p.pos_,
-             p.origin_ptr_);
+  template <typename U, bool Deep>
+  bool is_checked(U const* el) const {
+    if (all_checked_) {
+      return true;
     }
+    auto const lock = std::lock_guard{mutex_};
+    return checked_.find({tag<U, Deep>(), el}) != end(checked_) ||
+           (!Deep && checked_.find({tag<U, true>(), el}) != end(checked_));
   }
 
-  if constexpr (is_mode_enabled(Mode, mode::WITH_INTEGRITY)) {
-    auto const csum =
-        c.checksum(integrity_offset + static_cast<offset_t>(sizeof(hash_t)));
-    c.write(integrity_offset, convert_endian<Mode>(csum));
+  template <typename U, bool Deep>
+  void mark_checked(U const* el) const {
+    auto const lock = std::lock_guard{mutex_};
+    checked_.emplace(tag<U, Deep>(), el);
   }
-}
-
-template <mode const Mode = mode::NONE, typename T>
-byte_buf serialize(T& el) {
-  auto b = buf{};
-  serialize<Mode>(b, el);
-  return std::move(b.buf_);
-}
 
-// =============================================================================
-// DESERIALIZE
-// -----------------------------------------------------------------------------
-template <typename Arg, typename... Args>
-Arg checked_addition(Arg a1, Args... aN) {
-  using Type = decay_t<Arg>;
+  uint8_t const* from_;
+  uint8_t const* to_;
+  T const* root_{nullptr};
+  std::atomic_bool all_checked_{false};
+  std::exception_ptr error_;
+  std::thread background_;
+  std::mutex mutable mutex_;
+  std::set<std::pair<void const*, void const*>> mutable checked_;
+};
 
-  auto add_if_ok = [&](Arg x) {
-    if (x == 0) {
+// Reads the root of a mode::WITH_SCHEMA buffer that may have been written
+// by another version of T.
+//
+// If the stored type hash equals type_hash<T>(), the buffer is checked by
+// deserialize() as usual and exact() returns the root: the same cost as
+// without a schema. Otherwise the fields of T are looked up by tag (see
+// field_tag()) in the field table of the buffer. get<I>() returns a stored
+// field in place and, for a field the writer did not have, the value from
+// T{}. The defaults are constructed on first use. Stored fields unknown to
+// T are ignored and not validated.
+//
+// A field must keep its type as long as it keeps its tag; changing it
+// throws. Give the field a new tag instead. Like lazy_checked, this reads
+// the buffer as const and is limited to offset containers without endian
+// conversion.
+template <typename T, mode const Mode>
+struct versioned_view {
+  static constexpr auto const MODE = Mode | mode::_CONST;
+  static constexpr auto const FIELDS = arity<T>();
+  static constexpr auto const MISSING = std::numeric_limits<uint32_t>::max();
+  static_assert(is_mode_enabled(Mode, mode::WITH_SCHEMA), "schema required");
+  static_assert(!endian_conversion_necessary<Mode>(), "cannot be const");
+  static_assert(to_tuple_works_v<T>, "root has to be a struct");
+
+  template <std::size_t I>
+  using field_t = decay_t<
+      std::tuple_element_t<I, decltype(to_tuple(std::declval<T&>()))>>;
+
+  versioned_view(uint8_t const* from, uint8_t const* to) {
+    verify(to - from > data_start(Mode), "invalid range");
+    auto const size = static_cast<uint64_t>(to - from);
+
+    auto schema = uint64_t{0U};
+    std::memcpy(&schema, from + schema_start(Mode), sizeof(schema));
+    schema = convert_endian<Mode>(schema);
+    verify(schema >= static_cast<uint64_t>(data_start(Mode)) &&
+               schema <= size && size - schema >= sizeof(schema_header),
+           "invalid schema offset");
+
+    auto header = schema_header{};
+    std::memcpy(&header, from + schema, sizeof(header));
+    stored_hash_ = convert_endian<Mode>(header.root_hash_);
+
+    if (stored_hash_ == type_hash<T>()) {
+      exact_ = deserialize<T, MODE>(const_cast<uint8_t*>(from),
+                                    const_cast<uint8_t*>(to));
+      root_ = reinterpret_cast<uint8_t const*>(exact_);
       return;
-    } else if (x < 0) {
-      if (a1 < std::numeric_limits<Type>::min() - x) {
-        throw std::overflow_error("addition overflow");
-      }
-    } else if (x > 0) {
-      if (a1 > std::numeric_limits<Type>::max() - x) {
-        throw std::overflow_error("addition overflow");
-      }
     }
-    a1 = a1 + x;
-  };
-  (add_if_ok(aN), ...);
-  return a1;
-}
 
-template <typename Arg, typename... Args>
-Arg checked_multiplication(Arg a1, Args... aN) {
-  using Type = decay_t<Arg>;
-  auto multiply_if_ok = [&](auto x) {
-    if (a1 != 0 && ((std::numeric_limits<Type>::max() / a1) < x)) {
-      throw std::overflow_error("addition overflow");
-    }
-    a1 = a1 * x;
-  };
-  (multiply_if_ok(aN), ...);
-  return a1;
-}
+    check_integrity<Mode>(from, to);
+    root_ = from + data_start(Mode);
+    auto const root_size = convert_endian<Mode>(header.root_size_);
+    auto const field_count = convert_endian<Mode>(header.field_count_);
+    verify(static_cast<uint64_t>(data_start(Mode)) + root_size <= schema,
+           "invalid root size");
+    verify((size - schema - sizeof(schema_header)) / sizeof(schema_field) >=
+               field_count,
+           "invalid schema size");
 
-template <mode Mode>
-struct deserialization_context {
-  static constexpr auto const MODE = Mode;
+    auto c = deserialization_context<MODE>{const_cast<uint8_t*>(from),
+                                           const_cast<uint8_t*>(to)};
+    map_fields(c, from, to, from + schema + sizeof(schema_header),
+               field_count, root_size, std::make_index_sequence<FIELDS>{});
+  }
 
-  deserialization_context(uint8_t* from, uint8_t* to)
-      : from_{reinterpret_cast<intptr_t>(from)},
-        to_{reinterpret_cast<intptr_t>(to)} {}
+  template <typename Container>
+  explicit versioned_view(Container const& c)
+      : versioned_view{reinterpret_cast<uint8_t const*>(&c[0]),
+                       reinterpret_cast<uint8_t const*>(&c[0] + c.size())} {}
 
-  template <typename T>
-  void convert_endian(T& el) const {
-    if (endian_conversion_necessary<MODE>()) {
-      el = ::cista::convert_endian<MODE>(el);
-    }
-  }
+  // The root if the buffer was written with this version of T.
+  T const* exact() const { return exact_; }
 
-  template <typename Ptr>
-  void deserialize_ptr(Ptr** ptr) const {
-    auto const offset =
-        reinterpret_cast<offset_t>(::cista::convert_endian<MODE>(*ptr));
-    static_assert(is_mode_disabled(MODE, mode::_CONST),
-                  "raw pointer deserialize is not const");
-    *ptr = offset == NULLPTR_OFFSET
-               ? nullptr
-               : reinterpret_cast<Ptr*>(
-                     checked_addition(reinterpret_cast<offset_t>(ptr), offset));
+  hash_t stored_hash() const { return stored_hash_; }
+
+  template <std::size_t I>
+  bool has() const {
+    return exact_ != nullptr || offsets_[I] != MISSING;
   }
 
-  template <typename T>
-  constexpr static size_t type_size() {
-    using Type = decay_t<T>;
-    if constexpr (std::is_same_v<Type, void>) {
-      return 0;
+  template <std::size_t I>
+  field_t<I> const& get() const {
+    if (exact_ != nullptr) {
+      return std::get<I>(to_tuple(*exact_));
+    } else if (offsets_[I] != MISSING) {
+      return *reinterpret_cast<field_t<I> const*>(root_ + offsets_[I]);
     } else {
-      return sizeof(Type);
+      return std::get<I>(to_tuple(defaults()));
     }
   }
 
-  template <typename T>
-  void check_ptr(offset_ptr<T> const& el,
-                 size_t const size = type_size<T>()) const {
-    checked_addition(el.offset_, reinterpret_cast<intptr_t>(&el));
-    check_ptr(el.get(), size);
-  }
+private:
+  static T const& defaults() {
+    static T const d{};
+    return d;
+  }
+
+  template <std::size_t... I>
+  void map_fields(deserialization_context<MODE> const& c, uint8_t const* from,
+                  uint8_t const* to, uint8_t const* fields,
+                  uint32_t const field_count, uint32_t const root_size,
+                  std::index_sequence<I...>) {
+    (map_field<I>(c, from, to, fields, field_count, root_size), ...);
+  }
+
+  template <std::size_t I>
+  void map_field(deserialization_context<MODE> const& c, uint8_t const* from,
+                 uint8_t const* to, uint8_t const* fields,
+                 uint32_t const field_count, uint32_t const root_size) {
+    using Field = field_t<I>;
+    offsets_[I] = MISSING;
+    for (auto i = 0U; i != field_count; ++i) {
+      auto f = schema_field{};
+      std::memcpy(&f, fields + i * sizeof(schema_field), sizeof(f));
+      if (convert_endian<Mode>(f.tag_) != field_tag<T>(I)) {
+        continue;
+      }
 
-  template <typename T>
-  void check_ptr(T* el, size_t const size = type_size<T>()) const {
-    if constexpr ((MODE & mode::UNCHECKED) == mode::UNCHECKED) {
+      auto const offset = convert_endian<Mode>(f.offset_);
+      verify(convert_endian<Mode>(f.type_hash_) == type_hash<Field>() &&
+                 convert_endian<Mode>(f.size_) == sizeof(Field),
+             "field type changed");
+      verify(offset % alignof(Field) == 0U && root_size >= sizeof(Field) &&
+                 offset <= root_size - sizeof(Field),
+             "invalid field offset");
+
+      auto const el = reinterpret_cast<Field*>(const_cast<uint8_t*>(root_) +
+                                               offset);
+      deserialize(c, el);
+      if constexpr (is_mode_enabled(Mode, mode::DEEP_CHECK)) {
+        auto c1 = deep_check_context<MODE | mode::_PHASE_II>{
+            const_cast<uint8_t*>(from), const_cast<uint8_t*>(to)};
+        deserialize(c1, el);
+      } else {
+        CISTA_UNUSED_PARAM(from)
+        CISTA_UNUSED_PARAM(to)
+      }
+      offsets_[I] = offset;
       return;
     }
+  }
 
-    if (el == nullptr || to_ == 0U) {
-      return;
-    }
+  uint8_t const* root_{nullptr};
+  T const* exact_{nullptr};
+  hash_t stored_hash_{0U};
+  std::array<uint32_t, FIELDS> offsets_{};
+};
 
-    auto const pos = reinterpret_cast<intptr_t>(el);
-    verify(pos >= from_, "underflow");
-    verify(checked_addition(pos, static_cast<intptr_t>(size)) <= to_,
-           "overflow");
-    verify(size < static_cast<size_t>(std::numeric_limits<intptr_t>::max()),
-           "size out of bounds");
+// Holds a memory mapped dataset that can be replaced while readers use it.
+//
+// reload() maps the new file copy-on-write (deserialize may fix up
+// pointers in place, the file stays untouched), validates it with
+// deserialize<T, Mode>() and publishes it. Everything expensive happens
+// on the reloading thread; a broken file throws and leaves the current
+// snapshot in place.
+//
+// Readers never lock: read() returns a guard that pins the current
+// snapshot. Pins are counted per generation (the two most recent ones)
+// in striped counters, so concurrent readers do not share a cache line.
+// After publishing, reload() waits until the previous generation has no
+// readers left and unmaps it. Reloads are serialized.
+//
+// The dataset must outlive all guards returned by read().
+template <typename T, mode const Mode = mode::NONE>
+struct dataset {
+  static constexpr auto const STRIPES = 16U;
 
-    if constexpr (!std::is_same_v<T, void>) {
-      verify((pos &
-              static_cast<intptr_t>(std::alignment_of<decay_t<T>>() - 1)) == 0U,
-             "ptr alignment");
+  struct snapshot {
+    mmap mapping_;
+    T const* root_;
+    uint64_t generation_;
+  };
+
+  struct guard {
+    guard(dataset const* d, snapshot const* s, unsigned const counter)
+        : d_{d}, s_{s}, counter_{counter} {}
+    guard(guard const&) = delete;
+    guard& operator=(guard const&) = delete;
+    guard(guard&& o) noexcept
+        : d_{std::exchange(o.d_, nullptr)}, s_{o.s_}, counter_{o.counter_} {}
+    guard& operator=(guard&&) = delete;
+    ~guard() {
+      if (d_ != nullptr) {
+        d_->unpin(counter_);
+      }
     }
-  }
 
-  static void check_bool(bool const& b) {
-    auto const val = *reinterpret_cast<uint8_t const*>(&b);
-    verify(val <= 1U, "valid bool");
+    explicit operator bool() const { return s_ != nullptr; }
+    T const* get() const { return s_ == nullptr ? nullptr : s_->root_; }
+    T const* operator->() const { return get(); }
+    T const& operator*() const { return *get(); }
+    uint64_t generation() const { return s_ == nullptr ? 0U : s_->generation_; }
+
+  private:
+    dataset const* d_;
+    snapshot const* s_;
+    unsigned counter_;
+  };
+
+  dataset() = default;
+
+  explicit dataset(char const* path, mmap::hint const h = mmap::hint::NONE) {
+    reload(path, h);
   }
 
-  void require(bool condition, char const* msg) const {
-    if constexpr ((MODE & mode::UNCHECKED) == mode::UNCHECKED) {
-      return;
-    }
+  dataset(dataset const&) = delete;
+  dataset& operator=(dataset const&) = delete;
 
-    if (!condition) {
-      throw std::runtime_error(msg);
+  guard read() const {
+    auto const stripe = stripe_of_this_thread();
+    while (true) {
+      auto const gen = generation_.load();
+      auto const counter = static_cast<unsigned>(gen & 1U) * STRIPES + stripe;
+      readers_[counter].n_.fetch_add(1U);
+      // Recheck: reload() might have moved on before the pin was visible.
+      if (generation_.load() == gen) {
+        return guard{this, slots_[gen & 1U].get(), counter};
+      }
+      readers_[counter].n_.fetch_sub(1U);
     }
   }
 
-  intptr_t from_, to_;
-};
+  void reload(char const* path, mmap::hint const h = mmap::hint::NONE) {
+    auto const lock = std::lock_guard{reload_mutex_};
+    auto const gen = generation_.load();
+    auto const next = (gen + 1U) & 1U;
 
-template <mode Mode>
-struct deep_check_context : public deserialization_context<Mode> {
-  using parent = deserialization_context<Mode>;
+    auto m = mmap{path, mmap::protection::COPY_ON_WRITE, h};
+    auto const root = deserialize<T, Mode>(m);
+    auto s = std::make_unique<snapshot>(snapshot{std::move(m), root, gen + 1U});
 
-  using parent::parent;
+    // The previous reload emptied this slot once its readers were gone.
+    slots_[next] = std::move(s);
+    generation_.store(gen + 1U);
 
-  template <typename T>
-  bool add_checked(T const* v) const {
-    return checked_.emplace(type_hash<T>(), static_cast<void const*>(v)).second;
+    wait_for_readers(gen & 1U);
+    slots_[gen & 1U].reset();
   }
 
-  std::set<std::pair<hash_t, void const*>> mutable checked_;
-};
+  uint64_t generation() const { return generation_.load(); }
 
-template <typename T, mode const Mode = mode::NONE>
-void check(uint8_t const* from, uint8_t const* to) {
-  verify(to - from > data_start(Mode), "invalid range");
+private:
+  struct alignas(64) counter {
+    std::atomic<size_t> n_{0U};
+  };
 
-  if constexpr ((Mode & mode::WITH_VERSION) == mode::WITH_VERSION) {
-    verify(convert_endian<Mode>(*reinterpret_cast<hash_t const*>(from)) ==
-               type_hash<T>(),
-           "invalid version");
+  void unpin(unsigned const counter) const {
+    readers_[counter].n_.fetch_sub(1U, std::memory_order_release);
   }
 
-  if constexpr ((Mode & mode::WITH_INTEGRITY) == mode::WITH_INTEGRITY) {
-    verify(convert_endian<Mode>(*reinterpret_cast<uint64_t const*>(
-               from + integrity_start(Mode))) ==
-               hash(std::string_view{
-                   reinterpret_cast<char const*>(from + data_start(Mode)),
-                   static_cast<size_t>(to - from - data_start(Mode))}),
-           "invalid checksum");
+  void wait_for_readers(uint64_t const slot) const {
+    for (auto i = 0U; i != STRIPES; ++i) {
+      while (readers_[slot * STRIPES + i].n_.load() != 0U) {
+        std::this_thread::yield();
+      }
+    }
   }
-}
 
-// --- GENERIC ---
-template <typename Ctx, typename T>
-void convert_endian_and_ptr(Ctx const& c, T* el) {
-  using Type = decay_t<T>;
-  if constexpr (std::is_pointer_v<Type>) {
-    c.deserialize_ptr(el);
-  } else if constexpr (std::numeric_limits<Type>::is_integer ||
-                       std::is_floating_point_v<Type>) {
-    c.convert_endian(*el);
-  } else {
-    CISTA_UNUSED_PARAM(c)
-    CISTA_UNUSED_PARAM(el)
+  static unsigned stripe_of_this_thread() {
+    thread_local auto const stripe = static_cast<unsigned>(
+        std::hash<std::thread::id>{}(std::this_thread::get_id()) % STRIPES);
+    return stripe;
   }
-}
 
-template <typename Ctx, typename T>
-void check_state(Ctx const& c, T* el) {
-  using Type = decay_t<T>;
-  if constexpr (std::is_pointer_v<Type> && !std::is_same_v<Type, void*>) {
-    c.check_ptr(*el);
-  } else {
-    CISTA_UNUSED_PARAM(c)
-    CISTA_UNUSED_PARAM(el)
+  std::atomic<uint64_t> generation_{0U};
+  std::unique_ptr<snapshot> slots_[2];
+  counter mutable readers_[2U * STRIPES];
+  std::mutex reload_mutex_;
+};
+
+// =============================================================================
+// APPEND
+// -----------------------------------------------------------------------------
+// rebase(el, delta) fixes the offset pointers stored in *el after its bytes
+// were moved by a memcpy (delta = old address - new address). The memory
+// these pointers refer to stays where it is.
+template <typename T>
+void rebase(offset_ptr<T>* el, offset_t const delta) {
+  if (el->offset_ != NULLPTR_OFFSET) {
+    el->offset_ += delta;
   }
 }
 
-template <typename Ctx, typename T, typename Fn>
-void recurse(Ctx& c, T* el, Fn&& fn) {
-  using Type = decay_t<T>;
-  if constexpr (is_indexed_v<Type>) {
-    fn(static_cast<typename T::value_type*>(el));
-  } else if constexpr (std::is_aggregate_v<Type> && !std::is_union_v<Type>) {
-    for_each_ptr_field(*el, [&](auto& f) { fn(f); });
-  } else if constexpr (is_mode_enabled(Ctx::MODE, mode::_PHASE_II) &&
-                       std::is_pointer_v<Type>) {
-    if (*el != nullptr && c.add_checked(el)) {
-      fn(*el);
-    }
-  } else {
-    CISTA_UNUSED_PARAM(c)
-    CISTA_UNUSED_PARAM(el)
-    CISTA_UNUSED_PARAM(fn)
-  }
+template <typename T, typename Ptr, bool Indexed, typename TemplateSizeType>
+void rebase(basic_vector<T, Ptr, Indexed, TemplateSizeType>* el,
+            offset_t const delta) {
+  rebase(&el->el_, delta);
 }
 
-template <typename Ctx, typename T>
-void deserialize(Ctx const& c, T* el) {
-  c.check_ptr(el);
-  if constexpr (is_mode_disabled(Ctx::MODE, mode::_PHASE_II)) {
-    convert_endian_and_ptr(c, el);
-  }
-  if constexpr (is_mode_disabled(Ctx::MODE, mode::UNCHECKED)) {
-    check_state(c, el);
+template <typename Ptr>
+void rebase(generic_string<Ptr>* el, offset_t const delta) {
+  if (*reinterpret_cast<uint8_t const*>(&el->s_.is_short_) == 0U) {
+    rebase(&el->h_.ptr_, delta);
   }
-  recurse(c, el, [&](auto* entry) { deserialize(c, entry); });
 }
 
-// --- OFFSET_PTR<T> ---
-template <typename Ctx, typename T>
-void convert_endian_and_ptr(Ctx const& c, offset_ptr<T>* el) {
-  c.convert_endian(el->offset_);
+template <typename Ptr>
+void rebase(basic_string<Ptr>* el, offset_t const delta) {
+  rebase(static_cast<generic_string<Ptr>*>(el), delta);
 }
 
-template <typename Ctx, typename T>
-void check_state(Ctx const& c, offset_ptr<T>* el) {
-  c.check_ptr(*el);
+template <typename Ptr>
+void rebase(basic_string_view<Ptr>* el, offset_t const delta) {
+  rebase(static_cast<generic_string<Ptr>*>(el), delta);
 }
 
-template <typename Ctx, typename T, typename Fn>
-void recurse(Ctx& c, offset_ptr<T>* el, Fn&& fn) {
-  if constexpr (is_mode_enabled(Ctx::MODE, mode::_PHASE_II)) {
-    if (*el != nullptr && c.add_checked(el)) {
-      fn(static_cast<T*>(*el));
-    }
-  } else {
-    CISTA_UNUSED_PARAM(c)
-    CISTA_UNUSED_PARAM(el)
-    CISTA_UNUSED_PARAM(fn)
-  }
+template <typename Ptr>
+void rebase(basic_hashed_string<Ptr>* el, offset_t const delta) {
+  rebase(&el->str_, delta);
 }
 
-// --- VECTOR<T> ---
-template <typename Ctx, typename T, typename Ptr, bool Indexed,
-          typename TemplateSizeType>
-void convert_endian_and_ptr(
-    Ctx const& c, basic_vector<T, Ptr, Indexed, TemplateSizeType>* el) {
-  deserialize(c, &el->el_);
-  c.convert_endian(el->allocated_size_);
-  c.convert_endian(el->used_size_);
+template <typename T, typename Ptr>
+void rebase(basic_unique_ptr<T, Ptr>* el, offset_t const delta) {
+  rebase(&el->el_, delta);
 }
 
-template <typename Ctx, typename T, typename Ptr, bool Indexed,
-          typename TemplateSizeType>
-void check_state(Ctx const& c,
-                 basic_vector<T, Ptr, Indexed, TemplateSizeType>* el) {
-  c.check_ptr(el->el_,
-              checked_multiplication(static_cast<size_t>(el->allocated_size_),
-                                     sizeof(T)));
-  c.check_bool(el->self_allocated_);
-  c.require(!el->self_allocated_, "vec self-allocated");
-  c.require(el->allocated_size_ == el->used_size_, "vec size mismatch");
-  c.require((el->size() == 0) == (el->el_ == nullptr), "vec size=0 <=> ptr=0");
+template <typename T, template <typename> typename Ptr, typename GetKey,
+          typename GetValue, typename Hash, typename Eq>
+void rebase(hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>* el,
+            offset_t const delta) {
+  rebase(&el->entries_, delta);
+  rebase(&el->ctrl_, delta);
 }
 
-template <typename Ctx, typename T, typename Ptr, bool Indexed,
-          typename TemplateSizeType, typename Fn>
-void recurse(Ctx&, basic_vector<T, Ptr, Indexed, TemplateSizeType>* el,
-             Fn&& fn) {
+template <typename T, size_t Size>
+void rebase(array<T, Size>* el, offset_t const delta) {
   for (auto& m : *el) {
-    fn(&m);
+    rebase(&m, delta);
   }
 }
 
-// --- STRING ---
-template <typename Ctx, typename Ptr>
-void convert_endian_and_ptr(Ctx const& c, generic_string<Ptr>* el) {
-  if (*reinterpret_cast<uint8_t const*>(&el->s_.is_short_) == 0U) {
-    deserialize(c, &el->h_.ptr_);
-    c.convert_endian(el->h_.size_);
+template <typename T>
+void rebase(T* el, offset_t const delta) {
+  using Type = decay_t<T>;
+  if constexpr (is_indexed_v<Type>) {
+    rebase(static_cast<typename Type::value_type*>(el), delta);
+  } else if constexpr (std::is_aggregate_v<Type> && !std::is_union_v<Type>) {
+    for_each_ptr_field(*el, [&](auto& m) { rebase(m, delta); });
+  } else {
+    CISTA_UNUSED_PARAM(el)
+    CISTA_UNUSED_PARAM(delta)
   }
 }
 
-template <typename Ctx, typename Ptr>
-void check_state(Ctx const& c, generic_string<Ptr>* el) {
-  c.check_bool(el->s_.is_short_);
-  if (!el->is_short()) {
-    c.check_ptr(el->h_.ptr_, el->h_.size_);
-    c.check_bool(el->h_.self_allocated_);
-    c.require(!el->h_.self_allocated_, "string self-allocated");
-    c.require((el->h_.size_ == 0) == (el->h_.ptr_ == nullptr),
-              "str size=0 <=> ptr=0");
+// Appends to a file written by serialize<Mode>() without rewriting it.
+// New objects are written at the end of the file and the offset pointers
+// leading to them are updated in place, so an update costs about as much as
+// the data it adds. The file is validated (according to Mode) on open.
+//
+// Containers passed to push_back / insert have to live in this file, e.g.
+// be reachable from root(). Growing a container moves its elements to the
+// end of the file; the old copy stays in place as dead space and pointers
+// into it (cista::ptr to elements of an indexed_vector) are not updated.
+// compact() reserializes the file without dead space.
+//
+// References into the file are invalidated by every modification (the
+// mapping may move when the file grows). Values that are appended may point
+// to objects in the file that were obtained before the call, or live in the
+// file themselves if they are copyable (they are copied out first).
+template <typename T, mode const Mode = mode::NONE>
+struct appender {
+  static_assert(is_mode_disabled(Mode, mode::SERIALIZE_BIG_ENDIAN),
+                "in-place updates need native byte order");
+  static_assert(is_mode_disabled(Mode, mode::_CONST));
+
+  explicit appender(char const* path)
+      : buf_{mmap{path, mmap::protection::MODIFY}} {
+    buf_.curr_offset_ = static_cast<offset_t>(buf_.size());
+    root_ = static_cast<offset_t>(
+        reinterpret_cast<uint8_t*>(deserialize<T, Mode>(buf_.buf_)) -
+        buf_.base());
+  }
+
+  // Errors are swallowed here, call commit() to see them.
+  ~appender() {
+    try {
+      commit();
+    } catch (...) {
+    }
   }
-}
 
-template <typename Ctx, typename Ptr, typename Fn>
-void recurse(Ctx&, generic_string<Ptr>*, Fn&&) {}
+  appender(appender const&) = delete;
+  appender& operator=(appender const&) = delete;
 
-template <typename Ctx, typename Ptr>
-void convert_endian_and_ptr(Ctx const& c, basic_string<Ptr>* el) {
-  convert_endian_and_ptr(c, static_cast<generic_string<Ptr>*>(el));
-}
+  T& root() { return *at<T>(root_); }
 
-template <typename Ctx, typename Ptr>
-void check_state(Ctx const& c, basic_string<Ptr>* el) {
-  check_state(c, static_cast<generic_string<Ptr>*>(el));
-}
+  template <typename Vec>
+  void push_back(Vec& v, typename Vec::value_type const& el) {
+    if constexpr (std::is_copy_constructible_v<typename Vec::value_type>) {
+      if (in_file(&el)) {
+        auto const copy = typename Vec::value_type{el};
+        return push_back(v, copy);
+      }
+    } else {
+      verify(!in_file(&el), "appender: element in the file is not copyable");
+    }
 
-template <typename Ctx, typename Ptr, typename Fn>
-void recurse(Ctx&, basic_string<Ptr>*, Fn&&) {}
+    auto const base = buf_.base();
+    auto const size = buf_.size();
+    auto const pos = offset_of(&v);
 
-template <typename Ctx, typename Ptr>
-void convert_endian_and_ptr(Ctx const& c, basic_string_view<Ptr>* el) {
-  convert_endian_and_ptr(c, static_cast<generic_string<Ptr>*>(el));
-}
+    if (v.used_size_ == v.allocated_size_) {
+      relocate<Vec>(pos, std::max(std::size_t{1U},
+                                  2U * static_cast<std::size_t>(v.used_size_)));
+    }
 
-template <typename Ctx, typename Ptr>
-void check_state(Ctx const& c, basic_string_view<Ptr>* el) {
-  check_state(c, static_cast<generic_string<Ptr>*>(el));
-}
+    auto& vec = *at<Vec>(pos);
+    place(el, offset_of(vec.el_ + vec.used_size_), base, size);
+    ++at<Vec>(pos)->used_size_;
+  }
 
-template <typename Ctx, typename Ptr, typename Fn>
-void recurse(Ctx&, basic_string_view<Ptr>*, Fn&&) {}
+  // Moves the elements once, so that the next pushes keep them in place.
+  template <typename Vec>
+  void reserve(Vec& v, std::size_t const new_capacity) {
+    if (new_capacity > v.allocated_size_) {
+      relocate<Vec>(offset_of(&v), new_capacity);
+    }
+  }
 
-// --- UNIQUE_PTR<T> ---
-template <typename Ctx, typename T, typename Ptr>
-void convert_endian_and_ptr(Ctx const& c, basic_unique_ptr<T, Ptr>* el) {
-  deserialize(c, &el->el_);
-}
+  // Returns false (and keeps the old entry) if the key is already present.
+  template <typename Map>
+  bool insert(Map& m, typename Map::entry_t const& el) {
+    if constexpr (std::is_copy_constructible_v<typename Map::entry_t>) {
+      if (in_file(&el)) {
+        auto const copy = typename Map::entry_t{el};
+        return insert(m, copy);
+      }
+    } else {
+      verify(!in_file(&el), "appender: element in the file is not copyable");
+    }
 
-template <typename Ctx, typename T, typename Ptr>
-void check_state(Ctx const& c, basic_unique_ptr<T, Ptr>* el) {
-  c.check_bool(el->self_allocated_);
-  c.require(!el->self_allocated_, "unique_ptr self-allocated");
-}
+    auto const base = buf_.base();
+    auto const size = buf_.size();
+    auto const pos = offset_of(&m);
 
-template <typename Ctx, typename T, typename Ptr, typename Fn>
-void recurse(Ctx&, basic_unique_ptr<T, Ptr>* el, Fn&& fn) {
-  if (el->el_ != nullptr) {
-    fn(static_cast<T*>(el->el_));
+    auto const& key = typename Map::get_key_t{}(el);
+    if (m.find(key) != m.end()) {
+      return false;
+    }
+    if (m.growth_left_ == 0U) {
+      grow<Map>(pos);
+    }
+
+    // The entry is written before its ctrl byte marks the slot as used,
+    // an interrupted insert leaves no half written entry behind.
+    auto const hash = at<Map>(pos)->compute_hash(key);
+    auto const i = at<Map>(pos)->find_first_non_full(hash).offset_;
+    place(el, offset_of(at<Map>(pos)->entries_ + i), base, size);
+    std::atomic_thread_fence(std::memory_order_release);
+    auto& map = *at<Map>(pos);
+    map.growth_left_ -= Map::is_empty(map.ctrl_[i]) ? 1U : 0U;
+    map.set_ctrl(i, Map::h2(hash));
+    ++map.size_;
+    return true;
   }
-}
 
-// --- HASH_STORAGE<T> ---
-template <typename Ctx, typename T, template <typename> typename Ptr,
-          typename GetKey, typename GetValue, typename Hash, typename Eq>
-void convert_endian_and_ptr(
-    Ctx const& c,
-    hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>* el) {
-  deserialize(c, &el->entries_);
-  deserialize(c, &el->ctrl_);
-  c.convert_endian(el->size_);
-  c.convert_endian(el->capacity_);
-  c.convert_endian(el->growth_left_);
-}
+  // Writes the checksum (WITH_INTEGRITY) and flushes the mapping.
+  void commit() {
+    if constexpr (is_mode_enabled(Mode, mode::WITH_INTEGRITY)) {
+      auto const start = integrity_start(Mode);
+      auto const data = start + static_cast<offset_t>(sizeof(hash_t));
+      auto const pos = static_cast<std::size_t>(start);
+      if constexpr (is_mode_enabled(Mode, mode::FAST_INTEGRITY)) {
+        buf_.write(pos, buf_.chunked_checksum(data));
+      } else {
+        buf_.write(pos, buf_.checksum(data));
+      }
+    }
+    buf_.buf_.sync();
+  }
 
-template <typename Ctx, typename T, template <typename> typename Ptr,
-          typename GetKey, typename GetValue, typename Hash, typename Eq>
-void check_state(
-    Ctx const& c,
-    hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>* el) {
-  using Type = decay_t<remove_pointer_t<decltype(el)>>;
-  c.require(el->ctrl_ != nullptr, "hash storage: ctrl must be set");
-  c.check_ptr(
-      el->entries_,
-      checked_addition(
-          checked_multiplication(
-              el->capacity_, static_cast<typename Type::size_type>(sizeof(T))),
-          checked_addition(el->capacity_, 1U, Type::WIDTH)));
-  c.check_ptr(el->ctrl_, checked_addition(el->capacity_, 1U, Type::WIDTH));
-  c.require(el->entries_ == nullptr ||
-                reinterpret_cast<uint8_t const*>(ptr_cast(el->ctrl_)) ==
-                    reinterpret_cast<uint8_t const*>(ptr_cast(el->entries_)) +
-                        checked_multiplication(
-                            static_cast<size_t>(el->capacity_), sizeof(T)),
-            "hash storage: entries!=null -> ctrl = entries+capacity");
-  c.require(
-      (el->entries_ == nullptr) == (el->capacity_ == 0U && el->size_ == 0U),
-      "hash storage: entries=null <=> size=capacity=0");
+  // Reserializes root() in place, dropping the dead space.
+  void compact() {
+    auto const compacted = serialize<Mode>(root());
+    buf_.buf_.resize(compacted.size());
+    std::memcpy(buf_.base(), compacted.data(), compacted.size());
+    buf_.curr_offset_ = static_cast<offset_t>(compacted.size());
+    root_ = static_cast<offset_t>(
+        reinterpret_cast<uint8_t*>(deserialize<T, Mode>(buf_.buf_)) -
+        buf_.base());
+    dead_bytes_ = 0U;
+  }
 
-  c.check_bool(el->self_allocated_);
-  c.require(!el->self_allocated_, "hash storage: self-allocated");
+  // Bytes left unreachable by appends since the file was opened.
+  std::size_t dead_bytes() const { return dead_bytes_; }
+  std::size_t size() const { return buf_.size(); }
 
-  c.require(el->ctrl_[el->capacity_] == Type::END,
-            "hash storage: end ctrl byte");
-  c.require(std::all_of(ptr_cast(el->ctrl_),
-                        ptr_cast(el->ctrl_) + el->capacity_ + 1U + Type::WIDTH,
-                        [](typename Type::ctrl_t const ctrl) {
-                          return Type::is_empty(ctrl) ||
-                                 Type::is_deleted(ctrl) ||
-                                 Type::is_full(ctrl) ||
-                                 ctrl == Type::ctrl_t::END;
-                        }),
-            "hash storage: ctrl bytes must be empty or deleted or full");
+protected:
+  struct context : public serialization_context<buf<mmap>, Mode> {
+    using base_t = serialization_context<buf<mmap>, Mode>;
 
-  using st_t = typename Type::size_type;
-  auto [empty, full, deleted, growth] = std::accumulate(
-      ptr_cast(el->ctrl_), ptr_cast(el->ctrl_) + el->capacity_,
-      std::tuple{st_t{0U}, st_t{0U}, st_t{0U}, st_t{0}},
-      [&](std::tuple<st_t, st_t, st_t, st_t> const acc,
-          typename Type::ctrl_t const& ctrl) {
-        auto const [empty, full, deleted, growth_left] = acc;
-        return std::tuple{
-            Type::is_empty(ctrl) ? empty + 1 : empty,
-            Type::is_full(ctrl) ? full + 1 : full,
-            Type::is_deleted(ctrl) ? deleted + 1 : deleted,
-            (Type::is_empty(ctrl) &&
-                     el->was_never_full(static_cast<st_t>(&ctrl - el->ctrl_))
-                 ? growth_left + 1
-                 : growth_left)};
-      });
+    context(buf<mmap>& t, uint8_t const* base, std::size_t const size)
+        : base_t{t}, base_{base}, size_{size} {}
 
-  c.require(el->size_ == full, "hash storage: size");
-  c.require(empty + full + deleted == el->capacity_,
-            "hash storage: empty + full + deleted = capacity");
-  c.require(std::min(Type::capacity_to_growth(el->capacity_) - el->size_,
-                     growth) <= el->growth_left_,
-            "hash storage: growth left");
-}
+    template <typename P>
+    bool resolve_pointer(offset_ptr<P> const& ptr, offset_t const pos,
+                         bool add_pending = true) {
+      return resolve_pointer(ptr.get(), pos, add_pending);
+    }
 
-template <typename Ctx, typename T, template <typename> typename Ptr,
-          typename GetKey, typename GetValue, typename Hash, typename Eq,
-          typename Fn>
-void recurse(Ctx&,
-             hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>* el,
-             Fn&& fn) {
-  for (auto& m : *el) {
-    fn(&m);
+    // Pointers into the file (as it was mapped before the call) are kept.
+    template <typename P>
+    bool resolve_pointer(P ptr, offset_t const pos, bool add_pending = true) {
+      auto const p = reinterpret_cast<uint8_t const*>(ptr_cast(ptr));
+      if (p != nullptr && p >= base_ && p < base_ + size_) {
+        this->write(pos, static_cast<offset_t>(p - base_) - pos);
+        return true;
+      }
+      return base_t::resolve_pointer(ptr, pos, add_pending);
+    }
+
+    uint8_t const* base_;
+    std::size_t size_;
+  };
+
+  template <typename X>
+  X* at(offset_t const pos) {
+    return reinterpret_cast<X*>(buf_.addr(pos));
   }
-}
 
-// --- ARRAY<T> ---
-template <typename Ctx, typename T, size_t Size, typename Fn>
-void recurse(Ctx&, array<T, Size>* el, Fn&& fn) {
-  for (auto& m : *el) {
-    fn(&m);
+  bool in_file(void const* ptr) {
+    auto const p = static_cast<uint8_t const*>(ptr);
+    return p >= buf_.base() && p < buf_.base() + buf_.size();
   }
-}
 
-template <typename T, mode const Mode = mode::NONE, typename CharT>
-T* deserialize(CharT* from, CharT* to = nullptr) {
-  static_assert(sizeof(decltype(from[0])) == 1U, "byte container");
-  if constexpr (is_mode_enabled(Mode, mode::CAST)) {
-    CISTA_UNUSED_PARAM(to)
-    return reinterpret_cast<T*>(from);
-  } else {
-    check<T, Mode>(from, to);
-    auto const el = reinterpret_cast<T*>(from + data_start(Mode));
+  template <typename X>
+  offset_t offset_of(X const* ptr) {
+    return static_cast<offset_t>(reinterpret_cast<uint8_t const*>(ptr) -
+                                 buf_.base());
+  }
 
-    deserialization_context<Mode> c{from, to};
-    deserialize(c, el);
+  // Zeroed, aligned space at the end of the file.
+  offset_t alloc(std::size_t const size, std::size_t const alignment) {
+    auto const start = static_cast<offset_t>(
+        (buf_.size() + alignment - 1U) & ~(alignment - 1U));
+    auto const end = static_cast<std::size_t>(start) + size;
+    auto const old_size = buf_.size();
+    buf_.buf_.resize(end);
+    std::memset(buf_.addr(static_cast<offset_t>(old_size)), 0,
+                end - old_size);
+    buf_.curr_offset_ = static_cast<offset_t>(end);
+    return start;
+  }
 
-    if constexpr ((Mode & mode::DEEP_CHECK) == mode::DEEP_CHECK) {
-      deep_check_context<Mode | mode::_PHASE_II> c1{from, to};
-      deserialize(c1, el);
+  // Copies el to pos and serializes what it owns behind the end of the file.
+  template <typename Value>
+  void place(Value const& el, offset_t const pos, uint8_t const* base,
+             std::size_t const size) {
+    auto c = context{buf_, base, size};
+    buf_.write(static_cast<std::size_t>(pos), el);
+    serialize(c, &el, pos);
+    for (auto const& p : c.resolve_pending()) {
+      printf("warning: dangling pointer at %" PRI_O " (origin=%p)\n", p.pos_,
+             p.origin_ptr_);
     }
+  }
 
-    return el;
+  template <typename Vec>
+  void relocate(offset_t const pos, std::size_t const new_capacity) {
+    using Value = typename Vec::value_type;
+    auto const start =
+        alloc(new_capacity * sizeof(Value), std::alignment_of_v<Value>);
+    auto& vec = *at<Vec>(pos);
+    auto const used = static_cast<std::size_t>(vec.used_size_);
+    auto const old =
+        vec.el_ == nullptr ? offset_t{0} : offset_of(ptr_cast(vec.el_));
+    for (auto i = std::size_t{0U}; i != used; ++i) {
+      auto const to = start + static_cast<offset_t>(i * sizeof(Value));
+      auto const from = old + static_cast<offset_t>(i * sizeof(Value));
+      std::memcpy(buf_.addr(to), buf_.addr(from), sizeof(Value));
+      rebase(at<Value>(to), from - to);
+    }
+    vec.el_ = at<Value>(start);
+    vec.allocated_size_ =
+        static_cast<decltype(vec.allocated_size_)>(new_capacity);
+    dead_bytes_ += used * sizeof(Value);
+  }
+
+  // Same as hash_storage::resize(), with the new table in the file.
+  template <typename Map>
+  void grow(offset_t const pos) {
+    using Entry = typename Map::entry_t;
+    using ctrl_t = typename Map::ctrl_t;
+
+    auto const old_capacity = at<Map>(pos)->capacity_;
+    auto const new_capacity =
+        old_capacity == 0U ? typename Map::size_type{1U} : old_capacity * 2U + 1U;
+    auto const start =
+        alloc(new_capacity * sizeof(Entry) +
+                  (new_capacity + 1U + Map::WIDTH) * sizeof(ctrl_t),
+              std::alignment_of_v<Entry>);
+
+    auto& map = *at<Map>(pos);
+    auto const old_entries = map.entries_ == nullptr
+                                 ? offset_t{0}
+                                 : offset_of(ptr_cast(map.entries_));
+    auto const old_ctrl = ptr_cast(map.ctrl_);
+    map.entries_ = at<Entry>(start);
+    map.ctrl_ = at<ctrl_t>(start + static_cast<offset_t>(new_capacity *
+                                                           sizeof(Entry)));
+    map.capacity_ = new_capacity;
+    map.reset_ctrl();
+
+    for (auto i = typename Map::size_type{0U}; i != old_capacity; ++i) {
+      if (Map::is_full(old_ctrl[i])) {
+        auto const from = old_entries + static_cast<offset_t>(i * sizeof(Entry));
+        auto const hash =
+            map.compute_hash(typename Map::get_key_t{}(*at<Entry>(from)));
+        auto const target = map.find_first_non_full(hash).offset_;
+        map.set_ctrl(target, Map::h2(hash));
+        auto const to = offset_of(map.entries_ + target);
+        std::memcpy(buf_.addr(to), buf_.addr(from), sizeof(Entry));
+        rebase(at<Entry>(to), from - to);
+      }
+    }
+    map.reset_growth_left();
+
+    if (old_capacity != 0U) {
+      dead_bytes_ += old_capacity * sizeof(Entry) +
+                     (old_capacity + 1U + Map::WIDTH) * sizeof(ctrl_t);
+    }
   }
-}
 
-template <typename T, mode const Mode = mode::NONE>
-T const* deserialize(std::string_view c) {
-  static_assert(!endian_conversion_necessary<Mode>(), "cannot be const");
-  return deserialize<T const, Mode | mode::_CONST>(
-      reinterpret_cast<uint8_t const*>(&c[0]),
-      reinterpret_cast<uint8_t const*>(&c[0] + c.size()));
-}
+  buf<mmap> buf_;
+  offset_t root_{0};
+  std::size_t dead_bytes_{0U};
+};
 
-template <typename T, mode const Mode = mode::NONE, typename Container>
-T const* deserialize(Container const& c) {
-  static_assert(sizeof(decay_t<decltype(c[0])>) == 1U, "byte size entries");
-  static_assert(!endian_conversion_necessary<Mode>(), "cannot be const");
-  return deserialize<T const, Mode | mode::_CONST>(
-      reinterpret_cast<uint8_t const*>(&c[0]),
-      reinterpret_cast<uint8_t const*>(&c[0] + c.size()));
-}
+template <typename Map>
+struct persistent_map_root {
+  array<Map, 2U> maps_;
+  uint32_t active_{0U};
+  uint32_t dirty_{0U};
+};
 
-template <typename T, mode const Mode = mode::NONE, typename Container>
-T* deserialize(Container& c) {
-  static_assert(sizeof(decay_t<decltype(c[0])>) == 1U, "byte size entries");
-  return deserialize<T, Mode>(reinterpret_cast<uint8_t*>(&c[0]),
-                              reinterpret_cast<uint8_t*>(&c[0] + c.size()));
-}
+// A hash map that lives in a file and is modified in place: opening maps
+// the file, emplace() writes the entry (and what it owns) into the
+// mapping. Built on appender, so keys and values can be any offset type.
+//
+// Crash tolerance: an entry is written before its ctrl byte publishes it
+// and stays intact when erase() clears the ctrl byte.
+// Growing builds the new table in free space of the file and then switches
+// between two map headers with a single store. While the map is open the
+// file is marked dirty; opening a dirty file recounts the size from the
+// ctrl bytes and restores the unused header before validating it. This
+// covers a process that dies at any point; after a system crash
+// everything written before the last sync() is there.
+//
+// With mode::CAST the file is not validated on open (constant time, only
+// for trusted files). Integrity checksums would be invalid after every
+// crash and are not supported. compact() rewrites the file into a
+// temporary file and renames it over the original.
+template <typename Key, typename Value, mode const Mode = mode::NONE>
+struct persistent_hash_map {
+  static_assert(is_mode_disabled(Mode, mode::WITH_INTEGRITY),
+                "no checksum for in-place updates");
+
+  using map_t = offset::hash_map<Key, Value>;
+  using root_t = persistent_map_root<map_t>;
+  using entry_t = typename map_t::entry_t;
+
+  explicit persistent_hash_map(char const* path)
+      : path_{path}, file_{std::make_unique<file>(prepare(path))} {
+    file_->root().dirty_ = 1U;
+  }
+
+  // A failed flush leaves the file marked dirty, it is repaired on the
+  // next open. Call sync() to see the error.
+  ~persistent_hash_map() {
+    if (file_ != nullptr) {
+      try {
+        file_->commit();
+        file_->root().dirty_ = 0U;
+      } catch (...) {
+      }
+    }
+  }
 
-template <typename T, mode const Mode = mode::NONE>
-T* unchecked_deserialize(uint8_t* from, uint8_t* to = nullptr) {
-  return deserialize<T, Mode | mode::UNCHECKED>(from, to);
-}
+  persistent_hash_map(persistent_hash_map const&) = delete;
+  persistent_hash_map& operator=(persistent_hash_map const&) = delete;
 
-template <typename T, mode const Mode = mode::NONE, typename Container>
-T* unchecked_deserialize(Container& c) {
-  return unchecked_deserialize<T, Mode>(&c[0], &c[0] + c.size());
-}
+  map_t const& map() const { return active(file_->root()); }
+
+  template <typename K>
+  Value const* find(K const& key) const {
+    auto const it = map().find(key);
+    return it == map().end() ? nullptr : &it->second;
+  }
+
+  // Returns false (and keeps the stored value) if the key exists.
+  bool emplace(Key const& key, Value const& value) {
+    if (map().find(key) != map().end()) {
+      return false;
+    }
+    if (map().growth_left_ == 0U) {
+      grow();
+    }
+    return file_->insert(active(file_->root()), entry_t{key, value});
+  }
+
+  // Only the ctrl byte changes: entries in the file own nothing, and
+  // running their destructor would blank a key that is still published.
+  template <typename K>
+  bool erase(K const& key) {
+    auto& m = active(file_->root());
+    auto const it = m.find(key);
+    if (it == m.end()) {
+      return false;
+    }
+    m.erase_meta_only(it);
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+  }
+
+  std::size_t size() const { return map().size(); }
+  bool empty() const { return map().empty(); }
+
+  // Bytes of the file no longer reachable since it was opened.
+  std::size_t dead_bytes() const { return file_->dead_bytes(); }
+
+  // Flushes the mapping to disk.
+  void sync() { file_->commit(); }
+
+  void compact() {
+    auto compacted = root_t{};
+    for (auto const& e : map()) {
+      compacted.maps_[0].insert(e);
+    }
+    sync();
+    file_.reset();
+    write_file(path_, compacted);
+    file_ = std::make_unique<file>(path_.c_str());
+    file_->root().dirty_ = 1U;
+  }
+
+private:
+  struct file : public appender<root_t, Mode> {
+    using appender<root_t, Mode>::appender;
+    using appender<root_t, Mode>::at;
+    using appender<root_t, Mode>::grow;
+    using appender<root_t, Mode>::offset_of;
+  };
+
+  static map_t& active(root_t& r) { return r.maps_[r.active_]; }
+  static map_t const& active(root_t const& r) { return r.maps_[r.active_]; }
+
+  // The header not in use gets a copy of the active one, grows it and is
+  // made active. The old table stays untouched until the switch.
+  void grow() {
+    auto& r = file_->root();
+    auto const next = 1U - r.active_;
+    auto const from = file_->offset_of(&r.maps_[r.active_]);
+    auto const to = file_->offset_of(&r.maps_[next]);
+    std::memcpy(static_cast<void*>(file_->template at<map_t>(to)),
+                static_cast<void const*>(file_->template at<map_t>(from)),
+                sizeof(map_t));
+    rebase(file_->template at<map_t>(to), from - to);
+    file_->template grow<map_t>(to);
+    std::atomic_thread_fence(std::memory_order_release);
+    file_->root().active_ = next;
+  }
+
+  static void write_file(std::string const& path, root_t const& r) {
+    auto const tmp = path + ".tmp";
+    {
+      auto b = buf<mmap>{mmap{tmp.c_str(), mmap::protection::WRITE}};
+      serialize<Mode>(b, r);
+    }
+    std::filesystem::rename(tmp, path);
+  }
+
+  // Creates a missing file and repairs the file of a map that was not
+  // closed. Runs before the file is validated, so it checks every access.
+  static char const* prepare(char const* path) {
+    if (!std::filesystem::exists(path)) {
+      write_file(path, root_t{});
+      return path;
+    }
+
+    auto m = mmap{path, mmap::protection::MODIFY};
+    auto const start = static_cast<std::size_t>(data_start(Mode));
+    verify(m.size() >= start + sizeof(root_t), "persistent map: file size");
+    auto& r = *reinterpret_cast<root_t*>(m.data() + start);
+    if (r.dirty_ == 0U) {
+      return path;
+    }
+    verify(r.active_ < 2U, "persistent map: active header");
+
+    auto& a = active(r);
+    if (a.capacity_ != 0U) {
+      auto const ctrl = reinterpret_cast<uint8_t const*>(ptr_cast(a.ctrl_));
+      auto const ctrl_size = std::size_t{a.capacity_} + 1U + map_t::WIDTH;
+      verify(ctrl >= m.data() && m.size() >= ctrl_size &&
+                 static_cast<std::size_t>(ctrl - m.data()) <=
+                     m.size() - ctrl_size,
+             "persistent map: ctrl bytes");
+      auto full = typename map_t::size_type{0U};
+      auto deleted = typename map_t::size_type{0U};
+      for (auto i = typename map_t::size_type{0U}; i != a.capacity_; ++i) {
+        auto const c = a.ctrl_[i];
+        full += map_t::is_full(c) ? 1U : 0U;
+        deleted += map_t::is_deleted(c) ? 1U : 0U;
+        a.set_ctrl(i, static_cast<typename map_t::h2_t>(c));
+      }
+      auto const max_growth = map_t::capacity_to_growth(a.capacity_);
+      verify(full + deleted <= max_growth, "persistent map: ctrl bytes");
+      a.size_ = full;
+      a.growth_left_ = max_growth - full - deleted;
+    }
+
+    auto& inactive = r.maps_[1U - r.active_];
+    std::memcpy(static_cast<void*>(&inactive), static_cast<void const*>(&a),
+                sizeof(map_t));
+    rebase(&inactive, reinterpret_cast<uint8_t*>(&a) -
+                          reinterpret_cast<uint8_t*>(&inactive));
+    return path;
+  }
+
+  std::string path_;
+  std::unique_ptr<file> file_;
+};
 
 namespace raw {
 using cista::deserialize;
@@ -4843,8 +8430,13 @@ using cista::unchecked_deserialize;
 }  // namespace raw
 
 namespace offset {
+using cista::appender;
+using cista::dataset;
+using cista::persistent_hash_map;
 using cista::deserialize;
+using cista::lazy_checked;
 using cista::unchecked_deserialize;
+using cista::versioned_view;
 }  // namespace offset
 
 }  // namespace cista
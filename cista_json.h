@@ -0,0 +1,450 @@
+#pragma once
+
+// Bridge between json_struct and cista.
+//
+// JS::TypeHandler specializations for the cista containers, so structs
+// described with JS_OBJ / JS_OBJ_EXT can be parsed straight into cista types
+// and written back to JSON from a deserialized (e.g. memory mapped) buffer,
+// without going through std:: containers:
+//
+//   - string: the token is copied once into the cista string, escape
+//     sequences are decoded while copying.
+//   - string_view: points into the JSON input (no copy at all), so the input
+//     has to outlive the value. Strings with escape sequences are rejected.
+//   - vector, array, unique_ptr: like their std:: counterparts.
+//   - hash_map with string keys: JSON object. hash_set: JSON array.
+//
+// Field names come from the json_struct metadata, the member layout from
+// cista's reflection (serialize, deserialize). Escape handling follows
+// RFC 8259, i.e. \u escapes (including surrogate pairs) are decoded to UTF-8.
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "cista.h"
+#include "json_struct.h"
+
+namespace cista {
+
+namespace json_detail {
+
+inline int hex_value(char const c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// Value of the four hex digits at s, or -1.
+inline long hex4(char const* s) {
+  auto v = 0L;
+  for (auto i = 0; i != 4; ++i) {
+    auto const h = hex_value(s[i]);
+    if (h < 0) {
+      return -1;
+    }
+    v = (v << 4U) | h;
+  }
+  return v;
+}
+
+template <typename Out>
+void utf8(unsigned long const cp, Out&& out) {
+  if (cp < 0x80U) {
+    out(static_cast<char>(cp));
+  } else if (cp < 0x800U) {
+    out(static_cast<char>(0xC0U | (cp >> 6U)));
+    out(static_cast<char>(0x80U | (cp & 0x3FU)));
+  } else if (cp < 0x10000U) {
+    out(static_cast<char>(0xE0U | (cp >> 12U)));
+    out(static_cast<char>(0x80U | ((cp >> 6U) & 0x3FU)));
+    out(static_cast<char>(0x80U | (cp & 0x3FU)));
+  } else {
+    out(static_cast<char>(0xF0U | (cp >> 18U)));
+    out(static_cast<char>(0x80U | ((cp >> 12U) & 0x3FU)));
+    out(static_cast<char>(0x80U | ((cp >> 6U) & 0x3FU)));
+    out(static_cast<char>(0x80U | (cp & 0x3FU)));
+  }
+}
+
+// Calls out(c) for every byte of the decoded string [s, s + n).
+// Malformed escape sequences are passed through unchanged.
+template <typename Out>
+void unescape(char const* s, std::size_t const n, Out&& out) {
+  auto const end = s + n;
+  while (s != end) {
+    if (*s != '\\' || end - s < 2) {
+      out(*s++);
+      continue;
+    }
+    switch (s[1]) {
+      case '"': out('"'); break;
+      case '\\': out('\\'); break;
+      case '/': out('/'); break;
+      case 'b': out('\b'); break;
+      case 'f': out('\f'); break;
+      case 'n': out('\n'); break;
+      case 'r': out('\r'); break;
+      case 't': out('\t'); break;
+      case 'u': {
+        auto cp = end - s >= 6 ? hex4(s + 2) : -1L;
+        if (cp < 0) {
+          out('\\');
+          out('u');
+          break;
+        }
+        s += 6;
+        if (cp >= 0xD800 && cp < 0xDC00 && end - s >= 6 && s[0] == '\\' &&
+            s[1] == 'u') {
+          if (auto const low = hex4(s + 2); low >= 0xDC00 && low < 0xE000) {
+            cp = 0x10000 + ((cp - 0xD800) << 10U) + (low - 0xDC00);
+            s += 6;
+          }
+        }
+        utf8(static_cast<unsigned long>(cp), out);
+        continue;
+      }
+      default:
+        out('\\');
+        out(s[1]);
+        break;
+    }
+    s += 2;
+  }
+}
+
+template <typename T>
+struct is_string_view : std::false_type {};
+
+template <typename Ptr>
+struct is_string_view<basic_string_view<Ptr>> : std::true_type {};
+
+inline bool needs_escape(char const c) {
+  return static_cast<unsigned char>(c) < 0x20U || c == '"' || c == '\\';
+}
+
+// Calls out(c) for every byte of the escaped string [s, s + n).
+template <typename Out>
+void escape(char const* s, std::size_t const n, Out&& out) {
+  constexpr char const* const hex = "0123456789abcdef";
+  for (auto const c : std::string_view{s, n}) {
+    if (!needs_escape(c)) {
+      out(c);
+      continue;
+    }
+    out('\\');
+    switch (c) {
+      case '"': out('"'); break;
+      case '\\': out('\\'); break;
+      case '\b': out('b'); break;
+      case '\f': out('f'); break;
+      case '\n': out('n'); break;
+      case '\r': out('r'); break;
+      case '\t': out('t'); break;
+      default:
+        out('u');
+        out('0');
+        out('0');
+        out(hex[static_cast<unsigned char>(c) >> 4U]);
+        out(hex[static_cast<unsigned char>(c) & 0xFU]);
+    }
+  }
+}
+
+template <typename Ptr>
+JS::Error parse_string(generic_string<Ptr>& s, JS::DataRef const& v) {
+  if (std::memchr(v.data, '\\', v.size) == nullptr) {
+    s.set_owning(v.data, static_cast<uint32_t>(v.size));
+    return JS::Error::NoError;
+  }
+  auto size = uint32_t{0U};
+  unescape(v.data, v.size, [&](char) { ++size; });
+  s.set_owning(v.data, size);  // Allocates, the content is overwritten.
+  auto out = s.data();
+  unescape(v.data, v.size, [&](char const c) { *out++ = c; });
+  return JS::Error::NoError;
+}
+
+template <typename Ptr>
+JS::Error parse_string_view(generic_string<Ptr>& s, JS::DataRef const& v) {
+  if (std::memchr(v.data, '\\', v.size) != nullptr) {
+    return JS::Error::IllegalDataValue;
+  }
+  s.set_non_owning(v.data, static_cast<uint32_t>(v.size));
+  return JS::Error::NoError;
+}
+
+// Writes s as string token. Only strings that need escaping are copied.
+inline void write_string(char const* s, std::size_t const n, JS::Token& token,
+                         JS::Serializer& serializer) {
+  token.value_type = JS::Type::String;
+  auto const first = std::find_if(s, s + n, needs_escape);
+  if (first == s + n) {
+    token.value = JS::DataRef(s, n);
+    serializer.write(token);
+    return;
+  }
+  auto size = std::size_t{0U};
+  escape(s, n, [&](char) { ++size; });
+  auto buf = raw::vector<char>(static_cast<uint32_t>(size));
+  auto out = buf.data();
+  escape(s, n, [&](char const c) { *out++ = c; });
+  token.value = JS::DataRef(buf.data(), size);
+  serializer.write(token);
+}
+
+// Quotes and escapes an object key into out. The key is written verbatim:
+// the serializer neither escapes String names nor writes empty ones.
+inline void quote_key(char const* s, std::size_t const n, std::string& out) {
+  out.clear();
+  out.push_back('"');
+  escape(s, n, [&](char const c) { out.push_back(c); });
+  out.push_back('"');
+}
+
+inline void write_array_start(JS::Token& token, JS::Serializer& serializer) {
+  token.value_type = JS::Type::ArrayStart;
+  token.value = JS::DataRef("[");
+  serializer.write(token);
+  token.name = JS::DataRef("");
+}
+
+inline void write_array_end(JS::Token& token, JS::Serializer& serializer) {
+  token.name = JS::DataRef("");
+  token.value_type = JS::Type::ArrayEnd;
+  token.value = JS::DataRef("]");
+  serializer.write(token);
+}
+
+// Parses a JSON array, calling element() for every entry.
+template <typename Fn>
+JS::Error parse_array(JS::ParseContext& context, Fn&& element) {
+  if (context.token.value_type != JS::Type::ArrayStart) {
+    return JS::Error::ExpectedArrayStart;
+  }
+  auto error = context.nextToken();
+  while (error == JS::Error::NoError &&
+         context.token.value_type != JS::Type::ArrayEnd) {
+    error = element();
+    if (error == JS::Error::NoError) {
+      error = context.nextToken();
+    }
+  }
+  return error;
+}
+
+}  // namespace json_detail
+
+// Parses json into a T and serializes it into the target. T holds cista
+// containers; its string_view members point into json until serialize()
+// copies them, so string data is copied exactly once.
+// Throws std::runtime_error on parse errors.
+template <typename T, mode const Mode = mode::NONE, typename Target>
+void json_to_cista(Target& t, char const* json, std::size_t const size) {
+  auto value = T{};
+  auto context = JS::ParseContext{json, size};
+  if (context.parseTo(value) != JS::Error::NoError) {
+    throw std::runtime_error{context.makeErrorString()};
+  }
+  serialize<Mode>(t, value);
+}
+
+template <typename T, mode const Mode = mode::NONE>
+byte_buf json_to_cista(char const* json, std::size_t const size) {
+  auto b = buf{};
+  json_to_cista<T, Mode>(b, json, size);
+  return std::move(b.buf_);
+}
+
+// JSON of a value, e.g. the result of deserialize() on a mapped file.
+// Strings are passed to the JSON writer straight from the cista buffer.
+template <typename T>
+std::string cista_to_json(
+    T const& value, JS::SerializerOptions const& options =
+                        JS::SerializerOptions{JS::SerializerOptions::Compact}) {
+  return JS::serializeStruct(value, options);
+}
+
+}  // namespace cista
+
+namespace JS {
+
+template <typename Ptr>
+struct TypeHandler<cista::basic_string<Ptr>> {
+  static inline Error to(cista::basic_string<Ptr>& to_type,
+                         ParseContext& context) {
+    return cista::json_detail::parse_string(to_type, context.token.value);
+  }
+
+  static inline void from(cista::basic_string<Ptr> const& s, Token& token,
+                          Serializer& serializer) {
+    cista::json_detail::write_string(s.data(), s.size(), token, serializer);
+  }
+};
+
+template <typename Ptr>
+struct TypeHandler<cista::basic_string_view<Ptr>> {
+  static inline Error to(cista::basic_string_view<Ptr>& to_type,
+                         ParseContext& context) {
+    return cista::json_detail::parse_string_view(to_type, context.token.value);
+  }
+
+  static inline void from(cista::basic_string_view<Ptr> const& s, Token& token,
+                          Serializer& serializer) {
+    cista::json_detail::write_string(s.data(), s.size(), token, serializer);
+  }
+};
+
+template <typename T, typename Ptr, bool Indexed, typename TemplateSizeType>
+struct TypeHandler<cista::basic_vector<T, Ptr, Indexed, TemplateSizeType>> {
+  using vector_t = cista::basic_vector<T, Ptr, Indexed, TemplateSizeType>;
+
+  static inline Error to(vector_t& to_type, ParseContext& context) {
+    to_type.clear();
+    return cista::json_detail::parse_array(context, [&]() {
+      return TypeHandler<T>::to(to_type.emplace_back(), context);
+    });
+  }
+
+  static inline void from(vector_t const& vec, Token& token,
+                          Serializer& serializer) {
+    cista::json_detail::write_array_start(token, serializer);
+    for (auto const& el : vec) {
+      TypeHandler<T>::from(el, token, serializer);
+    }
+    cista::json_detail::write_array_end(token, serializer);
+  }
+};
+
+template <typename T, std::size_t Size>
+struct TypeHandler<cista::array<T, Size>> {
+  static inline Error to(cista::array<T, Size>& to_type,
+                         ParseContext& context) {
+    auto i = std::size_t{0U};
+    auto const error =
+        cista::json_detail::parse_array(context, [&]() -> Error {
+          if (i == Size) {
+            return Error::ExpectedArrayEnd;
+          }
+          return TypeHandler<T>::to(to_type[i++], context);
+        });
+    return error == Error::NoError && i != Size ? Error::ExpectedDataToken
+                                                : error;
+  }
+
+  static inline void from(cista::array<T, Size> const& arr, Token& token,
+                          Serializer& serializer) {
+    cista::json_detail::write_array_start(token, serializer);
+    for (auto const& el : arr) {
+      TypeHandler<T>::from(el, token, serializer);
+    }
+    cista::json_detail::write_array_end(token, serializer);
+  }
+};
+
+template <typename T, typename Ptr>
+struct TypeHandler<cista::basic_unique_ptr<T, Ptr>> {
+  static inline Error to(cista::basic_unique_ptr<T, Ptr>& to_type,
+                         ParseContext& context) {
+    if (context.token.value_type == Type::Null) {
+      to_type.reset();
+      return Error::NoError;
+    }
+    if (!to_type) {
+      to_type = cista::basic_unique_ptr<T, Ptr>{new T{}};
+    }
+    return TypeHandler<T>::to(*to_type, context);
+  }
+
+  static inline void from(cista::basic_unique_ptr<T, Ptr> const& p,
+                          Token& token, Serializer& serializer) {
+    if (p) {
+      TypeHandler<T>::from(*p, token, serializer);
+    } else {
+      token.value_type = Type::Null;
+      token.value = DataRef("null");
+      serializer.write(token);
+    }
+  }
+};
+
+template <typename T, template <typename> typename Ptr, typename GetKey,
+          typename GetValue, typename Hash, typename Eq>
+struct TypeHandler<
+    cista::hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>> {
+  using map_t =
+      cista::hash_storage<T, Ptr, uint32_t, GetKey, GetValue, Hash, Eq>;
+  using key_t = typename map_t::key_t;
+  static constexpr auto const IS_SET = std::is_same_v<GetKey, cista::identity>;
+
+  static inline Error to(map_t& to_type, ParseContext& context) {
+    to_type.clear();
+    if constexpr (IS_SET) {
+      return cista::json_detail::parse_array(context, [&]() {
+        auto el = T{};
+        auto const error = TypeHandler<T>::to(el, context);
+        to_type.emplace(std::move(el));
+        return error;
+      });
+    } else {
+      static_assert(cista::is_string_v<key_t>, "JSON object keys are strings");
+      if (context.token.value_type != Type::ObjectStart) {
+        return Error::ExpectedObjectStart;
+      }
+      auto error = context.nextToken();
+      while (error == Error::NoError &&
+             context.token.value_type != Type::ObjectEnd) {
+        auto key = key_t{};
+        if constexpr (cista::json_detail::is_string_view<key_t>::value) {
+          error = cista::json_detail::parse_string_view(key, context.token.name);
+        } else {
+          error = cista::json_detail::parse_string(key, context.token.name);
+        }
+        if (error == Error::NoError) {
+          error = TypeHandler<typename map_t::mapped_type>::to(
+              to_type[std::move(key)], context);
+        }
+        if (error == Error::NoError) {
+          error = context.nextToken();
+        }
+      }
+      return error;
+    }
+  }
+
+  static inline void from(map_t const& map, Token& token,
+                          Serializer& serializer) {
+    if constexpr (IS_SET) {
+      cista::json_detail::write_array_start(token, serializer);
+      for (auto const& el : map) {
+        TypeHandler<T>::from(el, token, serializer);
+      }
+      cista::json_detail::write_array_end(token, serializer);
+    } else {
+      token.value_type = Type::ObjectStart;
+      token.value = DataRef("{");
+      serializer.write(token);
+      auto name = std::string{};
+      for (auto const& el : map) {
+        auto const& key = GetKey{}(el);
+        cista::json_detail::quote_key(key.data(), key.size(), name);
+        token.name = DataRef(name.data(), name.size());
+        token.name_type = Type::Verbatim;
+        TypeHandler<typename map_t::mapped_type>::from(GetValue{}(el), token,
+                                                      serializer);
+      }
+      token.name = DataRef("");
+      token.name_type = Type::String;
+      token.value_type = Type::ObjectEnd;
+      token.value = DataRef("}");
+      serializer.write(token);
+    }
+  }
+};
+
+}  // namespace JS
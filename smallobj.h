@@ -39,6 +39,17 @@ namespace Loki {
  A Chunk is corrupt if this singly-linked list has a loop or is shorter
  than blocksAvailable_.  Much of the allocator's time and space efficiency
  comes from how these stealth indexes are implemented.
+
+ @par Hardened Mode
+ When SmallObj.cpp is compiled with LOKI_HARDENED_CHUNKS, each stealth index
+ is stored XOR-ed with a key derived from the block's address and a per-
+ process secret, and the second byte of each empty block holds a canary.
+ A stray write into an empty block then shows up as a bad canary or an out-
+ of-range index when the block is handed out again.  Either way the rest of
+ the Chunk is quarantined, and a block with a bad canary is not handed out
+ at all.  A block which still carries its canary when it is deallocated is
+ checked against the linked-list to catch double-frees.  Every check is
+ O(1) except that confirmation, which only runs for blocks that look empty.
  */
 class Chunk
 {
@@ -56,7 +67,8 @@ private:
      this will never throw.  Does not actually "allocate" by calling
      malloc, new, or any other function, but merely adjusts some internal
      indexes to indicate an already allocated block is no longer available.
-     @return Pointer to block within Chunk.
+     @return Pointer to block within Chunk, or NULL if hardened mode found the
+     next block written after it was freed.  The Chunk is then quarantined.
      */
     void * Allocate( std::size_t blockSize );
 
@@ -101,6 +113,29 @@ private:
     bool IsBlockAvailable( void * p, unsigned char numBlocks,
         std::size_t blockSize ) const;
 
+    /** Determines if deallocating the block at p would free it twice.  The
+     first available block is always checked.  In hardened mode, a block
+     whose canary is intact is looked up on the linked-list, otherwise this
+     is constant-time.  That walk stops at the first stealth index which is
+     out of range or repeats.
+     @param what Set to the reason to report when this returns true.
+     @return True if block is already available or the list is corrupt.
+     */
+    bool IsDoubleFree( void * p, unsigned char numBlocks,
+        std::size_t blockSize, const char * & what ) const;
+
+    /// Writes index as the stealth index of an empty block.
+    static void StoreIndex( unsigned char * block, unsigned char index,
+        std::size_t blockSize );
+
+    /// Reads the stealth index of an empty block.
+    static unsigned char LoadIndex( const unsigned char * block );
+
+    /** Returns false if an empty block was written to since it was
+     deallocated.  Always true unless in hardened mode.
+     */
+    static bool HasCanary( const unsigned char * block, std::size_t blockSize );
+
     /// Returns true if block at address P is inside this Chunk.
     inline bool HasBlock( void * p, std::size_t chunkLength ) const
     {
@@ -204,8 +239,22 @@ private:
     Chunk * deallocChunk_;
     /// Pointer to the only empty Chunk if there is one, else NULL.
     Chunk * emptyChunk_;
+    /// # of deallocations left before the next sampled Chunk check.
+    unsigned int deallocsUntilCheck_;
 
 public:
+    /** Called when a hardened-mode check finds a double-free or a corrupt
+     Chunk.  p is the offending block or Chunk data, and what says which
+     check failed.  If the handler returns, the allocator refuses the
+     operation instead of corrupting itself further.
+     */
+    typedef void ( * CorruptionHandler )( const void * p, const char * what );
+
+    /** Installs handler for corruption found in hardened mode, and returns
+     the previous one.  The default handler prints to stderr and aborts.
+     */
+    static CorruptionHandler SetCorruptionHandler( CorruptionHandler handler );
+
     /// Create a FixedAllocator which manages blocks of 'blockSize' size.
     FixedAllocator();
 
@@ -271,6 +320,202 @@ public:
 
 //unsigned char FixedAllocator::MinObjectsPerChunk_ = 8;
 //unsigned char FixedAllocator::MaxObjectsPerChunk_ = UCHAR_MAX;
+
+/** @struct ReclaimPolicy
+    @ingroup SmallObjectGroupInternal
+ Tells SmallObjAllocator when to give memory back.  Each FixedAllocator keeps
+ at most one empty Chunk around so that alternating allocate/deallocate calls
+ do not thrash the heap, but after a burst that Chunk and the spare capacity
+ of the Chunk list stay allocated forever unless somebody calls
+ TrimExcessMemory.
+
+ With a policy enabled, every stepInterval calls to Allocate or Deallocate
+ run one ReclaimStep, which visits allocatorsPerStep FixedAllocators in
+ round-robin order.  A FixedAllocator which has not been used for idleTicks
+ calls gets its empty Chunk and spare Chunk list capacity released.  Busy
+ size classes keep their empty Chunk, idle ones decay to nothing, and the
+ work done inside any single call stays bounded.
+
+ @par Background Reclamation
+ ReclaimStep may also be called from a low-priority thread instead of (or in
+ addition to) the incremental mode.  SmallObjAllocator does no locking, so
+ that thread must hold the same lock as the threads which allocate.
+ */
+struct ReclaimPolicy
+{
+    /// # of Allocate/Deallocate calls between reclaim steps, or 0 to disable.
+    std::size_t stepInterval;
+    /// # of FixedAllocators visited by a single reclaim step.
+    std::size_t allocatorsPerStep;
+    /// # of calls a FixedAllocator must stay unused before it is trimmed.
+    std::size_t idleTicks;
+
+    /// Default policy never reclaims memory on its own.
+    ReclaimPolicy( std::size_t interval = 0, std::size_t perStep = 1,
+        std::size_t idle = 4096 )
+        : stepInterval( interval )
+        , allocatorsPerStep( perStep )
+        , idleTicks( idle )
+    {}
+};
+
+/** @class SmallObjAllocator
+    @ingroup SmallObjectGroupInternal
+ Manages pool of fixed-size allocators.
+ Designed to be a non-templated base class of AllocatorSingleton so that
+ implementation details can be safely hidden in the source code file.
+ */
+class SmallObjAllocator
+{
+public:
+    /** The only available constructor needs certain parameters in order to
+     initialize all the FixedAllocator's.  This throws only if it can not
+     allocate the pool itself.
+     @param pageSize # of bytes in a page of memory.
+     @param maxObjectSize Max # of bytes which this may allocate.
+     @param objectAlignSize # of bytes between alignment boundaries.
+     @param policy When to give unused Chunks back to the heap.
+     */
+    SmallObjAllocator( std::size_t pageSize, std::size_t maxObjectSize,
+        std::size_t objectAlignSize,
+        const ReclaimPolicy & policy = ReclaimPolicy() );
+
+    /** Destructor releases all blocks, all Chunks, and FixedAllocator's.
+     Any outstanding blocks are unavailable, and should not be used after
+     this destructor is called.
+     */
+    ~SmallObjAllocator( void );
+
+    /** Allocates a block of memory of requested size.  Complexity is often
+     constant-time, but might be O(C) where C is the number of Chunks in a
+     FixedAllocator.
+
+     @par Exception Safety Level
+     Provides either strong-exception safety, or no-throw exception-safety
+     level depending upon doThrow parameter.  The reason it provides two
+     levels of exception safety is because it is used by both the nothrow
+     and throwing new operators.  The underlying implementation will never
+     throw of its own accord, but this can decide to throw if it does not
+     allocate.  The only exception it should emit is std::bad_alloc.
+
+     @par Allocation Failure
+     If it does not allocate, it will call TrimExcessMemory and attempt to
+     allocate again, before it decides to throw or return NULL.  Many
+     allocators loop through several new_handler functions, and terminate
+     if they can not allocate, but not this one.  It only makes one attempt
+     using its own implementation of the new_handler, and then returns NULL
+     or throws so that the program can decide what to do at a higher level.
+     (Side note: Even though the C++ Standard allows allocators and
+     new_handlers to terminate if they fail, the Loki allocator does not do
+     that since that policy is not polite to a host program.)
+
+     @param size # of bytes needed for allocation.
+     @param doThrow True if this should throw if unable to allocate, false
+      if it should provide no-throw exception safety level.
+     @return NULL if nothing allocated and doThrow is false.  Else the
+      pointer to an available block of memory.
+     */
+    void * Allocate( std::size_t size, bool doThrow );
+
+    /** Deallocates a block of memory at a given place and of a specific
+    size.  Complexity is almost always constant-time, and is O(C) only if
+    it has to search for which Chunk deallocates.  This never throws.
+     */
+    void Deallocate( void * p, std::size_t size );
+
+    /** Deallocates a block of memory at a given place but of unknown size
+    size.  Complexity is O(F + C) where F is the count of FixedAllocator's
+    in the pool, and C is the number of Chunks in all FixedAllocator's.  This
+    does not throw exceptions.  This overloaded version of Deallocate is
+    called by the nothow delete operator - which is called when the nothrow
+    new operator is used, but a constructor throws an exception.
+     */
+    void Deallocate( void * p );
+
+    /// Returns max # of bytes which this can allocate.
+    inline std::size_t GetMaxObjectSize() const
+    { return maxSmallObjectSize_; }
+
+    /// Returns # of bytes between allocation boundaries.
+    inline std::size_t GetAlignment() const { return objectAlignSize_; }
+
+    /// Returns the policy which drives incremental reclamation.
+    inline const ReclaimPolicy & GetReclaimPolicy() const { return policy_; }
+
+    /** Releases empty Chunks from memory.  Complexity is O(F + C) where F
+     is the count of FixedAllocator's in the pool, and C is the number of
+     Chunks in all FixedAllocator's.  This will never throw.  This is called
+     by AllocatorSingleto::ClearExtraMemory, the new_handler function for
+     Loki's allocator, and is called internally when an allocation fails.
+     @return True if any memory released, or false if none released.
+     */
+    bool TrimExcessMemory( void );
+
+    /** Runs one bounded step of the reclaim policy.  Visits the next
+     allocatorsPerStep FixedAllocators and trims the ones which have been
+     idle for at least idleTicks calls.  This is called from Allocate and
+     Deallocate when the policy is enabled, and may be called by a
+     background thread which serializes with them.
+     @return True if any memory released, or false if none released.
+     */
+    bool ReclaimStep( void );
+
+    /** Returns true if anything in implementation is corrupt.  Complexity
+     is O(F + C + B) where F is the count of FixedAllocator's in the pool,
+     C is the number of Chunks in all FixedAllocator's, and B is the number
+     of blocks in all Chunks.  If it determines any data is corrupted, this
+     will return true in release version, but assert in debug version at
+     the line where it detects the corrupted data.  If it does not detect
+     any corrupted data, it returns false.
+     */
+    bool IsCorrupt( void ) const;
+
+private:
+    /// Default-constructor is not implemented.
+    SmallObjAllocator( void );
+    /// Copy-constructor is not implemented.
+    SmallObjAllocator( const SmallObjAllocator & );
+    /// Copy-assignment operator is not implemented.
+    SmallObjAllocator & operator = ( const SmallObjAllocator & );
+
+    /** Records a use of the FixedAllocator at index, and runs a reclaim
+     step when the policy says one is due.  Costs one store and one
+     decrement when no step is due.
+     */
+    inline void Touch( std::size_t index )
+    {
+        lastUse_[ index ] = ++tick_;
+        if ( ( 0 != policy_.stepInterval ) && ( 0 == --untilNextStep_ ) )
+        {
+            untilNextStep_ = policy_.stepInterval;
+            ReclaimStep();
+        }
+    }
+
+    /// Pointer to array of fixed-size allocators.
+    Loki::FixedAllocator * pool_;
+
+    /// Largest object size supported by allocators.
+    const std::size_t maxSmallObjectSize_;
+
+    /// Size of alignment boundaries.
+    const std::size_t objectAlignSize_;
+
+    /// When and how much memory to give back.
+    const ReclaimPolicy policy_;
+
+    /// Count of Allocate/Deallocate calls handled by the pool.
+    std::size_t tick_;
+
+    /// Value of tick_ when each FixedAllocator was last used.
+    std::size_t * lastUse_;
+
+    /// # of calls left before the next reclaim step.
+    std::size_t untilNextStep_;
+
+    /// Index of FixedAllocator visited next by ReclaimStep.
+    std::size_t reclaimCursor_;
+};
 }
 
 #endif // SMALLOBJ_H
@@ -2,6 +2,8 @@
 
 #include"smallobj.h"
 
+#include<vector>
+
 using namespace Loki;
 
 TEST_CASE("fuck2")
@@ -11,3 +13,107 @@ TEST_CASE("fuck2")
     double * d=static_cast<double *>(f.Allocate());
     f.Deallocate(d,nullptr);
 }
+
+TEST_CASE("reclaim step trims idle size classes")
+{
+    SmallObjAllocator a{4096, 64, 8, ReclaimPolicy{0, 8, 32}};
+    std::vector<void *> v;
+    for(int i=0;i<1000;i++)
+        v.push_back(a.Allocate(8,true));
+    for(auto p:v)
+        a.Deallocate(p,8);
+    CHECK(!a.IsCorrupt());
+    //刚用过的分配器不算空闲
+    CHECK(!a.ReclaimStep());
+    for(int i=0;i<20;i++)
+        a.Deallocate(a.Allocate(32,true),32);
+    //8字节的分配器已空闲超过32次调用,它的空chunk被释放
+    CHECK(a.ReclaimStep());
+    CHECK(!a.ReclaimStep());
+    CHECK(!a.IsCorrupt());
+}
+
+TEST_CASE("reclaim policy trims idle size classes on its own")
+{
+    //每 4 次调用自动走一步,不手动调用 ReclaimStep
+    SmallObjAllocator a{4096, 64, 8, ReclaimPolicy{4, 8, 32}};
+    std::vector<void *> v;
+    for(int i=0;i<1000;i++)
+        v.push_back(a.Allocate(8,true));
+    for(auto p:v)
+        a.Deallocate(p,8);
+    for(int i=0;i<40;i++)
+        a.Deallocate(a.Allocate(32,true),32);
+    //8字节的分配器已经被自动释放,手动再走一步什么也找不到
+    CHECK(!a.ReclaimStep());
+    CHECK(!a.IsCorrupt());
+    v.clear();
+    for(int i=0;i<100;i++)
+        v.push_back(a.Allocate(8,true));
+    for(auto p:v)
+        a.Deallocate(p,8);
+    CHECK(!a.IsCorrupt());
+}
+
+#ifdef LOKI_HARDENED_CHUNKS
+namespace {
+int corruptions=0;
+void count_corruption(const void *,const char *){++corruptions;}
+}
+
+TEST_CASE("hardened mode catches double free")
+{
+    auto old=FixedAllocator::SetCorruptionHandler(count_corruption);
+    FixedAllocator f{};
+    f.Initialize(sizeof (double),4096);
+    double * a=static_cast<double *>(f.Allocate());
+    double * b=static_cast<double *>(f.Allocate());
+    f.Deallocate(a,nullptr);
+    f.Deallocate(b,nullptr);
+    //a 不在空闲链表头部,只能靠金丝雀发现
+    CHECK(!f.Deallocate(a,nullptr));
+    CHECK(corruptions==1);
+    CHECK(!f.IsCorrupt());
+    FixedAllocator::SetCorruptionHandler(old);
+}
+
+TEST_CASE("hardened mode stops at a corrupt free list")
+{
+    auto old=FixedAllocator::SetCorruptionHandler(count_corruption);
+    corruptions=0;
+    FixedAllocator f{};
+    //每个 chunk 64 块,解出来的索引 >=128 一定越界
+    f.Initialize(64,4096);
+    auto * a=static_cast<unsigned char *>(f.Allocate());
+    auto * b=static_cast<unsigned char *>(f.Allocate());
+    f.Deallocate(a,nullptr);
+    f.Deallocate(b,nullptr);
+    //b 存的是 a 的索引 0,索引是异或存的,翻最高位就变成 128
+    b[0]^=0x80;
+    //a 的金丝雀还在,要沿链表确认;走到 b 就该停下,不能读到 chunk 外面
+    CHECK(!f.Deallocate(a,nullptr));
+    CHECK(corruptions==1);
+    FixedAllocator::SetCorruptionHandler(old);
+}
+
+TEST_CASE("hardened mode quarantines a chunk written after free")
+{
+    auto old=FixedAllocator::SetCorruptionHandler(count_corruption);
+    corruptions=0;
+    FixedAllocator f{};
+    f.Initialize(sizeof (double),4096);
+    double * a=static_cast<double *>(f.Allocate());
+    double * b=static_cast<double *>(f.Allocate());
+    f.Deallocate(a,nullptr);
+    //释放以后还在写,下一次分配不能把 a 交出去,也不能相信它里面的索引
+    reinterpret_cast<unsigned char *>(a)[1]^=0xff;
+    double * c=static_cast<double *>(f.Allocate());
+    CHECK(corruptions==1);
+    CHECK(c!=nullptr);
+    CHECK(c!=a);
+    CHECK(c!=b);
+    f.Deallocate(c,nullptr);
+    f.Deallocate(b,nullptr);
+    FixedAllocator::SetCorruptionHandler(old);
+}
+#endif
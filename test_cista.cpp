@@ -0,0 +1,942 @@
+#include"doctest/doctest.h"
+
+#include"cista.h"
+#include"cista_json.h"
+
+#include<atomic>
+#include<cstring>
+#include<filesystem>
+#include<string>
+#include<thread>
+#include<vector>
+
+namespace data=cista::offset;
+
+TEST_CASE("hash_map roundtrip with group probing")
+{
+    //删除和插入交替进行,让探测序列跨过 DELETED 槽位
+    data::hash_map<data::string,int> m;
+    for(int i=0;i<2000;++i)
+        m[data::string{std::to_string(i)}]=i;
+    for(int i=0;i<2000;i+=3)
+        m.erase(data::string{std::to_string(i)});
+    for(int i=2000;i<2500;++i)
+        m[data::string{std::to_string(i)}]=i;
+
+    auto buf=cista::serialize<cista::mode::WITH_VERSION>(m);
+    auto p=cista::deserialize<data::hash_map<data::string,int>,
+                              cista::mode::WITH_VERSION|cista::mode::DEEP_CHECK>(buf);
+    CHECK_EQ(p->size(),m.size());
+    for(int i=0;i<2500;++i){
+        auto it=p->find(data::string{std::to_string(i)});
+        if(i<2000&&i%3==0)
+            CHECK(it==p->end());
+        else
+            CHECK((it!=p->end()&&it->second==i));
+    }
+
+    //空表写出的是共享的空 group
+    data::hash_map<int,int> empty;
+    auto e=cista::serialize(empty);
+    auto q=cista::deserialize<data::hash_map<int,int>,cista::mode::DEEP_CHECK>(e);
+    CHECK(q->empty());
+    CHECK(q->find(1)==q->end());
+}
+
+//读写两边都用 relaxed 原子访问共享的表,-fsanitize=thread 下也不该报竞争
+TEST_CASE("concurrent hash_map readers during writes")
+{
+    cista::raw::concurrent_hash_map<int,int> m;
+    std::atomic<bool> stop{false};
+    std::atomic<int> bad{0};
+    std::vector<std::thread> readers;
+    for(int t=0;t<4;++t)
+        readers.emplace_back([&]{
+            while(!stop.load()){
+                //写入的值总是 key*2,读到别的值说明读到了撕裂的条目
+                for(int i=0;i<5000;i+=7){
+                    auto v=m.find(i);
+                    if(v&&*v!=i*2)
+                        ++bad;
+                }
+            }
+        });
+    for(int i=0;i<5000;++i)
+        m.emplace(i,i*2);
+    for(int i=0;i<5000;i+=2)
+        m.erase(i);
+    for(int i=0;i<5000;i+=4)
+        m.insert_or_assign(i,i*2);
+    //已有的 key 走原地覆盖
+    for(int i=1;i<5000;i+=6)
+        m.insert_or_assign(i,i*2);
+    stop=true;
+    for(auto & r:readers)
+        r.join();
+    //没有读者了,扩容换下来的旧表都能释放
+    CHECK_EQ(m.reclaim(),0u);
+
+    CHECK_EQ(bad.load(),0);
+    CHECK_EQ(m.size(),2500u+1250u);
+    CHECK(m.contains(4));
+    CHECK_FALSE(m.contains(2));
+    CHECK_EQ(*m.find(3),6);
+    CHECK_FALSE(m.emplace(3,0));
+}
+
+namespace {
+struct Node
+{
+    int id;
+    data::string name;
+    data::vector<int> edges;
+    data::unique_ptr<int> extra;
+    data::ptr<Node> next;
+};
+struct Record
+{
+    int id;
+    double price;
+    data::string name;
+};
+struct JsonItem
+{
+    data::string name;
+    data::string_view tag;
+    data::vector<int> values;
+    data::unique_ptr<int> extra;
+    data::hash_map<data::string,int> counts;
+    JS_OBJ(name,tag,values,extra,counts);
+};
+struct JsonDoc
+{
+    data::vector<JsonItem> items;
+    data::array<int,3> xyz;
+    data::hash_set<data::string> tags;
+    JS_OBJ(items,xyz,tags);
+};
+//同一个结构体的三个版本: v2 在末尾加字段, v3 删掉 id 并自己指定标签
+namespace v1{
+struct Item
+{
+    int id;
+    data::string name;
+};
+}
+namespace v2{
+struct Item
+{
+    int id;
+    data::string name;
+    data::vector<int> tags;
+    double weight{1.5};
+};
+}
+namespace v3{
+struct Item
+{
+    data::string name;
+    double weight{-1.0};
+    long id;
+    static constexpr auto cista_field_tags(){return std::array{1U,3U,7U};}
+};
+}
+struct Graph
+{
+    data::indexed_vector<Node> nodes;
+    data::vector<data::ptr<Node>> entry_points;
+    data::hash_map<int,data::string> labels;
+};
+}
+
+TEST_CASE("parallel serialization matches sequential")
+{
+    Graph g;
+    for(int i=0;i<20000;++i){
+        Node n{i,data::string{"node number "+std::to_string(i)},{},nullptr,nullptr};
+        for(int j=0;j<i%5;++j)
+            n.edges.push_back(i+j);
+        if(i%3==0)
+            n.extra=data::make_unique<int>(i);
+        g.nodes.emplace_back(std::move(n));
+    }
+    //指向别的线程负责的区域,要在最后一轮里补上
+    for(int i=0;i<20000;++i)
+        g.nodes[i].next=&g.nodes[(i+5000)%20000];
+    for(int i=0;i<20000;i+=1000)
+        g.entry_points.push_back(&g.nodes[i]);
+    g.labels[1]=data::string{"a label that does not fit into sso"};
+
+    auto seq=cista::serialize<cista::mode::WITH_INTEGRITY>(g);
+    auto par=cista::serialize_parallel<cista::mode::WITH_INTEGRITY>(g,4,512);
+    CHECK(par.size()>=seq.size());
+
+    auto p=cista::deserialize<Graph,cista::mode::WITH_INTEGRITY|cista::mode::DEEP_CHECK>(par);
+    REQUIRE(p->nodes.size()==20000u);
+    bool ok=true;
+    for(int i=0;i<20000;++i){
+        auto const & n=p->nodes[i];
+        ok=ok&&n.id==i&&n.name.view()==("node number "+std::to_string(i))&&
+           n.edges.size()==static_cast<unsigned>(i%5)&&
+           (i%3==0?(n.extra!=nullptr&&*n.extra==i):n.extra==nullptr)&&
+           n.next==&p->nodes[(i+5000)%20000];
+    }
+    CHECK(ok);
+    for(int i=0;i<20;++i)
+        CHECK(p->entry_points[i]==&p->nodes[i*1000]);
+    CHECK(p->labels.at(1).view()=="a label that does not fit into sso");
+}
+
+TEST_CASE("fd target streams the same bytes as buf")
+{
+    Graph g;
+    for(int i=0;i<3000;++i){
+        g.nodes.emplace_back(Node{i,data::string{"streamed node "+std::to_string(i)},{},nullptr,nullptr});
+        g.nodes.back().edges.push_back(i);
+    }
+    //指针在节点之前写出,补丁会落在已经刷到文件里的部分
+    for(int i=0;i<3000;i+=100)
+        g.entry_points.push_back(&g.nodes[i]);
+    constexpr auto MODE=cista::mode::WITH_INTEGRITY|cista::mode::WITH_VERSION;
+    auto expected=cista::serialize<MODE>(g);
+
+    char const * path="test_cista_fd.bin";
+    {
+        cista::fd_target t{path,4096};
+        cista::serialize<MODE>(t,g);
+        t.flush();
+        CHECK_EQ(t.size(),expected.size());
+    }
+    auto f=cista::file{path,"r"};
+    auto content=f.content();
+    std::remove(path);
+    REQUIRE(content.size()==expected.size());
+    CHECK(std::equal(expected.begin(),expected.end(),content.begin()));
+    auto p=cista::deserialize<Graph,MODE>(content);
+    CHECK(p->entry_points[29]==&p->nodes[2900]);
+}
+
+TEST_CASE("dry run size matches serialized size")
+{
+    Graph g;
+    for(int i=0;i<1000;++i)
+        g.nodes.emplace_back(Node{i,data::string{"sized node "+std::to_string(i)},{},nullptr,nullptr});
+    g.entry_points.push_back(&g.nodes[10]);
+    g.labels[7]=data::string{"another label longer than the sso buffer"};
+    constexpr auto MODE=cista::mode::WITH_INTEGRITY;
+
+    auto const expected=cista::serialize<MODE>(g);
+    auto const size=cista::serialization_size<MODE>(g);
+    CHECK_EQ(size,expected.size());
+
+    auto b=cista::buf{};
+    b.reserve(size);
+    auto const before=b.buf_.data();
+    cista::serialize<MODE>(b,g);
+    CHECK(b.buf_==expected);
+    CHECK(b.buf_.data()==before);
+}
+
+TEST_CASE("fast integrity checksum")
+{
+    //XXH64 的参考值
+    CHECK_EQ(cista::xxh64("",0),0xEF46DB3751D8E999ULL);
+    CHECK_EQ(cista::xxh64("abc",3),0x44BC2CF5AD770999ULL);
+
+    std::vector<uint8_t> big((5u<<20)+123);
+    for(std::size_t i=0;i<big.size();++i)
+        big[i]=static_cast<uint8_t>(i*2654435761u>>13);
+    auto const one=cista::chunked_checksum(big.data(),big.size(),1);
+    CHECK_EQ(cista::chunked_checksum(big.data(),big.size(),3),one);
+    big[4u<<20]^=1;
+    CHECK(cista::chunked_checksum(big.data(),big.size(),1)!=one);
+
+    data::vector<data::string> v;
+    for(int i=0;i<50000;++i)
+        v.emplace_back(data::string{"checksummed string "+std::to_string(i)});
+    constexpr auto MODE=cista::mode::WITH_INTEGRITY|cista::mode::FAST_INTEGRITY;
+    auto buf=cista::serialize<MODE>(v);
+    auto const p=cista::deserialize<data::vector<data::string>,MODE>(buf);
+    CHECK_EQ(p->size(),50000u);
+
+    //流式目标逐块读回,结果必须和内存里算的一样
+    char const * path="test_cista_fast.bin";
+    {
+        cista::fd_target t{path,1u<<16};
+        cista::serialize<MODE>(t,v);
+    }
+    auto f=cista::file{path,"r"};
+    auto content=f.content();
+    std::remove(path);
+    CHECK(std::equal(buf.begin(),buf.end(),content.begin(),content.end()));
+
+    buf.back()^=1;
+    bool thrown=false;
+    try{
+        cista::deserialize<data::vector<data::string>,MODE>(buf);
+    }catch(std::exception const &){
+        thrown=true;
+    }
+    CHECK(thrown);
+}
+
+TEST_CASE("lazy check validates on access")
+{
+    Graph g;
+    for(int i=0;i<1000;++i)
+        g.nodes.emplace_back(Node{i,data::string{"lazily checked node "+std::to_string(i)},{i},nullptr,nullptr});
+    for(int i=0;i<1000;++i)
+        g.nodes[i].next=&g.nodes[(i+1)%1000];
+    auto buf=cista::serialize(g);
+
+    {
+        cista::lazy_checked<Graph> l{buf};
+        auto const n=l.shallow(&l->nodes[42]);
+        CHECK(n->name.view()=="lazily checked node 42");
+        CHECK(l.deep(n)->next->id==43);
+        l.check_all_async();
+        l.wait();
+        CHECK(l.all_checked());
+    }
+
+    //破坏一个深处的字符串长度: 构造时不会发现,访问到它或后台检查时才报错
+    auto & victim=const_cast<Node &>(cista::deserialize<Graph>(buf)->nodes[900]);
+    victim.name.h_.size_=0x7fffffff;
+    cista::lazy_checked<Graph> l{buf};
+    CHECK(l.shallow(&l->nodes[899])->id==899);
+    bool thrown=false;
+    try{
+        l.shallow(&l->nodes[900]);
+    }catch(std::exception const &){
+        thrown=true;
+    }
+    CHECK(thrown);
+    thrown=false;
+    l.check_all_async();
+    try{
+        l.wait();
+    }catch(std::exception const &){
+        thrown=true;
+    }
+    CHECK(thrown);
+    CHECK_FALSE(l.all_checked());
+}
+
+TEST_CASE("mmap access hints and prefetch")
+{
+    Graph g;
+    for(int i=0;i<5000;++i)
+        g.nodes.emplace_back(Node{i,data::string{"mapped node with a long name "+std::to_string(i)},{i,i+1},nullptr,nullptr});
+    g.labels[3]=data::string{"label stored in a memory mapped file"};
+    char const * path="test_cista_mmap.bin";
+    {
+        cista::buf mm{cista::mmap{path}};
+        cista::serialize(mm,g);
+    }
+    using hint=cista::mmap::hint;
+    for(auto h:{hint::SEQUENTIAL|hint::POPULATE,hint::RANDOM|hint::HUGE_PAGES}){
+        cista::mmap m{path,cista::mmap::protection::READ,h};
+        m.prefetch(0,m.size());
+        auto const p=cista::deserialize<Graph>(m);
+        cista::prefetch(p->nodes);
+        cista::prefetch_subtree(*p);
+        CHECK(p->nodes[4999].name.view()=="mapped node with a long name 4999");
+        CHECK(p->labels.at(3).view()=="label stored in a memory mapped file");
+        if((static_cast<unsigned>(h)&static_cast<unsigned>(hint::HUGE_PAGES))!=0)
+            CHECK(reinterpret_cast<std::uintptr_t>(m.data())%cista::mmap::HUGE_PAGE_SIZE==0);
+    }
+    std::remove(path);
+}
+
+TEST_CASE("dataset reload while reading")
+{
+    //两个版本的数据: 每个版本里所有元素都等于同一个值,读者读到混合的值就说明看到了被卸载的映射
+    char const * paths[]={"test_cista_ds_a.bin","test_cista_ds_b.bin"};
+    for(int v=0;v<2;++v){
+        data::vector<data::string> d;
+        for(int i=0;i<2000;++i)
+            d.emplace_back(data::string{"dataset version "+std::to_string(v)});
+        cista::buf mm{cista::mmap{paths[v]}};
+        cista::serialize(mm,d);
+    }
+
+    using dataset_t=cista::offset::dataset<data::vector<data::string>>;
+    dataset_t ds{paths[0],cista::mmap::hint::RANDOM};
+    std::atomic<bool> stop{false};
+    std::atomic<int> bad{0};
+    std::vector<std::thread> readers;
+    for(int t=0;t<4;++t)
+        readers.emplace_back([&]{
+            while(!stop.load()){
+                auto const r=ds.read();
+                auto const first=(*r)[0].view();
+                for(auto const & s:*r)
+                    if(s.view()!=first)
+                        ++bad;
+            }
+        });
+    for(int i=1;i<=20;++i)
+        ds.reload(paths[i%2]);
+    stop=true;
+    for(auto & r:readers)
+        r.join();
+    CHECK_EQ(bad.load(),0);
+    CHECK_EQ(ds.generation(),21u);
+    CHECK(ds.read()->at(0).view()=="dataset version 0");
+
+    //坏文件: 抛异常,旧版本继续可用
+    {
+        std::FILE * f=std::fopen(paths[1],"wb");
+        std::fputs("not a cista buffer",f);
+        std::fclose(f);
+    }
+    bool thrown=false;
+    try{
+        ds.reload(paths[1]);
+    }catch(std::exception const &){
+        thrown=true;
+    }
+    CHECK(thrown);
+    CHECK_EQ(ds.generation(),21u);
+    CHECK(ds.read()->at(1999).view()=="dataset version 0");
+    std::remove(paths[0]);
+    std::remove(paths[1]);
+}
+
+TEST_CASE("append to serialized file")
+{
+    //追加写: 只在文件末尾写新对象并原地修改偏移量,结果应当和重新序列化一致
+    constexpr auto MODE=cista::mode::WITH_INTEGRITY|cista::mode::DEEP_CHECK;
+    char const * path="test_cista_append.bin";
+    {
+        Graph g;
+        for(int i=0;i<100;++i)
+            g.nodes.emplace_back(Node{i,data::string{"node number "+std::to_string(i)},{i},nullptr,nullptr});
+        g.labels[1]=data::string{"a label that does not fit into sso"};
+        cista::buf mm{cista::mmap{path}};
+        cista::serialize<MODE>(mm,g);
+    }
+
+    std::size_t size_before=0;
+    {
+        data::appender<Graph,MODE> a{path};
+        size_before=a.size();
+        //先预留容量,后面 push_back 不再搬动节点,指向节点的指针一直有效
+        a.reserve(a.root().nodes,150);
+        for(int i=0;i<50;++i){
+            Node n;
+            n.id=1000+i;
+            n.name="appended node with a long name "+std::to_string(i);
+            n.edges={i,i+1,i+2};
+            n.extra=data::make_unique<int>(i);
+            //指向文件中已有的节点
+            n.next=&a.root().nodes[static_cast<std::size_t>(i)];
+            a.push_back(a.root().nodes,n);
+            a.push_back(a.root().nodes[0].edges,i);
+        }
+        for(int i=0;i<200;++i)
+            CHECK(a.insert(a.root().labels,{1000+i,data::string{"label "+std::to_string(i)}}));
+        CHECK_FALSE(a.insert(a.root().labels,{1000,data::string{"dup"}}));
+        CHECK(a.dead_bytes()>0);
+        CHECK(a.size()>size_before);
+    }
+
+    //重新打开: 完整校验(包括校验和)
+    auto check=[&](auto && b){
+        auto const g=cista::deserialize<Graph,MODE>(b);
+        REQUIRE(g->nodes.size()==150u);
+        auto const & n=g->nodes[120];
+        CHECK_EQ(n.id,1020);
+        CHECK(n.name=="appended node with a long name 20");
+        CHECK_EQ(n.edges.size(),3u);
+        CHECK_EQ(*n.extra,20);
+        CHECK_EQ(n.next->id,g->nodes[20].id);
+        CHECK_EQ(g->nodes[0].edges.size(),51u);
+        CHECK_EQ(g->nodes[0].edges.back(),49);
+        CHECK(g->labels.at(1199)=="label 199");
+        CHECK(g->labels.at(1000)=="label 0");
+        CHECK(g->labels.at(1)=="a label that does not fit into sso");
+    };
+    check(cista::file{path,"r"}.content());
+
+    //压缩: 去掉死空间后内容不变
+    std::size_t size_appended=0;
+    {
+        data::appender<Graph,MODE> a{path};
+        size_appended=a.size();
+        a.compact();
+        CHECK_EQ(a.dead_bytes(),0u);
+        CHECK(a.size()<size_appended);
+    }
+    check(cista::file{path,"r"}.content());
+    std::remove(path);
+}
+
+TEST_CASE("append an element that lives in the file")
+{
+    //追加的元素本身就在文件里: 扩容会重新映射文件,元素得先拷出来
+    char const * path="test_cista_append_alias.bin";
+    {
+        data::vector<data::string> v;
+        v.emplace_back("a string that is long enough to live outside of sso");
+        cista::buf mm{cista::mmap{path}};
+        cista::serialize(mm,v);
+    }
+    {
+        data::appender<data::vector<data::string>> a{path};
+        for(int i=0;i<64;++i)
+            a.push_back(a.root(),a.root()[0]);
+    }
+    {
+        auto f=cista::file{path,"r"}.content();
+        auto const v=cista::deserialize<data::vector<data::string>>(f);
+        REQUIRE(v->size()==65u);
+        for(auto const & s:*v)
+            CHECK(s=="a string that is long enough to live outside of sso");
+    }
+    std::remove(path);
+
+    //两个 map 都在文件里,把第一个的条目逐个插入第二个
+    using map_t=data::hash_map<data::string,data::string>;
+    {
+        data::vector<map_t> maps(2);
+        for(int i=0;i<64;++i)
+            maps[0][data::string{"a key that does not fit into sso "+std::to_string(i)}]=data::string{"a value that does not fit into sso"};
+        cista::buf mm{cista::mmap{path}};
+        cista::serialize(mm,maps);
+    }
+    {
+        data::appender<data::vector<map_t>> a{path};
+        for(int i=0;i<64;++i){
+            auto const key=data::string{"a key that does not fit into sso "+std::to_string(i)};
+            auto & e=*a.root()[0].find(key);
+            CHECK(a.insert(a.root()[1],e));
+        }
+        CHECK_FALSE(a.insert(a.root()[1],*a.root()[0].begin()));
+    }
+    {
+        auto f=cista::file{path,"r"}.content();
+        auto const maps=cista::deserialize<data::vector<map_t>>(f);
+        REQUIRE(maps->size()==2u);
+        REQUIRE((*maps)[1].size()==64u);
+        for(auto const & [k,v]:(*maps)[0])
+            CHECK((*maps)[1].at(k)==v);
+    }
+    std::remove(path);
+}
+
+TEST_CASE("vecvec stores small vectors compactly")
+{
+    //大量很小的向量: vecvec 每个桶只多 4 字节索引, vector<vector> 每个都有完整的头
+    data::vecvec<int> vv;
+    data::vector<data::vector<int>> nested;
+    for(int i=0;i<10000;++i){
+        std::vector<int> v(static_cast<std::size_t>(i%4),i);
+        vv.emplace_back(v);
+        nested.emplace_back(data::vector<int>(v.begin(),v.end()));
+    }
+    vv.emplace_back({});
+    nested.emplace_back(data::vector<int>{});
+    CHECK_EQ(vv.size(),10001u);
+    CHECK(vv.back().empty());
+
+    auto b=cista::serialize<cista::mode::WITH_INTEGRITY>(vv);
+    auto const nested_size=cista::serialize(nested).size();
+    CHECK(b.size()*2<nested_size);
+
+    auto const p=cista::deserialize<data::vecvec<int>,cista::mode::WITH_INTEGRITY|cista::mode::DEEP_CHECK>(b);
+    REQUIRE(p->size()==10001u);
+    auto i=0u;
+    for(auto const bucket:*p){
+        auto const & expected=nested[i];
+        REQUIRE(bucket.size()==expected.size());
+        CHECK(std::equal(bucket.begin(),bucket.end(),expected.begin()));
+        ++i;
+    }
+    CHECK_EQ(i,10001u);
+    CHECK_EQ(p->at(7).size(),3u);
+    CHECK_EQ(p->at(7)[2],7);
+
+    //索引越界: 最后一个桶的结束位置不等于数据长度
+    auto bad=cista::serialize(vv);
+    auto const q=cista::deserialize<data::vecvec<int>>(bad);
+    const_cast<data::vecvec<int> *>(q)->bucket_starts_[5000]=99999999u;
+    bool thrown=false;
+    try{
+        cista::deserialize<data::vecvec<int>>(bad);
+    }catch(std::exception const &){
+        thrown=true;
+    }
+    CHECK(thrown);
+}
+
+TEST_CASE("soa columns")
+{
+    //按列存储: 扫描一个字段只读这一列
+    data::soa<Record> s;
+    s.reserve(10000);
+    for(int i=0;i<10000;++i)
+        s.push_back(Record{i,i*0.5,data::string{"record with a long name "+std::to_string(i)}});
+    s[3]=Record{-3,1.5,data::string{"replaced"}};
+    CHECK_EQ(s.size(),10000u);
+
+    auto b=cista::serialize<cista::mode::WITH_INTEGRITY>(s);
+    auto const p=cista::deserialize<data::soa<Record>,cista::mode::WITH_INTEGRITY|cista::mode::DEEP_CHECK>(b);
+    REQUIRE(p->size()==10000u);
+
+    auto const & prices=p->column<1>();
+    double sum=0;
+    for(std::size_t i=0;i<prices.size();++i)
+        sum+=prices.data()[i];
+    CHECK_EQ(sum,0.5*(9999.0*10000.0/2));
+
+    CHECK_EQ((*p)[42].get<0>(),42);
+    CHECK((*p)[42].get<2>()=="record with a long name 42");
+    auto const r=p->at(3).value();
+    CHECK_EQ(r.id,-3);
+    CHECK(r.name=="replaced");
+    int rows=0;
+    for(auto const row:*p)
+        rows+=row.get<0>()>=0;
+    CHECK_EQ(rows,9999);
+
+    //列长度不一致
+    auto bad=cista::serialize(s);
+    auto const u=cista::deserialize<data::soa<Record>>(bad);
+    --u->column<1>().used_size_;
+    bool thrown=false;
+    try{
+        cista::deserialize<data::soa<Record>>(bad);
+    }catch(std::exception const &){
+        thrown=true;
+    }
+    CHECK(thrown);
+}
+
+TEST_CASE("pointers into vectors resolve in bulk")
+{
+    //指针在向量之前和之后序列化都要能找到: 都放进 pending,最后排序后一起解析
+    struct Holder
+    {
+        data::vector<data::ptr<int>> before;
+        data::vector<data::indexed_vector<int>> vecs;
+        data::vector<data::ptr<int>> after;
+    };
+    Holder h;
+    for(int i=0;i<1000;++i)
+        h.vecs.emplace_back(data::indexed_vector<int>{i*3,i*3+1,i*3+2});
+    for(int i=0;i<3000;++i){
+        auto const p=&h.vecs[static_cast<std::size_t>((i*7)%1000)][static_cast<std::size_t>(i%3)];
+        h.before.push_back(p);
+        h.after.push_back(p);
+    }
+    auto b=cista::serialize(h);
+    auto const p=cista::deserialize<Holder,cista::mode::DEEP_CHECK>(b);
+    for(std::size_t i=0;i<3000;++i){
+        CHECK_EQ(*p->before[i],*h.before[i]);
+        CHECK(p->before[i]==p->after[i]);
+    }
+    CHECK(p->before[2]==&p->vecs[14][2]);
+}
+
+TEST_CASE("json to cista and back")
+{
+    //JSON 直接解析进 cista 类型再序列化; 从反序列化的缓冲区直接输出 JSON
+    std::string const json=R"({"items":[)"
+        R"({"name":"line\nbreak \u00e9 \ud83d\ude00 \"q\"","tag":"plain tag","values":[1,2,3],"extra":7,"counts":{"a":1,"bb":2}},)"
+        R"({"name":"second item with a long name","tag":"t","values":[],"extra":null,"counts":{}}],)"
+        R"("xyz":[4,5,6],"tags":["x","y"]})";
+    auto b=cista::json_to_cista<JsonDoc,cista::mode::WITH_INTEGRITY>(json.data(),json.size());
+    auto const p=cista::deserialize<JsonDoc,cista::mode::WITH_INTEGRITY|cista::mode::DEEP_CHECK>(b);
+    REQUIRE(p->items.size()==2u);
+    auto const & first=p->items[0];
+    CHECK(first.name=="line\nbreak \xc3\xa9 \xf0\x9f\x98\x80 \"q\"");
+    CHECK(first.tag=="plain tag");
+    CHECK_EQ(first.values.size(),3u);
+    CHECK_EQ(*first.extra,7);
+    CHECK_EQ(first.counts.at(data::string{"bb"}),2);
+    CHECK(p->items[1].extra==nullptr);
+    CHECK_EQ(p->xyz[2],6);
+    CHECK(p->tags.find(data::string{"y"})!=p->tags.end());
+
+    //输出再解析,结果一致
+    auto const out=cista::cista_to_json(*p);
+    CHECK(out.find(R"("line\nbreak)")!=std::string::npos);
+    auto b2=cista::json_to_cista<JsonDoc>(out.data(),out.size());
+    auto const q=cista::deserialize<JsonDoc>(b2);
+    CHECK(q->items[0].name==first.name);
+    CHECK(q->items[1].name=="second item with a long name");
+    CHECK_EQ(q->items[0].counts.size(),2u);
+    CHECK_EQ(cista::cista_to_json(*q),out);
+
+    //map 的 key 也要转义,空 key 不能丢
+    std::string const odd_keys=R"({"items":[{"name":"","tag":"","values":[],"extra":null,"counts":{"a\"b":1,"":2}}],"xyz":[0,0,0],"tags":[]})";
+    auto b3=cista::json_to_cista<JsonDoc>(odd_keys.data(),odd_keys.size());
+    auto const odd=cista::cista_to_json(*cista::deserialize<JsonDoc>(b3));
+    CHECK(odd.find(R"("a\"b":1)")!=std::string::npos);
+    CHECK(odd.find(R"("":2)")!=std::string::npos);
+    auto b4=cista::json_to_cista<JsonDoc>(odd.data(),odd.size());
+    auto const r=cista::deserialize<JsonDoc>(b4);
+    REQUIRE(r->items[0].counts.size()==2u);
+    CHECK_EQ(r->items[0].counts.at(data::string{"a\"b"}),1);
+    CHECK_EQ(r->items[0].counts.at(data::string{""}),2);
+
+    //string_view 不能引用带转义的字符串
+    std::string const escaped_tag=R"({"items":[{"name":"","tag":"a\tb","values":[],"extra":null,"counts":{}}],"xyz":[0,0,0],"tags":[]})";
+    bool thrown=false;
+    try{
+        cista::json_to_cista<JsonDoc>(escaped_tag.data(),escaped_tag.size());
+    }catch(std::runtime_error const &){
+        thrown=true;
+    }
+    CHECK(thrown);
+}
+
+TEST_CASE("read older and newer versions through the schema")
+{
+    constexpr auto MODE=cista::mode::WITH_SCHEMA|cista::mode::WITH_VERSION|cista::mode::WITH_INTEGRITY;
+    v1::Item const old_item{42,data::string{"a name longer than the small string buffer"}};
+    auto old_buf=cista::serialize<MODE>(old_item);
+
+    //类型相同走原来的 deserialize
+    CHECK_EQ((cista::deserialize<v1::Item,MODE>(old_buf)->id),42);
+    data::versioned_view<v1::Item,MODE> const same{old_buf};
+    REQUIRE(same.exact()!=nullptr);
+    CHECK_EQ(same.get<0>(),42);
+
+    //新读者读旧数据: 旧字段原地读,新字段用默认值
+    data::versioned_view<v2::Item,MODE> const newer{old_buf};
+    CHECK(newer.exact()==nullptr);
+    CHECK_EQ(newer.get<0>(),42);
+    CHECK(newer.get<1>()==old_item.name);
+    CHECK(newer.get<1>().data()>=reinterpret_cast<char const *>(old_buf.data()));
+    CHECK(newer.get<1>().data()<reinterpret_cast<char const *>(old_buf.data()+old_buf.size()));
+    CHECK_FALSE(newer.has<2>());
+    CHECK(newer.get<2>().empty());
+    CHECK(newer.get<3>()==1.5);
+
+    //旧读者读新数据: 不认识的字段直接忽略
+    v2::Item const new_item{7,data::string{"x"},data::vector<int>{1,2,3},2.5};
+    auto new_buf=cista::serialize<MODE>(new_item);
+    data::versioned_view<v1::Item,MODE> const older{new_buf};
+    CHECK(older.exact()==nullptr);
+    CHECK_EQ(older.get<0>(),7);
+    CHECK(older.get<1>()=="x");
+    CHECK_THROWS(cista::deserialize<v1::Item,MODE>(new_buf));
+
+    //按标签对应: 名字和权重找得到, id 换了类型也换了标签,取默认
+    data::versioned_view<v3::Item,MODE> const tagged{new_buf};
+    CHECK(tagged.get<0>()=="x");
+    CHECK(tagged.get<1>()==2.5);
+    CHECK_FALSE(tagged.has<2>());
+
+    //标签不变但类型变了是错误
+    struct WrongType
+    {
+        long id;
+    };
+    CHECK_THROWS(data::versioned_view<WrongType,MODE>{old_buf});
+
+    //校验和覆盖字段表
+    auto broken=new_buf;
+    broken[broken.size()-20]^=1u;
+    CHECK_THROWS(data::versioned_view<v1::Item,MODE>{broken});
+}
+
+TEST_CASE("compressed vector for cold data")
+{
+    //冷数据压缩存放,热数据照常用普通 vector
+    struct Sample
+    {
+        int32_t sensor;
+        int32_t value;
+        double time;
+    };
+    struct Archive
+    {
+        data::vector<int> hot;
+        data::compressed_vector<Sample> cold;
+    };
+    std::vector<Sample> samples;
+    for(int i=0;i<100000;++i)
+        samples.push_back(Sample{i%16,(i/256)%100,(i/16)*0.5});
+    Archive a;
+    a.hot={1,2,3};
+    a.cold.assign(samples,4096u);
+    CHECK_EQ(a.cold.size(),samples.size());
+    CHECK_EQ(a.cold.block_count(),25u);
+    CHECK(a.cold.compressed_size()*3<samples.size()*sizeof(Sample));
+
+    auto b=cista::serialize(a);
+    auto const p=cista::deserialize<Archive,cista::mode::DEEP_CHECK>(b);
+    CHECK_EQ(p->hot[2],3);
+
+    //容量只够两个块,最早用的块被换出
+    cista::block_cache cache{2u*4096u*sizeof(Sample)};
+    CHECK_EQ(p->cold.at(12345,cache).value,samples[12345].value);
+    CHECK(p->cold.at(12346,cache).time==samples[12346].time);
+    CHECK_EQ(cache.misses(),1u);
+    CHECK_EQ(cache.hits(),1u);
+    auto const pinned=p->cold.block(0,cache);
+    p->cold.at(50000,cache);
+    p->cold.at(90000,cache);
+    CHECK(cache.size()<=2u*4096u*sizeof(Sample));
+    CHECK_EQ(pinned[7].sensor,7);
+
+    std::size_t i=0;
+    bool same=true;
+    for(auto it=p->cold.begin(cache);it!=p->cold.end(cache);++it,++i)
+        same=same&&it->sensor==samples[i].sensor&&it->time==samples[i].time;
+    CHECK(same);
+    CHECK_EQ(i,samples.size());
+    CHECK_THROWS(p->cold.at(samples.size()));
+    cache.clear();
+
+    //同一块内存换成别的数据,默认缓存不能把旧块还回来
+    struct Ints
+    {
+        data::compressed_vector<int> v;
+    };
+    Ints ones,twos;
+    ones.v.assign(std::vector<int>(1000,1));
+    twos.v.assign(std::vector<int>(1000,2));
+    auto reused=cista::serialize(ones);
+    CHECK_EQ(cista::deserialize<Ints>(reused)->v[0],1);
+    auto const other=cista::serialize(twos);
+    REQUIRE(other.size()==reused.size());
+    std::copy(other.begin(),other.end(),reused.begin());
+    CHECK_EQ(cista::deserialize<Ints>(reused)->v[0],2);
+
+    //随机数据压不动也要能还原; 截断的数据要报错
+    std::vector<uint8_t> noise(10000);
+    uint32_t x=1;
+    for(auto & n:noise){
+        x=x*1664525u+1013904223u;
+        n=static_cast<uint8_t>(x>>24);
+    }
+    std::vector<uint8_t> packed;
+    cista::lz::compress(noise.data(),noise.size(),packed);
+    std::vector<uint8_t> unpacked(noise.size());
+    cista::lz::decompress(packed.data(),packed.size(),unpacked.data(),unpacked.size());
+    CHECK(unpacked==noise);
+    CHECK_THROWS(cista::lz::decompress(packed.data(),packed.size()/2,unpacked.data(),unpacked.size()));
+}
+
+TEST_CASE("persistent hash map in a file")
+{
+    //直接在映射的文件里插入,关闭后重新打开数据都在
+    char const * path="test_cista_persistent_map.bin";
+    std::filesystem::remove(path);
+    using map_t=data::persistent_hash_map<data::string,int>;
+    {
+        map_t m{path};
+        for(int i=0;i<5000;++i)
+            CHECK(m.emplace(data::string{"key number "+std::to_string(i)},i));
+        CHECK_FALSE(m.emplace(data::string{"key number 7"},-1));
+        CHECK(m.erase(data::string{"key number 8"}));
+        CHECK_EQ(m.size(),4999u);
+    }
+    {
+        map_t m{path};
+        CHECK_EQ(m.size(),4999u);
+        REQUIRE(m.find(data::string{"key number 4321"})!=nullptr);
+        CHECK_EQ(*m.find(data::string{"key number 4321"}),4321);
+        CHECK(m.find(data::string{"key number 8"})==nullptr);
+        CHECK_EQ(*m.find(data::string{"key number 7"}),7);
+
+        //扩容留下的旧表是死空间,压缩之后文件变小
+        auto const before=std::filesystem::file_size(path);
+        m.compact();
+        CHECK_EQ(m.size(),4999u);
+        CHECK(std::filesystem::file_size(path)<before);
+        CHECK(m.emplace(data::string{"after compact"},1));
+    }
+
+    //模拟进程在插入和扩容中途退出: 计数没更新,没用的表头写了一半
+    {
+        using root_t=map_t::root_t;
+        {
+            cista::mmap f{path,cista::mmap::protection::MODIFY};
+            auto & r=*reinterpret_cast<root_t*>(f.data());
+            CHECK_EQ(r.dirty_,0u);
+            r.dirty_=1u;
+            auto & a=r.maps_[r.active_];
+            --a.size_;
+            ++a.growth_left_;
+            std::memset(static_cast<void *>(&r.maps_[1u-r.active_]),0xAB,sizeof(map_t::map_t));
+        }
+        map_t m{path};
+        CHECK_EQ(m.size(),5000u);
+        CHECK_EQ(*m.find(data::string{"after compact"}),1);
+        for(int i=5000;i<20000;++i)
+            m.emplace(data::string{"key number "+std::to_string(i)},i);
+        CHECK_EQ(*m.find(data::string{"key number 19999"}),19999);
+        CHECK(m.dead_bytes()>0u);
+    }
+    {
+        map_t m{path};
+        CHECK_EQ(m.size(),20000u);
+
+        //删除只改控制字节,条目本身不动,任何时刻退出都不会留下有标记却被清空的 key
+        data::string const key{"key number 12345"};
+        auto const * e=&*m.map().find(key);
+        std::vector<unsigned char> before(sizeof(*e));
+        std::memcpy(before.data(),static_cast<void const *>(e),sizeof(*e));
+        CHECK(m.erase(key));
+        CHECK_EQ(std::memcmp(before.data(),static_cast<void const *>(e),sizeof(*e)),0);
+
+        //文件还开着就复制一份,相当于进程刚删完就退出
+        char const * crashed="test_cista_persistent_map_crashed.bin";
+        std::filesystem::copy_file(path,crashed,std::filesystem::copy_options::overwrite_existing);
+        {
+            map_t c{crashed};
+            CHECK_EQ(c.size(),19999u);
+            CHECK(c.find(key)==nullptr);
+            CHECK_EQ(*c.find(data::string{"key number 12346"}),12346);
+        }
+        std::filesystem::remove(crashed);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("string keys compare and hash in blocks")
+{
+    //各种长度都走一遍,包括 16 字节边界两侧和只差最后一个字节的情况
+    for(std::size_t n=0;n<70;++n){
+        std::string a(n,'x');
+        for(std::size_t i=0;i<n;++i)
+            a[i]=static_cast<char>('a'+(i*7)%26);
+        CHECK(cista::string_equal(a,a));
+        for(std::size_t i=0;i<n;++i){
+            auto b=a;
+            b[i]^=1;
+            CHECK_FALSE(cista::string_equal(a,b));
+        }
+        CHECK_FALSE(cista::string_equal(a,a+"!"));
+    }
+
+    //不同的字符串类型哈希值一致,可以混用查找
+    data::hash_map<data::string,int> m;
+    data::hash_map<data::hashed_string,int> hm;
+    for(int i=0;i<1000;++i){
+        auto const key="a key that is long enough for the heap "+std::to_string(i);
+        m[data::string{key}]=i;
+        hm[data::hashed_string{key}]=i;
+    }
+    std::string const k="a key that is long enough for the heap 512";
+    CHECK_EQ(m.at(std::string_view{k}),512);
+    CHECK_EQ(m.at(k.c_str()),512);
+    CHECK_EQ(hm.at(data::hashed_string{k}),512);
+    CHECK_EQ(hm.at(std::string_view{k}),512);
+    CHECK(hm.find(std::string_view{"missing"})==hm.end());
+    CHECK_EQ(hm.at(k.c_str()),512);
+    CHECK_EQ(data::hashed_string{k}.hash(),cista::string_hash(k));
+    //普通字符串 key 还是原来的哈希,已有的文件照样能查到
+    CHECK_EQ(cista::hashing<data::string>{}(data::string{k}),cista::hash(k));
+
+    //序列化后哈希值跟着存下来
+    auto b=cista::serialize(hm);
+    auto const p=cista::deserialize<data::hash_map<data::hashed_string,int>,cista::mode::DEEP_CHECK>(b);
+    CHECK_EQ(p->at(std::string_view{k}),512);
+    CHECK_EQ(p->size(),1000u);
+}
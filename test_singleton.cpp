@@ -0,0 +1,202 @@
+#include<algorithm>
+#include<atomic>
+#include<chrono>
+#include<cstdint>
+#include<cstdio>
+#include<cstdlib>
+#include<mutex>
+#include<string>
+#include<thread>
+#include<vector>
+
+#include<sys/wait.h>
+#include<unistd.h>
+
+#include"doctest/doctest.h"
+
+#include"Singleton.h"
+
+using namespace Loki;
+
+namespace {
+std::atomic<int> constructed{0};
+
+struct Slow
+{
+    int value=0;
+    Slow()
+    {
+        ++constructed;
+        //拉长构造时间,让其他线程有机会看到未完成的对象
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        value=42;
+    }
+};
+}
+
+TEST_CASE("concurrent first Instance constructs once")
+{
+    typedef SingletonHolder<Slow,CreateUsingNew,DefaultLifetime,ClassLevelLockable> Holder;
+    std::vector<std::thread> threads;
+    std::atomic<int> bad{0};
+    for(int i=0;i<8;i++)
+        threads.emplace_back([&]{
+            if(Holder::Instance().value!=42)
+                ++bad;
+        });
+    for(auto & t:threads)
+        t.join();
+    CHECK(constructed==1);
+    CHECK(bad==0);
+    CHECK(&Holder::Instance()==&Holder::Instance());
+}
+
+namespace {
+struct Counter
+{
+    std::atomic<long> hits{0};
+};
+
+long sum_hits(long total,const Counter & c)
+{
+    return total+c.hits.load(std::memory_order_relaxed);
+}
+}
+
+TEST_CASE("sharded and thread local holders aggregate on read")
+{
+    typedef ShardedSingletonHolder<Counter> Sharded;
+    typedef ThreadLocalSingletonHolder<Counter> PerThread;
+    std::atomic<int> ready{0};
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    for(int i=0;i<4;i++)
+        threads.emplace_back([&]{
+            for(int j=0;j<1000;j++){
+                Sharded::Instance().hits.fetch_add(1,std::memory_order_relaxed);
+                PerThread::Instance().hits.fetch_add(1,std::memory_order_relaxed);
+            }
+            ++ready;
+            //线程退出前它的实例还在注册表里
+            while(!stop)
+                std::this_thread::yield();
+        });
+    while(ready!=4)
+        std::this_thread::yield();
+    CHECK(Sharded::Accumulate(0L,sum_hits)==4000);
+    CHECK(PerThread::Accumulate(0L,sum_hits)==4000);
+    stop=true;
+    for(auto & t:threads)
+        t.join();
+    CHECK(Sharded::Accumulate(0L,sum_hits)==4000);
+    CHECK(PerThread::Accumulate(0L,sum_hits)==0);
+}
+
+namespace {
+std::mutex log_mutex;
+std::vector<std::string> events;
+//子进程退出时析构的顺序写到这里
+int exit_log_fd=-1;
+
+void log_event(const std::string & e)
+{
+    std::lock_guard g{log_mutex};
+    events.push_back(e);
+    if(exit_log_fd>=0){
+        const std::string line=e+"\n";
+        if(write(exit_log_fd,line.data(),line.size())<0)
+            std::_Exit(2);
+    }
+}
+
+template<int N>
+struct Named
+{
+    Named(){log_event("make "+std::to_string(N));}
+    ~Named(){log_event("kill "+std::to_string(N));}
+};
+
+typedef SingletonHolder<Named<1>,CreateUsingNew,DefaultLifetime> First;
+typedef SingletonHolder<Named<2>,CreateUsingNew,DefaultLifetime> Second;
+typedef SingletonHolder<Named<3>,CreateUsingNew,DefaultLifetime> Third;
+EagerSingleton<Third> third("third",{"first","second"});
+EagerSingleton<First> first("first");
+EagerSingleton<Second> second("second",{"first"});
+
+std::ptrdiff_t position(const std::string & e)
+{
+    return std::find(events.begin(),events.end(),e)-events.begin();
+}
+}
+
+TEST_CASE("eager singletons start in dependency order")
+{
+    SingletonStartup::InitializeAll(4);
+    CHECK(events.size()==3);
+    CHECK(position("make 1")<position("make 2"));
+    CHECK(position("make 2")<position("make 3"));
+    //再次调用不会重复构造
+    SingletonStartup::InitializeAll();
+    CHECK(events.size()==3);
+}
+
+TEST_CASE("arena singletons get their own cache lines")
+{
+    typedef SingletonHolder<Counter,CreateInArena,NoDestroy> A;
+    typedef SingletonHolder<Named<4>,CreateInArena,NoDestroy> B;
+    auto a=reinterpret_cast<std::uintptr_t>(&A::Instance());
+    auto b=reinterpret_cast<std::uintptr_t>(&B::Instance());
+    CHECK(a%LOKI_CACHE_LINE_SIZE==0);
+    CHECK(b%LOKI_CACHE_LINE_SIZE==0);
+    CHECK(a!=b);
+    CHECK(SingletonArena::Used()>=2*LOKI_CACHE_LINE_SIZE);
+}
+
+namespace {
+template<int N>
+struct Long : Named<N> {};
+
+template<int N>
+unsigned int GetLongevity(Long<N> *){return N;}
+}
+
+TEST_CASE("singletons die in longevity and dependency order")
+{
+    //析构发生在进程退出时,只能在子进程里看
+    int fds[2];
+    REQUIRE(pipe(fds)==0);
+    std::fflush(nullptr);
+    const pid_t pid=fork();
+    REQUIRE(pid>=0);
+    if(pid==0){
+        close(fds[0]);
+        SingletonStartup::InitializeAll();
+        //创建顺序和寿命顺序不一致,按 atexit 的后进先出会是 20,10,30
+        SingletonHolder<Long<30>,CreateUsingNew,SingletonWithLongevity>::Instance();
+        SingletonHolder<Long<10>,CreateUsingNew,SingletonWithLongevity>::Instance();
+        SingletonHolder<Long<20>,CreateUsingNew,SingletonWithLongevity>::Instance();
+        exit_log_fd=fds[1];
+        std::exit(0);
+    }
+    close(fds[1]);
+    std::string out;
+    char buf[256];
+    for(ssize_t n;(n=read(fds[0],buf,sizeof buf))>0;)
+        out.append(buf,static_cast<std::size_t>(n));
+    close(fds[0]);
+    int status=0;
+    waitpid(pid,&status,0);
+    CHECK(WIFEXITED(status));
+    CHECK(WEXITSTATUS(status)==0);
+
+    auto const at=[&](const char * e){return ("\n"+out).find("\n"+std::string(e)+"\n");};
+    REQUIRE(at("kill 10")!=std::string::npos);
+    REQUIRE(at("kill 20")!=std::string::npos);
+    REQUIRE(at("kill 30")!=std::string::npos);
+    CHECK(at("kill 10")<at("kill 20"));
+    CHECK(at("kill 20")<at("kill 30"));
+    //被依赖的 eager 单例活得更久
+    REQUIRE(at("kill 1")!=std::string::npos);
+    CHECK(at("kill 3")<at("kill 2"));
+    CHECK(at("kill 2")<at("kill 1"));
+}